@@ -6,10 +6,11 @@
 #include <stddef.h>
 
 #define NAN_BOXING
+// #define COMPRESSED_HEAP
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
-#define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_NO_SLAB
 
 #define UNUSED(val) (void)(val)
 #define UINT24_COUNT ((size_t)1 << 12)
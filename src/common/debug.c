@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "../core/vm.h"
 
 void disassemble_chunk(Chunk* chunk, const char* name){
     printf("=== %s ===\n", name);
@@ -23,13 +24,45 @@ static size_t constant_instruction(const char* name, Chunk* chunk, size_t offset
     return offset+2;
 }
 
+static void print_cache(Chunk* chunk, size_t offset){
+    size_t index = chunk->code[offset] |
+                   chunk->code[offset+1] << 8 |
+                   chunk->code[offset+2] << 16;
+    InlineCache* cache = &chunk->caches[index];
+    printf(" ic %zu (%d-way, %u hits, %u misses)", index, cache->count, cache->hits, cache->misses);
+}
+
 static size_t invoke_instruction(const char* name, Chunk* chunk, size_t offset){
     uint8_t constant = chunk->code[offset+1];
     uint8_t arg_count = chunk->code[offset+2];
     printf("%-16s (%d args) %4d '", name, arg_count, constant);
     print_value(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset+3;
+    printf("'");
+    print_cache(chunk, offset+3);
+    printf("\n");
+    return offset+6;
+}
+
+static size_t property_instruction(const char* name, Chunk* chunk, size_t offset){
+    uint8_t constant = chunk->code[offset+1];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'");
+    print_cache(chunk, offset+2);
+    printf("\n");
+    return offset+5;
+}
+
+static size_t property_long_instruction(const char* name, Chunk* chunk, size_t offset){
+    size_t constant = chunk->code[offset+1] |
+                      chunk->code[offset+2] << 8 |
+                      chunk->code[offset+3] << 16;
+    printf("%-16s %4zu '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'");
+    print_cache(chunk, offset+4);
+    printf("\n");
+    return offset+7;
 }
 
 static size_t constant_long_instruction(const char* name, Chunk* chunk, size_t offset){
@@ -50,6 +83,21 @@ static size_t long_instruction(const char* name, Chunk* chunk, size_t offset){
     return offset+4;
 }
 
+static size_t byte_instruction(const char* name, Chunk* chunk, size_t offset){
+    uint8_t slot = chunk->code[offset+1];
+    printf("%-16s %4d\n", name, slot);
+    return offset+2;
+}
+
+static size_t global_instruction(const char* name, Chunk* chunk, size_t offset, bool is_long){
+    size_t slot = chunk->code[offset+1];
+    if (is_long) slot |= chunk->code[offset+2] << 8 | chunk->code[offset+3] << 16;
+    printf("%-16s %4zu '", name, slot);
+    if (slot < vm->global_names.count) print_value(vm->global_names.values[slot]);
+    printf("'\n");
+    return offset + (is_long ? 4 : 2);
+}
+
 static size_t jump_instruction(const char* name, int sign, Chunk* chunk, size_t offset){
     int jump = chunk->code[offset+1] |
                chunk->code[offset+2] << 8 |
@@ -58,6 +106,22 @@ static size_t jump_instruction(const char* name, int sign, Chunk* chunk, size_t
     return offset+4;
 }
 
+static size_t inc_local_instruction(const char* name, Chunk* chunk, size_t offset){
+    uint8_t slot = chunk->code[offset+1];
+    uint8_t constant = chunk->code[offset+2];
+    printf("%-16s %4d += '", name, slot);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset+3;
+}
+
+static size_t local_pair_instruction(const char* name, Chunk* chunk, size_t offset){
+    uint8_t a = chunk->code[offset+1];
+    uint8_t b = chunk->code[offset+2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset+3;
+}
+
 static size_t closure_instruction(const char* name, Chunk* chunk, size_t constant, size_t offset){
     printf("%-16s %4d ", name, constant);
     print_value(chunk->constants.values[constant]);
@@ -65,13 +129,14 @@ static size_t closure_instruction(const char* name, Chunk* chunk, size_t constan
     ObjFunction* fn = AS_FUNCTION(chunk->constants.values[constant]);
     // printf("\tsizeof upvalues: %d \n", fn->upvalue_count);
     for (size_t i = 0; i < fn->upvalue_count; i++){
-        int is_local = chunk->code[offset++];
-        size_t index = chunk->code[offset] |
-                       chunk->code[offset + 1] << 8 |
-                       chunk->code[offset + 2] << 16;
-        offset += 3;
+        uint8_t flags = chunk->code[offset++];
+        size_t index = chunk->code[offset++];
+        if (flags & UPVALUE_LONG){
+            index |= chunk->code[offset] << 8 | chunk->code[offset + 1] << 16;
+            offset += 2;
+        }
         printf("%04d    |                     %s %d\n", 
-                offset, is_local ? "local" : "upvalue", index);
+                offset, flags & UPVALUE_LOCAL ? "local" : "upvalue", index);
     } 
     return offset;
 }
@@ -109,20 +174,28 @@ size_t disassemble_instruction(Chunk* chunk, size_t offset){
         case OP_PRINT:                      return simple_instruction("OP_PRINT", offset);
         case OP_POP:                        return simple_instruction("OP_POP", offset); 
         case OP_POPN:                       return long_instruction("OP_POPN", chunk, offset);
-        case OP_DEFINE_GLOBAL:              return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset); 
-        case OP_DEFINE_GLOBAL_LONG:         return long_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset); 
-        case OP_GET_GLOBAL:                 return constant_instruction("OP_GET_GLOBAL", chunk, offset); 
-        case OP_GET_GLOBAL_LONG:            return long_instruction("OP_GET_GLOBAL_LONG", chunk, offset);     
-        case OP_SET_GLOBAL:                 return constant_instruction("OP_SET_GLOBAL", chunk, offset); 
-        case OP_SET_GLOBAL_LONG:            return long_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
-        case OP_GET_LOCAL:                  return long_instruction("OP_GET_LOCAL", chunk, offset); 
-        case OP_SET_LOCAL:                  return long_instruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_PROP:                   return constant_instruction("OP_GET_PROP", chunk, offset); 
-        case OP_GET_PROP_LONG:              return long_instruction("OP_GET_PROP_LONG", chunk, offset); 
-        case OP_SET_PROP:                   return constant_instruction("OP_SET_PROP", chunk, offset);
-        case OP_SET_PROP_LONG:              return long_instruction("OP_SET_PROP_LONG", chunk, offset);
-        case OP_GET_UPVALUE:                return long_instruction("OP_GET_UPVALUE", chunk, offset); 
-        case OP_SET_UPVALUE:                return long_instruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_DEFINE_GLOBAL:              return global_instruction("OP_DEFINE_GLOBAL", chunk, offset, false); 
+        case OP_DEFINE_GLOBAL_LONG:         return global_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset, true); 
+        case OP_GET_GLOBAL:                 return global_instruction("OP_GET_GLOBAL", chunk, offset, false); 
+        case OP_GET_GLOBAL_LONG:            return global_instruction("OP_GET_GLOBAL_LONG", chunk, offset, true);     
+        case OP_SET_GLOBAL:                 return global_instruction("OP_SET_GLOBAL", chunk, offset, false); 
+        case OP_SET_GLOBAL_LONG:            return global_instruction("OP_SET_GLOBAL_LONG", chunk, offset, true);
+        case OP_GET_LOCAL:                  return byte_instruction("OP_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:             return long_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_GET_LOCAL_0:                return simple_instruction("OP_GET_LOCAL_0", offset);
+        case OP_GET_LOCAL_1:                return simple_instruction("OP_GET_LOCAL_1", offset);
+        case OP_GET_LOCAL_2:                return simple_instruction("OP_GET_LOCAL_2", offset);
+        case OP_GET_LOCAL_3:                return simple_instruction("OP_GET_LOCAL_3", offset);
+        case OP_SET_LOCAL:                  return byte_instruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_LONG:             return long_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_PROP:                   return property_instruction("OP_GET_PROP", chunk, offset); 
+        case OP_GET_PROP_LONG:              return property_long_instruction("OP_GET_PROP_LONG", chunk, offset); 
+        case OP_SET_PROP:                   return property_instruction("OP_SET_PROP", chunk, offset);
+        case OP_SET_PROP_LONG:              return property_long_instruction("OP_SET_PROP_LONG", chunk, offset);
+        case OP_GET_UPVALUE:                return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_GET_UPVALUE_LONG:           return long_instruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE:                return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE_LONG:           return long_instruction("OP_SET_UPVALUE_LONG", chunk, offset);
         case OP_ARRAY:                      return constant_instruction("OP_ARRAY", chunk, offset); 
         case OP_ARRAY_LONG:                 return long_instruction("OP_ARRAY_LONG", chunk, offset);
         case OP_GET_INDEX:                  return simple_instruction("OP_GET_INDEX", offset);
@@ -130,6 +203,24 @@ size_t disassemble_instruction(Chunk* chunk, size_t offset){
         case OP_JUMP_IF_FALSE:              return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_JUMP:                       return jump_instruction("OP_JUMP", 1, chunk, offset);
         case OP_LOOP:                       return jump_instruction("OP_LOOP", -1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:          return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:          return jump_instruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:              return jump_instruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:           return jump_instruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:     return jump_instruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:        return jump_instruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:  return jump_instruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+        case OP_INC_LOCAL:                  return inc_local_instruction("OP_INC_LOCAL", chunk, offset);
+        case OP_GET_LOCAL2:                 return local_pair_instruction("OP_GET_LOCAL2", chunk, offset);
+        case OP_ADD_NUM:                    return simple_instruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:                    return simple_instruction("OP_ADD_STR", offset);
+        case OP_SUB_NUM:                    return simple_instruction("OP_SUB_NUM", offset);
+        case OP_MUL_NUM:                    return simple_instruction("OP_MUL_NUM", offset);
+        case OP_DIV_NUM:                    return simple_instruction("OP_DIV_NUM", offset);
+        case OP_LESS_NUM:                   return simple_instruction("OP_LESS_NUM", offset);
+        case OP_LESS_EQUAL_NUM:             return simple_instruction("OP_LESS_EQUAL_NUM", offset);
+        case OP_GREATER_NUM:                return simple_instruction("OP_GREATER_NUM", offset);
+        case OP_GREATER_EQUAL_NUM:          return simple_instruction("OP_GREATER_EQUAL_NUM", offset);
         case OP_CALL:                       return constant_instruction("OP_CALL", chunk, offset);
         case OP_CLOSE_UPVALUE:              return simple_instruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLOSURE:{
@@ -156,3 +247,150 @@ size_t disassemble_instruction(Chunk* chunk, size_t offset){
             return offset+1;
     }
 }
+
+
+void print_inline_caches(Chunk* chunk, const char* name){
+    size_t hits = 0, misses = 0;
+    for (size_t i = 0; i < chunk->cache_count; i++){
+        hits += chunk->caches[i].hits;
+        misses += chunk->caches[i].misses;
+    }
+    printf("=== inline caches %s: %zu sites, %zu hits, %zu misses ===\n", name, chunk->cache_count, hits, misses);
+    for (size_t i = 0; i < chunk->cache_count; i++){
+        InlineCache* cache = &chunk->caches[i];
+        printf("  ic %4zu %d-way %10u hits %10u misses\n", i, cache->count, cache->hits, cache->misses);
+    }
+}
+
+static const char* reg_names[] = {
+    [REG_MOVE]                      = "REG_MOVE",
+    [REG_GET_GLOBAL]                = "REG_GET_GLOBAL",
+    [REG_SET_GLOBAL]                = "REG_SET_GLOBAL",
+    [REG_DEFINE_GLOBAL]             = "REG_DEFINE_GLOBAL",
+    [REG_ADD]                       = "REG_ADD",
+    [REG_SUB]                       = "REG_SUB",
+    [REG_MUL]                       = "REG_MUL",
+    [REG_DIV]                       = "REG_DIV",
+    [REG_MOD]                       = "REG_MOD",
+    [REG_EQUAL]                     = "REG_EQUAL",
+    [REG_NOT_EQUAL]                 = "REG_NOT_EQUAL",
+    [REG_LESS]                      = "REG_LESS",
+    [REG_LESS_EQUAL]                = "REG_LESS_EQUAL",
+    [REG_GREATER]                   = "REG_GREATER",
+    [REG_GREATER_EQUAL]             = "REG_GREATER_EQUAL",
+    [REG_NOT]                       = "REG_NOT",
+    [REG_NEGATE]                    = "REG_NEGATE",
+    [REG_PRINT]                     = "REG_PRINT",
+    [REG_JUMP]                      = "REG_JUMP",
+    [REG_JUMP_IF_FALSE]             = "REG_JUMP_IF_FALSE",
+    [REG_JUMP_IF_NOT_EQUAL]         = "REG_JUMP_IF_NOT_EQUAL",
+    [REG_JUMP_IF_EQUAL]             = "REG_JUMP_IF_EQUAL",
+    [REG_JUMP_IF_NOT_LESS]          = "REG_JUMP_IF_NOT_LESS",
+    [REG_JUMP_IF_NOT_LESS_EQUAL]    = "REG_JUMP_IF_NOT_LESS_EQUAL",
+    [REG_JUMP_IF_NOT_GREATER]       = "REG_JUMP_IF_NOT_GREATER",
+    [REG_JUMP_IF_NOT_GREATER_EQUAL] = "REG_JUMP_IF_NOT_GREATER_EQUAL",
+    [REG_GET_UPVALUE]               = "REG_GET_UPVALUE",
+    [REG_SET_UPVALUE]               = "REG_SET_UPVALUE",
+    [REG_CLOSURE]                   = "REG_CLOSURE",
+    [REG_CLOSE_UPVALUE]             = "REG_CLOSE_UPVALUE",
+    [REG_CALL]                      = "REG_CALL",
+    [REG_RETURN]                    = "REG_RETURN",
+};
+
+static void print_operand(ObjFunction* function, uint16_t operand){
+    if (operand & RK_CONSTANT){
+        printf(" k%d '", operand & RK_MAX);
+        print_value(function->chunk.constants.values[operand & RK_MAX]);
+        printf("'");
+    } else {
+        printf(" r%d", operand);
+    }
+}
+
+static void print_global(uint16_t low, uint16_t high){
+    size_t slot = low | (size_t)high << 16;
+    printf(" g%zu '", slot);
+    if (slot < vm->global_names.count) print_value(vm->global_names.values[slot]);
+    printf("'");
+}
+
+size_t disassemble_reg_instruction(ObjFunction* function, size_t index){
+    RegChunk* reg = function->reg;
+    RegInstruction* ins = &reg->code[index];
+    printf("%04zu ", index);
+    if (index > 0 && reg->lines[index] == reg->lines[index-1]){
+        printf("   | ");
+    } else {
+        printf("%4zu ", reg->lines[index]);
+    }
+    printf("%-29s", reg_names[ins->op]);
+    switch (ins->op){
+        case REG_MOVE: case REG_NOT: case REG_NEGATE:
+            printf(" r%d", ins->a);
+            print_operand(function, ins->b);
+            break;
+        case REG_GET_GLOBAL:
+            printf(" r%d", ins->a);
+            print_global(ins->b, ins->c);
+            break;
+        case REG_SET_GLOBAL: case REG_DEFINE_GLOBAL:
+            print_global(ins->b, ins->c);
+            print_operand(function, ins->a);
+            break;
+        case REG_PRINT: case REG_RETURN:
+            print_operand(function, ins->a);
+            break;
+        case REG_JUMP:
+            printf(" -> %d", ins->a);
+            break;
+        case REG_JUMP_IF_FALSE:
+            print_operand(function, ins->b);
+            printf(" -> %d", ins->a);
+            break;
+        case REG_JUMP_IF_NOT_EQUAL: case REG_JUMP_IF_EQUAL:
+        case REG_JUMP_IF_NOT_LESS: case REG_JUMP_IF_NOT_LESS_EQUAL:
+        case REG_JUMP_IF_NOT_GREATER: case REG_JUMP_IF_NOT_GREATER_EQUAL:
+            print_operand(function, ins->b);
+            print_operand(function, ins->c);
+            printf(" -> %d", ins->a);
+            break;
+        case REG_CALL:
+            printf(" r%d (%d args)", ins->a, ins->b);
+            break;
+        case REG_GET_UPVALUE:
+            printf(" r%d u%d", ins->a, ins->b);
+            break;
+        case REG_SET_UPVALUE:
+            printf(" u%d", ins->b);
+            print_operand(function, ins->a);
+            break;
+        case REG_CLOSE_UPVALUE:
+            printf(" r%d", ins->a);
+            break;
+        case REG_CLOSURE: {
+            printf(" r%d", ins->a);
+            print_operand(function, ins->b | RK_CONSTANT);
+            printf("\n");
+            ObjFunction* closure = AS_FUNCTION(function->chunk.constants.values[ins->b]);
+            for (size_t i = 0; i < closure->upvalue_count; i++){
+                RegInstruction* upvalue = &reg->code[++index];
+                printf("%04zu    |                     %s %d\n", index, upvalue->op ? "local" : "upvalue", upvalue->a);
+            }
+            return index + 1;
+        }
+        default:
+            printf(" r%d", ins->a);
+            print_operand(function, ins->b);
+            print_operand(function, ins->c);
+            break;
+    }
+    printf("\n");
+    return index + 1;
+}
+
+void disassemble_reg_chunk(ObjFunction* function, const char* name){
+    printf("=== %s (registers, frame of %zu) ===\n", name, function->reg->frame_size);
+    for (size_t index = 0; index < function->reg->count;){
+        index = disassemble_reg_instruction(function, index);
+    }
+}
@@ -2,8 +2,12 @@
 #define _DEBUG_H
 
 #include "../core/chunk.h"
+#include "object.h"
 
 void disassemble_chunk(Chunk* chunk, const char* name);
 size_t disassemble_instruction(Chunk* chunk, size_t offset);
+void print_inline_caches(Chunk* chunk, const char* name);
+void disassemble_reg_chunk(ObjFunction* function, const char* name);
+size_t disassemble_reg_instruction(ObjFunction* function, size_t index);
 
 #endif //_DEBUG_H
@@ -17,6 +17,23 @@ static uint32_t hash_string(const char* key, size_t length){
     return hash;
 }
 
+const char* obj_type_name(ObjType type){
+    switch (type){
+        case OBJ_STRING: return "string";
+        case OBJ_ARRAY: return "array";
+        case OBJ_FUNCTION: return "function";
+        case OBJ_NATIVE: return "native";
+        case OBJ_CLOSURE: return "closure";
+        case OBJ_UPVALUE: return "upvalue";
+        case OBJ_CLASS: return "class";
+        case OBJ_INSTANCE: return "instance";
+        case OBJ_BOUND_METHOD: return "bound_method";
+        case OBJ_SHAPE: return "shape";
+        case OBJ_FIBER: return "fiber";
+        default: return "";
+    }
+}
+
 #ifdef DEBUG_LOG_GC
 const char* obj_type_tostring(ObjType type){
     switch (type){
@@ -28,55 +45,56 @@ const char* obj_type_tostring(ObjType type){
         case OBJ_UPVALUE: return "OBJ_UPVALUE"; 
         case OBJ_CLASS: return "OBJ_CLASS"; 
         case OBJ_INSTANCE: return "OBJ_INSTANCE";
+        case OBJ_BOUND_METHOD: return "OBJ_BOUND_METHOD";
+        case OBJ_SHAPE: return "OBJ_SHAPE";
+        case OBJ_FIBER: return "OBJ_FIBER";
         default: return "";
     }
 }
 #endif //DEBUG_LOG_GC
 
 static Obj* alloc_obj(size_t size, ObjType type){
-    Obj* object  = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
-    object->next = vm.objects;
-    object->is_marked = false;
-    vm.objects = object;
+    Obj* object = allocate_object(size, type);
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %d bytes for type '%s'\n", (void*)object, size, obj_type_tostring(type));
 #endif //DEBUG_LOG_GC
     return object;
 }
 
-extern Parser parser;
+extern __thread Parser parser;
 
-static ObjString* allocate_string(char* chars, size_t length, uint32_t hash){
-    ObjString* string = (ObjString*)alloc_obj(sizeof(ObjString) + sizeof(char) * length + 1, OBJ_STRING);
+static ObjString* allocate_string(const char* chars, size_t length, uint32_t hash){
+    ObjString* string = (ObjString*)alloc_obj(sizeof(ObjString) + sizeof(char) * (length + 1), OBJ_STRING);
     string->length = length;
-    strncpy(string->chars, chars, length);
+    memcpy(string->chars, chars, length);
     string->chars[length] = '\0';
     string->hash = hash;
     push(OBJ_VAL(string)); // push string on stack so GC doesn't clean
-    table_set(&vm.strings, string, NIL_VAL);
+    table_set(&vm->strings, string, NIL_VAL);
     pop(); // pop string from stack
     return string;
 }
 
+// the string table is weak, a string found there while the collector is marking
+// may not have been reached yet and must not be freed once the program uses it again
+static ObjString* shade_interned(ObjString* string){
+    if (vm->gc_phase == GC_MARKING) mark_object((Obj*)string);
+    return string;
+}
+
 ObjString* copy_string(const char* chars, size_t length){
     uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
-    char* heap_chars = ALLOCATE(char, length+1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
+    if (interned != NULL) return shade_interned(interned);
+    return allocate_string(chars, length, hash);
 }
 
 ObjString* take_string(char* chars, size_t length){
     uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length);
-        return interned;
-    }
-    return allocate_string(chars, length, hash);
+    ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
+    ObjString* string = interned != NULL ? shade_interned(interned) : allocate_string(chars, length, hash);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
 }
 
 ObjArray* take_array(){
@@ -90,6 +108,10 @@ ObjFunction* new_function(){
     func->arity = 0;
     func->upvalue_count = 0;
     func->name = NULL;
+    func->reg = NULL;
+    func->jit = NULL;
+    func->calls = 0;
+    func->stack_size = 0;
     init_chunk(&func->chunk);
     return func;
 }
@@ -102,8 +124,8 @@ ObjNative* new_native(NativeFn function, size_t arity){
 }
 
 ObjClosure* new_closure(ObjFunction* function){
-    ObjUpvalue** upvalues = (ObjUpvalue**)reallocate(NULL, 0, sizeof(ObjUpvalue*) * function->upvalue_count);
-    for (size_t i = 0; i < function->upvalue_count; i++) upvalues[i] = NULL;
+    HEAP_REF(ObjUpvalue)* upvalues = ALLOCATE(HEAP_REF(ObjUpvalue), function->upvalue_count);
+    for (size_t i = 0; i < function->upvalue_count; i++) upvalues[i] = NULL_REF;
     ObjClosure* closure = (ObjClosure*)alloc_obj(sizeof(ObjClosure), OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
@@ -119,18 +141,40 @@ ObjUpvalue* new_upvalue(Value* slot){
     return upval;
 }
 
+static ObjShape* new_shape(ObjShape* parent, ObjString* key){
+    ObjShape* shape = (ObjShape*)alloc_obj(sizeof(ObjShape), OBJ_SHAPE);
+    shape->parent = parent;
+    shape->key = key;
+    shape->slot = parent == NULL ? 0 : parent->field_count;
+    shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+    init_table(&shape->transitions);
+    init_table(&shape->index);
+    shape->indexed = NULL;
+    return shape;
+}
+
 ObjClass* new_class(ObjString* name){
     ObjClass* class_obj = (ObjClass*)alloc_obj(sizeof(ObjClass), OBJ_CLASS);
     class_obj->name = name;
     class_obj->init = NULL;
+    class_obj->shape = NULL;
+    class_obj->field_hint = 0;
     init_table(&class_obj->methods);
+    push(OBJ_VAL(class_obj));
+    class_obj->shape = new_shape(NULL, NULL);
+    WRITE_BARRIER_OBJ(class_obj, class_obj->shape);
+    pop();
     return class_obj;
 }
 
 ObjInstance* new_instance(ObjClass* instance_of){
-    ObjInstance* instance = (ObjInstance*)alloc_obj(sizeof(ObjInstance), OBJ_INSTANCE);
-    instance->instance_of = instance_of;
-    init_table(&instance->fields);
+    uint32_t inline_cap = instance_of->field_hint;
+    ObjInstance* instance = (ObjInstance*)alloc_obj(sizeof(ObjInstance) + sizeof(Value) * inline_cap, OBJ_INSTANCE);
+    instance->instance_of = TO_REF(instance_of);
+    instance->shape = TO_REF(instance_of->shape);
+    instance->fields = instance->inline_fields;
+    instance->field_cap = inline_cap;
+    instance->inline_cap = inline_cap;
     return instance;
 }
 
@@ -141,6 +185,106 @@ ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method){
     return bound;
 }
 
+// the stacks start small and grow like the script's, the function waits in the first slot
+ObjFiber* new_fiber(ObjClosure* function){
+    Value* values = ALLOCATE(Value, FIBER_STACK_INITIAL);
+    CallFrame* frames = ALLOCATE(CallFrame, FIBER_FRAMES_INITIAL);
+    ObjFiber* fiber = (ObjFiber*)alloc_obj(sizeof(ObjFiber), OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->stack = (CallStack){ values, values, FIBER_STACK_INITIAL, frames, 0, FIBER_FRAMES_INITIAL, NULL };
+    *fiber->stack.top++ = OBJ_VAL(function);
+    fiber->caller = NULL;
+    return fiber;
+}
+
+// long chains share a hashed name -> slot index. A child extends the index of its parent when
+// the parent was the last shape to extend it, so the index holds exactly the chain of its deepest
+// sharer and every other sharer sees the slots below its field count. Branches copy their chain
+static void index_shape(ObjShape* shape){
+    ObjShape* parent = shape->parent;
+    ObjShape* owner = parent->indexed;
+    if (owner == NULL || owner->index.count != parent->field_count){
+        owner = shape;
+        for (ObjShape* link = parent; link->key != NULL; link = link->parent){
+            table_set(&owner->index, link->key, NUM_VAL(link->slot));
+            WRITE_BARRIER_OBJ(owner, link->key);
+        }
+    }
+    table_set(&owner->index, shape->key, NUM_VAL(shape->slot));
+    WRITE_BARRIER_OBJ(owner, shape->key);
+    shape->indexed = owner;
+    WRITE_BARRIER_OBJ(shape, owner);
+}
+
+ObjShape* shape_transition(ObjShape* shape, ObjString* key){
+    Value next;
+    if (table_get(&shape->transitions, key, &next)) return AS_SHAPE(next);
+    ObjShape* child = new_shape(shape, key);
+    push(OBJ_VAL(child));
+    table_set(&shape->transitions, key, OBJ_VAL(child));
+    WRITE_BARRIER_OBJ(shape, child);
+    if (child->field_count > SHAPE_LINEAR_MAX) index_shape(child);
+    pop();
+    return child;
+}
+
+bool shape_find(ObjShape* shape, ObjString* key, uint32_t* slot){
+    if (shape->indexed != NULL){
+        Value value;
+        if (!table_get(&shape->indexed->index, key, &value) || AS_NUM(value) >= shape->field_count) return false;
+        *slot = (uint32_t)AS_NUM(value);
+        return true;
+    }
+    for (; shape->key != NULL; shape = shape->parent){
+        if (shape->key == key){
+            *slot = shape->slot;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool instance_get_field(ObjInstance* instance, ObjString* key, Value* value){
+    uint32_t slot;
+    if (!shape_find(INSTANCE_SHAPE(instance), key, &slot)) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+void instance_add_field(ObjInstance* instance, ObjShape* shape, Value value){
+    if (shape->field_count > instance->field_cap){
+        uint32_t old_cap = instance->field_cap;
+        uint32_t cap = GROW_CAP(old_cap);
+        if (instance->fields == instance->inline_fields){
+            Value* fields = ALLOCATE(Value, cap);
+            memcpy(fields, instance->inline_fields, sizeof(Value) * old_cap);
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(Value, instance->fields, old_cap, cap);
+        }
+        instance->field_cap = cap;
+    }
+    instance->fields[shape->slot] = value;
+    instance->shape = TO_REF(shape);
+    WRITE_BARRIER(instance, value);
+    WRITE_BARRIER_OBJ(instance, shape);
+
+    ObjClass* class_obj = INSTANCE_CLASS(instance);
+    if (shape->field_count > class_obj->field_hint && shape->field_count <= INSTANCE_INLINE_MAX){
+        class_obj->field_hint = shape->field_count;
+    }
+}
+
+void instance_set_field(ObjInstance* instance, ObjString* key, Value value){
+    uint32_t slot;
+    if (shape_find(INSTANCE_SHAPE(instance), key, &slot)){
+        instance->fields[slot] = value;
+        WRITE_BARRIER(instance, value);
+        return;
+    }
+    instance_add_field(instance, shape_transition(INSTANCE_SHAPE(instance), key), value);
+}
+
 static void print_function(ObjFunction* fn){
     if (fn->name == NULL) {
         printf("<Script>");
@@ -167,7 +311,9 @@ void print_obj(Value value){
         case OBJ_CLOSURE: print_function(AS_CLOSURE(value)->function); break;
         case OBJ_UPVALUE: printf("Upvalue"); break;
         case OBJ_CLASS: printf("<Class %s>", AS_CLASS(value)->name->chars); break;
-        case OBJ_INSTANCE: printf("<instance of %s>", AS_INSTANCE(value)->instance_of->name->chars); break;
+        case OBJ_INSTANCE: printf("<instance of %s>", INSTANCE_CLASS(AS_INSTANCE(value))->name->chars); break;
         case OBJ_BOUND_METHOD: print_function(AS_BOUND(value)->method->function); break;
+        case OBJ_SHAPE: printf("<shape %u fields>", AS_SHAPE(value)->field_count); break;
+        case OBJ_FIBER: printf("<fiber>"); break;
     }
 }
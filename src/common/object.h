@@ -16,12 +16,17 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_FIBER,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_FIBER + 1)
+
 struct Obj {
     ObjType type;
-    bool is_marked;
-    struct Obj* next;
+    bool is_large;                    // allocated with a LargeObject header instead of from a slab page
+    bool is_old;                      // survived a collection
+    bool is_remembered;               // old object in vm->remembered
 };
 
 struct ObjArray {
@@ -33,6 +38,10 @@ typedef struct {
     Obj obj;
     size_t arity;
     Chunk chunk;
+    RegChunk* reg;          // register code, NULL if the function runs on the stack VM
+    struct JitCode* jit;    // native code, NULL while the function is interpreted
+    uint32_t calls;         // calls so far, counted until the JIT threshold is reached
+    size_t stack_size;      // most stack slots a call uses, 0 until the first call
     size_t upvalue_count;
     ObjString* name;
 } ObjFunction;
@@ -47,23 +56,75 @@ typedef struct ObjUpvalue {
 typedef struct {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
+    HEAP_REF(ObjUpvalue)* upvalues;
     int32_t upvalue_count;
 } ObjClosure;
 
+#define SHAPE_LINEAR_MAX 8
+#define INSTANCE_INLINE_MAX 16
+
+// hidden class shared by all instances that added the same fields in the same order,
+// the root shape of every class is empty and each transition appends one field slot
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* key;             // field added by the transition into this shape
+    uint32_t slot;              // slot of key in the instance field array
+    uint32_t field_count;
+    Table transitions;          // field name -> child shape
+    Table index;                // field name -> slot, for this shape and the descendants sharing it
+    struct ObjShape* indexed;   // shape whose index covers this one, NULL for short chains
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjString* name;
     ObjClosure* init;
     Table methods;
+    ObjShape* shape;            // empty root shape of the instances of this class
+    uint32_t field_hint;        // most fields seen on an instance, used to size new instances
 } ObjClass;
 
 typedef struct {
     Obj obj;
-    ObjClass* instance_of;
-    Table fields;
+    HEAP_REF(ObjClass) instance_of;
+    HEAP_REF(ObjShape) shape;
+    Value* fields;              // points at inline_fields until the instance outgrows them
+    uint32_t field_cap;
+    uint32_t inline_cap;
+    Value inline_fields[];
 } ObjInstance;
 
+typedef enum {
+    FIBER_NEW,                  // its function hasn't been called yet
+    FIBER_SUSPENDED,            // stopped in a call of yield
+    FIBER_WAITING,              // resumed another fiber and waits for it to yield or finish
+    FIBER_BLOCKED,              // waits for a file descriptor to get ready
+    FIBER_RUNNING,
+    FIBER_DONE,
+} FiberState;
+
+struct CallFrame;
+
+// value and call frame stack the VM runs on, while it runs the fields of the VM are the live ones.
+// Both grow as calls need them, which moves them
+typedef struct {
+    Value* values;
+    Value* top;
+    size_t value_cap;
+    struct CallFrame* frames;
+    size_t frame_count;
+    size_t frame_cap;
+    ObjUpvalue* open_upvalues;
+} CallStack;
+
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    CallStack stack;            // saved while the fiber doesn't run
+    struct ObjFiber* caller;    // fiber that resumed this one, NULL if the script did
+} ObjFiber;
+
 typedef NativeResult (*NativeFn)(int arg_count, Value* args);
 
 typedef struct {
@@ -98,6 +159,8 @@ static inline bool is_obj_type(Value value, ObjType type){
 #define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_BOUND(value) is_obj_type(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value) is_obj_type(value, OBJ_SHAPE)
+#define IS_FIBER(value) is_obj_type(value, OBJ_FIBER)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
@@ -109,6 +172,12 @@ static inline bool is_obj_type(Value value, ObjType type){
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+
+#define CLOSURE_UPVALUE(closure, index) FROM_REF(ObjUpvalue, (closure)->upvalues[index])
+#define INSTANCE_CLASS(instance) FROM_REF(ObjClass, (instance)->instance_of)
+#define INSTANCE_SHAPE(instance) FROM_REF(ObjShape, (instance)->shape)
 
 ObjString* copy_string(const char* chars, size_t length);
 ObjString* take_string(char* chars, size_t length);
@@ -121,8 +190,16 @@ ObjClosure* new_closure(ObjFunction* function);
 ObjClass* new_class(ObjString* name);
 ObjInstance* new_instance(ObjClass* instance_of);
 ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method);
+ObjFiber* new_fiber(ObjClosure* function);
+
+ObjShape* shape_transition(ObjShape* shape, ObjString* key);
+bool shape_find(ObjShape* shape, ObjString* key, uint32_t* slot);
+bool instance_get_field(ObjInstance* instance, ObjString* key, Value* value);
+void instance_set_field(ObjInstance* instance, ObjString* key, Value value);
+void instance_add_field(ObjInstance* instance, ObjShape* shape, Value value);
 
 void print_obj(Value value);
+const char* obj_type_name(ObjType type);
 
 #ifdef DEBUG_LOG_GC
 const char* obj_type_tostring(ObjType type);
@@ -20,10 +20,11 @@ void free_table(Table* table){
 
 static Entry* find_entry(Entry* entries, size_t cap, ObjString* key){
     uint32_t index = key->hash & (cap-1);
+    HEAP_REF(ObjString) ref = TO_REF(key);
     Entry* tombstone = NULL;
     while(1){
         Entry* entry = (entries + index);
-        if (entry->key == NULL){
+        if (entry->key == NULL_REF){
             if (IS_NIL(entry->value)){
                 // empty entry
                 return tombstone != NULL ? tombstone : entry;
@@ -31,7 +32,7 @@ static Entry* find_entry(Entry* entries, size_t cap, ObjString* key){
                 // tombstone found
                 if (tombstone == NULL) tombstone = entry;
             }
-        } else if (entry->key == key || entry->key == NULL)
+        } else if (entry->key == ref)
             return entry;
         index = (index+1) & (cap-1);
     }
@@ -40,15 +41,15 @@ static Entry* find_entry(Entry* entries, size_t cap, ObjString* key){
 static void adjust_capacity(Table* table, size_t cap){
     Entry* entries = ALLOCATE(Entry, cap);
     for (size_t i = 0; i < cap; i++){
-        entries[i].key = NULL;
+        entries[i].key = NULL_REF;
         entries[i].value = NIL_VAL;
     }
     table->count = 0;
     // iterate through old entries
     for (size_t i = 0; i < table->cap; i++){
         Entry* entry = table->entries + i;
-        if (entry->key == NULL) continue; // skip unused entries
-        Entry* dest = find_entry(entries, cap, entry->key); // find new entry in new array based on existing key
+        if (entry->key == NULL_REF) continue; // skip unused entries
+        Entry* dest = find_entry(entries, cap, FROM_REF(ObjString, entry->key)); // find new entry in new array based on existing key
         dest->key = entry->key; // copy old to new 
         dest->value = entry->value;
         table->count++;
@@ -63,9 +64,9 @@ bool table_set(Table* table, ObjString* key, Value value){
         adjust_capacity(table, GROW_CAP(table->cap));
     }
     Entry* entry = find_entry(table->entries, table->cap, key);
-    bool is_new_key = entry->key == NULL;
+    bool is_new_key = entry->key == NULL_REF;
     if (is_new_key && IS_NIL(entry->value)) table->count++;
-    entry->key = key;
+    entry->key = TO_REF(key);
     entry->value = value;
     return is_new_key;
 }
@@ -73,7 +74,7 @@ bool table_set(Table* table, ObjString* key, Value value){
 bool table_get(Table* table, ObjString* key, Value* value){
     if (table->count == 0) return false;
     Entry* entry = find_entry(table->entries, table->cap, key);
-    if (entry->key == NULL) return false;
+    if (entry->key == NULL_REF) return false;
     *value = entry->value;
     return true;
 }
@@ -81,8 +82,8 @@ bool table_get(Table* table, ObjString* key, Value* value){
 bool table_delete(Table* table, ObjString* key){
     if (table->count == 0) return false;
     Entry* entry = find_entry(table->entries, table->cap, key);
-    if (entry->key == NULL) return false;
-    entry->key = NULL;
+    if (entry->key == NULL_REF) return false;
+    entry->key = NULL_REF;
     entry->value = BOOL_VAL(true);
     return true;
 }
@@ -90,8 +91,8 @@ bool table_delete(Table* table, ObjString* key){
 void table_add_all(Table* from, Table* to){
     for (size_t i = 0; i < from->cap; i++){
         Entry* entry = from->entries + i;
-        if (entry->key != NULL){
-            table_set(to, entry->key, entry->value);
+        if (entry->key != NULL_REF){
+            table_set(to, FROM_REF(ObjString, entry->key), entry->value);
         }
     }
 }
@@ -99,8 +100,8 @@ void table_add_all(Table* from, Table* to){
 void table_print(Table* table, const char* name){
     printf("=== hashtable %s ===\n", name);
     for (size_t i = 0; i < table->cap; i++){
-        if (table->entries[i].key) {
-            printf("%s -> ", table->entries[i].key->chars);
+        if (table->entries[i].key != NULL_REF) {
+            printf("%s -> ", FROM_REF(ObjString, table->entries[i].key)->chars);
             print_value(table->entries[i].value);
             printf("\n");
         } else printf("(null)\n");
@@ -111,16 +112,18 @@ void table_print(Table* table, const char* name){
 void table_mark(Table* table){
     for (size_t i = 0; i < table->cap; i++){
         Entry* entry = &table->entries[i];
-        mark_object((Obj*)entry->key);
+        mark_object((Obj*)FROM_REF(ObjString, entry->key));
         mark_value(entry->value);
     }
 }
 
-void table_remove_white_marked_obj(Table* table){
+// a minor collection may run while the background sweeper owns the pages of old objects,
+// so it must not read their mark bits
+void table_remove_white_marked_obj(Table* table, bool young_only){
     for (size_t i = 0; i < table->cap; i++){
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked){
-            table_delete(table, entry->key);
+        ObjString* key = FROM_REF(ObjString, table->entries[i].key);
+        if (key != NULL && !(young_only && key->obj.is_old) && !is_marked((Obj*)key)){
+            table_delete(table, key);
         }
     }
 }
@@ -130,13 +133,14 @@ ObjString* table_find_string(Table* table, const char* chars, size_t length, uin
     uint32_t index = hash & (table->cap-1);
     while(1){
         Entry* entry = table->entries + index;
-        if (entry->key == NULL){
+        ObjString* key = FROM_REF(ObjString, entry->key);
+        if (key == NULL){
             if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0)
+        } else if (key->length == length &&
+                   key->hash == hash &&
+                   memcmp(key->chars, chars, length) == 0)
         {
-            return entry->key;
+            return key;
         }
         index = (index+1) & (table->cap-1);
     }
@@ -6,10 +6,16 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+#ifdef COMPRESSED_HEAP
+#pragma pack(push, 4)                 // with a 32 bit key an entry takes 12 bytes
+#endif
 typedef struct {
-    ObjString* key;
+    HEAP_REF(ObjString) key;
     Value value;
 } Entry;
+#ifdef COMPRESSED_HEAP
+#pragma pack(pop)
+#endif
 
 typedef struct {
     size_t count;
@@ -26,7 +32,7 @@ void table_add_all(Table* from, Table* to);
 void table_print(Table* table, const char* name);
 
 void table_mark(Table* table);
-void table_remove_white_marked_obj(Table* table);
+void table_remove_white_marked_obj(Table* table, bool young_only);
 
 ObjString* table_find_string(Table* table, const char* chars, size_t length, uint32_t hash);
 
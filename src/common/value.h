@@ -18,6 +18,7 @@ typedef struct ObjArray ObjArray;
 
 typedef uint64_t Value;
 
+#define EMPTY_VAL       ((Value)(uint64_t)(QNAN))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
@@ -28,6 +29,7 @@ typedef uint64_t Value;
 
 #define IS_NUM(value)  (((value) & QNAN) != QNAN)
 #define IS_NIL(value)  ((value) == NIL_VAL)
+#define IS_EMPTY(value) ((value) == EMPTY_VAL)
 #define IS_OBJ(value)  (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 
@@ -53,7 +55,8 @@ typedef enum {
     VAL_NUM,
     VAL_BOOL,
     VAL_NIL,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_EMPTY
 } ValueType;
 
 typedef struct {
@@ -69,17 +72,45 @@ typedef struct {
 #define IS_NUM(value)  ((value).type == VAL_NUM)
 #define IS_NIL(value)  ((value).type == VAL_NIL)
 #define IS_OBJ(value)  ((value).type == VAL_OBJ)
+#define IS_EMPTY(value) ((value).type == VAL_EMPTY)
 
 #define BOOL_VAL(value) ((Value){.type=VAL_BOOL, {.boolean=value}})
 #define NUM_VAL(value)  ((Value){.type=VAL_NUM, {.number=value}})
 #define NIL_VAL         ((Value){.type=VAL_NIL, {.number=0}})
 #define OBJ_VAL(object) ((Value){.type=VAL_OBJ, {.obj=(Obj*)(object)}})
+#define EMPTY_VAL       ((Value){.type=VAL_EMPTY, {.number=0}})
 
 #define AS_NUM(value)   ((value).as.number)
 #define AS_BOOL(value)  ((value).as.boolean)
 #define AS_OBJ(value)   ((value).as.obj)
 #endif
 
+#ifdef COMPRESSED_HEAP
+// objects live in one region reserved by the slab allocator, references between objects
+// and from table keys are stored as 32 bit offsets into it, offset 0 being NULL
+extern char* heap_base;
+
+#define HEAP_REF(type) uint32_t
+#define NULL_REF 0
+#define TO_REF(object) to_ref(object)
+#define FROM_REF(type, ref) ((type*)from_ref(ref))
+
+static inline uint32_t to_ref(void* object){
+    return object == NULL ? 0 : (uint32_t)((char*)object - heap_base);
+}
+
+static inline void* from_ref(uint32_t ref){
+    return ref == 0 ? NULL : heap_base + ref;
+}
+
+#else
+
+#define HEAP_REF(type) type*
+#define NULL_REF NULL
+#define TO_REF(object) (object)
+#define FROM_REF(type, ref) (ref)
+#endif
+
 typedef struct {
     size_t count;
     size_t cap;
@@ -0,0 +1,352 @@
+// mmap, open and fstat are hidden by -std=c99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "memory.h"
+#include "registers.h"
+#include "vm.h"
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Compiled scripts are cached next to their source. The file starts with a header
+//   "YABC" | version u32 | flags u8 | source hash u64 | payload hash u64 | payload size u64
+// followed by the payload: the names of all global slots in slot order and then the script
+// function, with every nested function stored inline in the constant table that refers to it.
+// Instructions address globals by slot, so a cache only loads if every name gets its old slot.
+
+#define CACHE_MAGIC "YABC"
+#define CACHE_HEADER_SIZE (4 + 4 + 1 + 8 + 8 + 8)
+#define CACHE_PEEPHOLE 0x01
+
+typedef enum {
+    CONST_NUM,
+    CONST_STRING,
+    CONST_FUNCTION,
+    CONST_NIL,
+    CONST_TRUE,
+    CONST_FALSE,
+} ConstantTag;
+
+static uint64_t hash_bytes(const uint8_t* bytes, size_t length){
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++){
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static uint8_t cache_flags(){
+    return vm->options.peephole ? CACHE_PEEPHOLE : 0;
+}
+
+void write_bytes(Writer* w, const void* bytes, size_t length){
+    if (w->count + length > w->cap){
+        while (w->count + length > w->cap) w->cap = GROW_CAP(w->cap);
+        w->data = realloc(w->data, w->cap);
+        if (w->data == NULL){
+            fprintf(stderr, "Couldn't allocate serialisation buffer\n");
+            exit(1);
+        }
+    }
+    memcpy(w->data + w->count, bytes, length);
+    w->count += length;
+}
+
+void write_u8(Writer* w, uint8_t value){
+    write_bytes(w, &value, 1);
+}
+
+void write_u32(Writer* w, uint32_t value){
+    write_bytes(w, &value, 4);
+}
+
+void write_u64(Writer* w, uint64_t value){
+    write_bytes(w, &value, 8);
+}
+
+void write_string(Writer* w, ObjString* string){
+    write_u32(w, string->length);
+    write_bytes(w, string->chars, string->length);
+}
+
+bool write_function(Writer* w, ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    write_u32(w, function->arity);
+    write_u32(w, function->upvalue_count);
+    write_u8(w, function->name != NULL);
+    if (function->name != NULL) write_string(w, function->name);
+
+    // quickened instructions are stored as the generic instruction they came from
+    write_u32(w, chunk->count);
+    for (size_t offset = 0; offset < chunk->count;){
+        size_t length = instruction_length(chunk, offset);
+        write_u8(w, generic_op(chunk->code[offset]));
+        write_bytes(w, chunk->code + offset + 1, length - 1);
+        offset += length;
+    }
+
+    write_u32(w, chunk->lines.count);
+    for (size_t i = 0; i < chunk->lines.count; i++){
+        write_u32(w, chunk->lines.lines_t[i].line_num);
+        write_u32(w, chunk->lines.lines_t[i].count);
+    }
+
+    write_u32(w, chunk->constants.count);
+    for (size_t i = 0; i < chunk->constants.count; i++){
+        Value value = chunk->constants.values[i];
+        if (IS_NUM(value)){
+            double number = AS_NUM(value);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(double));
+            write_u8(w, CONST_NUM);
+            write_u64(w, bits);
+        } else if (IS_STRING(value)){
+            write_u8(w, CONST_STRING);
+            write_string(w, AS_STRING(value));
+        } else if (IS_FUNCTION(value)){
+            write_u8(w, CONST_FUNCTION);
+            if (!write_function(w, AS_FUNCTION(value))) return false;
+        } else if (IS_NIL(value)){
+            write_u8(w, CONST_NIL);
+        } else if (IS_BOOL(value)){
+            write_u8(w, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+        } else {
+            return false;
+        }
+    }
+
+    // the inline caches themselves start out empty again
+    write_u32(w, chunk->cache_count);
+    return true;
+}
+
+bool write_cache(const char* path, const char* source, ObjFunction* function){
+    Writer payload = { NULL, 0, 0 };
+    write_u32(&payload, vm->global_names.count);
+    for (size_t i = 0; i < vm->global_names.count; i++){
+        write_string(&payload, AS_STRING(vm->global_names.values[i]));
+    }
+    if (!write_function(&payload, function)){
+        free(payload.data);
+        return false;
+    }
+
+    Writer header = { NULL, 0, 0 };
+    write_bytes(&header, CACHE_MAGIC, 4);
+    write_u32(&header, CACHE_VERSION);
+    write_u8(&header, cache_flags());
+    write_u64(&header, hash_bytes((const uint8_t*)source, strlen(source)));
+    write_u64(&header, hash_bytes(payload.data, payload.count));
+    write_u64(&header, payload.count);
+
+    // written under a temporary name first so a concurrent run never maps half a file
+    size_t path_length = strlen(path);
+    char* temp_path = malloc(path_length + 5);
+    if (temp_path == NULL){
+        free(header.data);
+        free(payload.data);
+        return false;
+    }
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+
+    bool written = false;
+    FILE* file = fopen(temp_path, "wb");
+    if (file != NULL){
+        written = fwrite(header.data, 1, header.count, file) == header.count &&
+                  fwrite(payload.data, 1, payload.count, file) == payload.count;
+        written = fclose(file) == 0 && written;
+        written = written && rename(temp_path, path) == 0;
+        if (!written) remove(temp_path);
+    }
+    free(temp_path);
+    free(header.data);
+    free(payload.data);
+    return written;
+}
+
+static bool take(Reader* r, void* out, size_t length){
+    if (r->failed || r->size - r->pos < length){
+        r->failed = true;
+        memset(out, 0, length);
+        return false;
+    }
+    memcpy(out, r->data + r->pos, length);
+    r->pos += length;
+    return true;
+}
+
+uint8_t read_u8(Reader* r){
+    uint8_t value;
+    take(r, &value, 1);
+    return value;
+}
+
+uint32_t read_u32(Reader* r){
+    uint32_t value;
+    take(r, &value, 4);
+    return value;
+}
+
+uint64_t read_u64(Reader* r){
+    uint64_t value;
+    take(r, &value, 8);
+    return value;
+}
+
+static bool available(Reader* r, size_t length){
+    if (r->failed || r->size - r->pos < length) r->failed = true;
+    return !r->failed;
+}
+
+ObjString* read_string(Reader* r){
+    uint32_t length = read_u32(r);
+    if (!available(r, length)) return NULL;
+    ObjString* string = copy_string((const char*)r->data + r->pos, length);
+    r->pos += length;
+    return string;
+}
+
+// the function stays on the VM stack while it is filled in, so everything it
+// already refers to survives a collection
+ObjFunction* read_function(Reader* r){
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+    function->arity = read_u32(r);
+    function->upvalue_count = read_u32(r);
+    if (read_u8(r) && (function->name = read_string(r)) == NULL) goto failed;
+    WRITE_BARRIER_OBJ(function, function->name);
+
+    uint32_t count = read_u32(r);
+    if (!available(r, count)) goto failed;
+    chunk->code = GROW_ARRAY(uint8_t, NULL, 0, count);
+    chunk->cap = count;
+    memcpy(chunk->code, r->data + r->pos, count);
+    chunk->count = count;
+    r->pos += count;
+
+    uint32_t line_count = read_u32(r);
+    if (!available(r, (size_t)line_count * 8)) goto failed;
+    chunk->lines.lines_t = GROW_ARRAY(Line, NULL, 0, line_count);
+    chunk->lines.cap = line_count;
+    for (uint32_t i = 0; i < line_count; i++){
+        Line* line = &chunk->lines.lines_t[chunk->lines.count++];
+        line->line_num = read_u32(r);
+        line->count = read_u32(r);
+    }
+
+    uint32_t constant_count = read_u32(r);
+    for (uint32_t i = 0; i < constant_count && !r->failed; i++){
+        Value value = NIL_VAL;
+        switch (read_u8(r)){
+            case CONST_NUM: {
+                uint64_t bits = read_u64(r);
+                double number;
+                memcpy(&number, &bits, sizeof(double));
+                value = NUM_VAL(number);
+            } break;
+            case CONST_STRING: {
+                ObjString* string = read_string(r);
+                if (string == NULL) goto failed;
+                value = OBJ_VAL(string);
+            } break;
+            case CONST_FUNCTION: {
+                ObjFunction* nested = read_function(r);
+                if (nested == NULL) goto failed;
+                value = OBJ_VAL(nested);
+            } break;
+            case CONST_NIL:     value = NIL_VAL; break;
+            case CONST_TRUE:    value = TRUE_VAL; break;
+            case CONST_FALSE:   value = FALSE_VAL; break;
+            default:            goto failed;
+        }
+        add_constant(chunk, value);
+        WRITE_BARRIER(function, value);
+    }
+
+    uint32_t cache_count = read_u32(r);
+    if (r->failed) goto failed;
+    for (uint32_t i = 0; i < cache_count; i++) add_inline_cache(chunk);
+
+    if (vm->options.registers){
+        lower_to_registers(function, function->name != NULL ? function->name->chars : "<Script>",
+                           vm->options.register_stats);
+    }
+    pop();
+    return function;
+
+failed:
+    r->failed = true;
+    pop();
+    return NULL;
+}
+
+static ObjFunction* read_cache(const uint8_t* data, size_t size, const char* source){
+    Reader r = { data, size, 0, false };
+    char magic[4];
+    take(&r, magic, 4);
+    uint32_t version = read_u32(&r);
+    uint8_t flags = read_u8(&r);
+    uint64_t source_hash = read_u64(&r);
+    uint64_t payload_hash = read_u64(&r);
+    uint64_t payload_size = read_u64(&r);
+    if (r.failed || memcmp(magic, CACHE_MAGIC, 4) != 0 || version != CACHE_VERSION ||
+        flags != cache_flags() || source_hash != hash_bytes((const uint8_t*)source, strlen(source)) ||
+        payload_size != size - CACHE_HEADER_SIZE || payload_hash != hash_bytes(data + r.pos, payload_size))
+    {
+        return NULL;
+    }
+
+    uint32_t global_count = read_u32(&r);
+    for (uint32_t i = 0; i < global_count; i++){
+        ObjString* name = read_string(&r);
+        if (name == NULL) return NULL;
+        push(OBJ_VAL(name));
+        size_t slot = global_slot(name);
+        pop();
+        if (slot != i) return NULL;
+    }
+    ObjFunction* function = read_function(&r);
+    return r.failed || r.pos != r.size ? NULL : function;
+}
+
+ObjFunction* load_cache(const char* path, const char* source){
+#ifdef __unix__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < CACHE_HEADER_SIZE){
+        close(fd);
+        return NULL;
+    }
+    size_t size = info.st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    ObjFunction* function = read_cache(data, size, source);
+    munmap(data, size);
+    return function;
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    uint8_t* data = size >= CACHE_HEADER_SIZE ? malloc(size) : NULL;
+    bool read = data != NULL && fread(data, 1, size, file) == (size_t)size;
+    fclose(file);
+    ObjFunction* function = read ? read_cache(data, size, source) : NULL;
+    free(data);
+    return function;
+#endif
+}
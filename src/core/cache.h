@@ -0,0 +1,38 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "../common/object.h"
+
+// bump whenever the instruction set or the layout of the cache changes
+#define CACHE_VERSION 1
+
+typedef struct {
+    uint8_t* data;
+    size_t count;
+    size_t cap;
+} Writer;
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    bool failed;                      // set once the reader ran past the end or met bad data
+} Reader;
+
+ObjFunction* load_cache(const char* path, const char* source);
+bool write_cache(const char* path, const char* source, ObjFunction* function);
+
+// the encoding of the cache, also used to pass functions between VMs (see worker.c)
+void write_bytes(Writer* w, const void* bytes, size_t length);
+void write_u8(Writer* w, uint8_t value);
+void write_u32(Writer* w, uint32_t value);
+void write_u64(Writer* w, uint64_t value);
+void write_string(Writer* w, ObjString* string);
+bool write_function(Writer* w, ObjFunction* function);
+uint8_t read_u8(Reader* r);
+uint32_t read_u32(Reader* r);
+uint64_t read_u64(Reader* r);
+ObjString* read_string(Reader* r);
+ObjFunction* read_function(Reader* r);
+
+#endif //_CACHE_H
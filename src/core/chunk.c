@@ -1,6 +1,8 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include "chunk.h"
 #include "memory.h"
+#include "../common/object.h"
 
 void init_lines(LineArray* lines){
     lines->cap = 0;
@@ -54,6 +56,9 @@ void init_chunk(Chunk* chunk){
     chunk->cap = 0;
     chunk->count = 0;
     chunk->code = NULL;
+    chunk->cache_count = 0;
+    chunk->cache_cap = 0;
+    chunk->caches = NULL;
     init_value_array(&chunk->constants);
     init_lines(&chunk->lines);
 }
@@ -62,9 +67,16 @@ void free_chunk(Chunk* chunk){
     FREE_ARRAY(uint8_t, chunk->code, chunk->cap);
     free_value_array(&chunk->constants);
     free_lines(&chunk->lines);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_cap);
     init_chunk(chunk);
 }
 
+void free_reg_chunk(RegChunk* reg){
+    FREE_ARRAY(RegInstruction, reg->code, reg->count);
+    FREE_ARRAY(size_t, reg->lines, reg->count);
+    FREE(RegChunk, reg);
+}
+
 void write_chunk(Chunk* chunk, uint8_t byte, size_t line){
     if (chunk->cap < chunk->count + 1){
         size_t old_cap = chunk->cap;
@@ -84,9 +96,179 @@ void write_constant(Chunk* chunk, Value val, size_t line){
     write_chunk(chunk, const_index >> 16, line);
 }
 
+ChunkMark mark_chunk(Chunk* chunk){
+    return (ChunkMark){ chunk->count, chunk->constants.count, chunk->cache_count };
+}
+
+// drops the code, constants and inline caches added since the mark, only the code
+// after it refers to them
+void rewind_chunk(Chunk* chunk, ChunkMark mark){
+    size_t drop = chunk->count - mark.code;
+    while (drop > 0){
+        Line* last = &chunk->lines.lines_t[chunk->lines.count - 1];
+        if (last->count > drop){
+            last->count -= drop;
+            break;
+        }
+        drop -= last->count;
+        chunk->lines.count--;
+    }
+    chunk->count = mark.code;
+    chunk->constants.count = mark.constants;
+    chunk->cache_count = mark.caches;
+}
+
 size_t add_constant(Chunk* chunk, Value val){
     push(val);
     write_value_array(&chunk->constants, val);
     pop();
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+size_t add_inline_cache(Chunk* chunk){
+    if (chunk->cache_cap < chunk->cache_count + 1){
+        size_t old_cap = chunk->cache_cap;
+        chunk->cache_cap = GROW_CAP(chunk->cache_cap);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_cap, chunk->cache_cap);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cache_count];
+    cache->count = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    return chunk->cache_count++;
+}
+
+static size_t closure_length(Chunk* chunk, size_t offset, size_t constant){
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    size_t start = offset;
+    for (size_t i = 0; i < function->upvalue_count; i++){
+        offset += chunk->code[offset] & UPVALUE_LONG ? 4 : 2;
+    }
+    return offset - start;
+}
+
+size_t instruction_length(Chunk* chunk, size_t offset){
+    switch ((OpCode)chunk->code[offset]){
+        case OP_CONSTANT: case OP_DEFINE_GLOBAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+        case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_GET_UPVALUE: case OP_SET_UPVALUE:
+        case OP_ARRAY: case OP_CALL: case OP_CLASS: case OP_METHOD: case OP_GET_SUPER:
+            return 2;
+        case OP_INC_LOCAL: case OP_GET_LOCAL2:
+            return 3;
+        case OP_CONSTANT_LONG: case OP_POPN: case OP_DEFINE_GLOBAL_LONG: case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG: case OP_GET_LOCAL_LONG: case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG: case OP_SET_UPVALUE_LONG: case OP_ARRAY_LONG:
+        case OP_JUMP_IF_FALSE: case OP_JUMP: case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE: case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL: case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return 4;
+        case OP_GET_PROP: case OP_SET_PROP:
+            return 5;
+        case OP_INVOKE: case OP_SUPER_INVOKE:
+            return 6;
+        case OP_GET_PROP_LONG: case OP_SET_PROP_LONG:
+            return 7;
+        case OP_CLOSURE:
+            return 2 + closure_length(chunk, offset + 2, chunk->code[offset+1]);
+        case OP_CLOSURE_LONG: {
+            size_t constant = chunk->code[offset+1] |
+                              chunk->code[offset+2] << 8 |
+                              chunk->code[offset+3] << 16;
+            return 4 + closure_length(chunk, offset + 4, constant);
+        }
+        default:
+            return 1;
+    }
+}
+
+// instruction a quickened instruction was specialised from
+uint8_t generic_op(uint8_t op){
+    switch (op){
+        case OP_ADD_NUM: case OP_ADD_STR:   return OP_ADD;
+        case OP_SUB_NUM:                    return OP_SUB;
+        case OP_MUL_NUM:                    return OP_MUL;
+        case OP_DIV_NUM:                    return OP_DIV;
+        case OP_LESS_NUM:                   return OP_LESS;
+        case OP_LESS_EQUAL_NUM:             return OP_LESS_EQUAL;
+        case OP_GREATER_NUM:                return OP_GREATER;
+        case OP_GREATER_EQUAL_NUM:          return OP_GREATER_EQUAL;
+        default:                            return op;
+    }
+}
+
+static int64_t read_3_bytes(uint8_t* code){
+    return code[0] | code[1] << 8 | code[2] << 16;
+}
+
+// values the instruction leaves on the stack minus the ones it takes, a jump as if it falls through
+static int64_t stack_effect(uint8_t* code){
+    switch (generic_op(code[0])){
+        case OP_CONSTANT: case OP_CONSTANT_LONG: case OP_NIL: case OP_TRUE: case OP_FALSE:
+        case OP_GET_GLOBAL: case OP_GET_GLOBAL_LONG: case OP_GET_LOCAL: case OP_GET_LOCAL_LONG:
+        case OP_GET_LOCAL_0: case OP_GET_LOCAL_1: case OP_GET_LOCAL_2: case OP_GET_LOCAL_3:
+        case OP_GET_UPVALUE: case OP_GET_UPVALUE_LONG: case OP_CLOSURE: case OP_CLOSURE_LONG:
+        case OP_CLASS:
+            return 1;
+        case OP_GET_LOCAL2:
+            return 2;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_EQUAL:
+        case OP_NOT_EQUAL: case OP_LESS: case OP_LESS_EQUAL: case OP_GREATER: case OP_GREATER_EQUAL:
+        case OP_PRINT: case OP_POP: case OP_DEFINE_GLOBAL: case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_PROP: case OP_SET_PROP_LONG: case OP_CLOSE_UPVALUE: case OP_GET_INDEX:
+        case OP_POP_JUMP_IF_FALSE: case OP_METHOD: case OP_INHERIT: case OP_GET_SUPER: case OP_RETURN:
+            return -1;
+        case OP_SET_INDEX: case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return -2;
+        case OP_POPN:           return -read_3_bytes(code + 1);
+        case OP_ARRAY:          return 1 - code[1];
+        case OP_ARRAY_LONG:     return 1 - read_3_bytes(code + 1);
+        case OP_CALL:           return -code[1];
+        case OP_INVOKE:         return -code[2];
+        case OP_SUPER_INVOKE:   return -code[2] - 1;
+        default:                return 0;
+    }
+}
+
+static bool is_jump(uint8_t op){
+    switch (op){
+        case OP_JUMP: case OP_LOOP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// deepest the stack of a call gets, counting the callee and the arguments. The compiler leaves
+// the same depth on both ends of a jump, code after a jump or return starts at the depth of the
+// jumps to it, or of the code before it when nothing jumps there
+size_t stack_size(Chunk* chunk, size_t arity){
+    int64_t* depth_at = malloc(sizeof(int64_t) * (chunk->count + 1));
+    if (depth_at == NULL){
+        fprintf(stderr, "Couldn't allocate stack size buffers\n");
+        exit(1);
+    }
+    for (size_t i = 0; i <= chunk->count; i++) depth_at[i] = -1;
+
+    int64_t depth = arity + 1;
+    int64_t max = depth;
+    bool jumped = false;
+    for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)){
+        uint8_t* code = chunk->code + offset;
+        if (jumped && depth_at[offset] != -1) depth = depth_at[offset];
+        jumped = code[0] == OP_JUMP || code[0] == OP_LOOP || code[0] == OP_RETURN;
+        depth += stack_effect(code);
+        if (depth > max) max = depth;
+        if (is_jump(code[0]) && code[0] != OP_LOOP){
+            size_t target = offset + 1 + read_3_bytes(code + 1);
+            if (target <= chunk->count && depth > depth_at[target]) depth_at[target] = depth;
+        }
+    }
+    free(depth_at);
+    return max;
+}
@@ -33,9 +33,17 @@ typedef enum {
     OP_SET_GLOBAL,
     OP_SET_GLOBAL_LONG,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
+    OP_GET_LOCAL_0,
+    OP_GET_LOCAL_1,
+    OP_GET_LOCAL_2,
+    OP_GET_LOCAL_3,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_GET_UPVALUE,
+    OP_GET_UPVALUE_LONG,
     OP_SET_UPVALUE,
+    OP_SET_UPVALUE_LONG,
     OP_GET_PROP,
     OP_GET_PROP_LONG,
     OP_SET_PROP,
@@ -58,6 +66,26 @@ typedef enum {
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
     OP_RETURN,
+    OP_POP_JUMP_IF_FALSE,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_INC_LOCAL,
+    OP_GET_LOCAL2,
+    // specialised by the VM while running, deoptimised back to the generic instruction
+    // when the operands stop matching
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_DIV_NUM,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_GREATER_NUM,
+    OP_GREATER_EQUAL_NUM,
 } OpCode;
 
 typedef struct {
@@ -71,19 +99,119 @@ typedef struct {
     size_t cap;
 } LineArray;
 
+#define IC_WAYS 4
+
+// flags of the upvalue descriptors that follow OP_CLOSURE
+#define UPVALUE_LOCAL 0x01
+#define UPVALUE_LONG  0x02
+
+typedef enum {
+    IC_FIELD,       // property lives in field slot 'index' of the instance
+    IC_METHOD,      // property resolves to the closure in 'value'
+    IC_TRANSITION,  // storing the property adds field slot 'index' and moves to the shape in 'value'
+} ICKind;
+
+typedef struct {
+    Obj* shape;     // receiver shape the entry was recorded for
+    ICKind kind;
+    uint32_t index;
+    Value value;
+} ICEntry;
+
+// per call site cache of property lookups, first entry is the monomorphic
+// fast path, the remaining entries make the site polymorphic
+typedef struct {
+    ICEntry entries[IC_WAYS];
+    uint8_t count;
+    uint32_t hits;
+    uint32_t misses;
+} InlineCache;
+
 typedef struct {
     size_t count;
     size_t cap;
     uint8_t* code;
     LineArray lines;
     ValueArray constants;
+    size_t cache_count;
+    size_t cache_cap;
+    InlineCache* caches;
 } Chunk;
 
+// how far a chunk was written, the compiler rewinds to it to replace or discard code
+typedef struct {
+    size_t code;
+    size_t constants;
+    size_t caches;
+} ChunkMark;
+
+// three-address instructions of the register backend, registers are the slots of the call frame
+typedef enum {
+    REG_MOVE,               // a = RK(b)
+    REG_GET_GLOBAL,         // a = globals[b | c << 16]
+    REG_SET_GLOBAL,         // globals[b | c << 16] = RK(a)
+    REG_DEFINE_GLOBAL,      // globals[b | c << 16] = RK(a)
+    REG_ADD,                // a = RK(b) + RK(c)
+    REG_SUB,
+    REG_MUL,
+    REG_DIV,
+    REG_MOD,
+    REG_EQUAL,
+    REG_NOT_EQUAL,
+    REG_LESS,
+    REG_LESS_EQUAL,
+    REG_GREATER,
+    REG_GREATER_EQUAL,
+    REG_NOT,                // a = !RK(b)
+    REG_NEGATE,             // a = -RK(b)
+    REG_PRINT,              // print RK(a)
+    REG_JUMP,               // jump to instruction a
+    REG_JUMP_IF_FALSE,      // jump to a if RK(b) is falsey
+    REG_JUMP_IF_NOT_EQUAL,  // jump to a unless RK(b) == RK(c)
+    REG_JUMP_IF_EQUAL,
+    REG_JUMP_IF_NOT_LESS,
+    REG_JUMP_IF_NOT_LESS_EQUAL,
+    REG_JUMP_IF_NOT_GREATER,
+    REG_JUMP_IF_NOT_GREATER_EQUAL,
+    REG_GET_UPVALUE,        // a = upvalues[b]
+    REG_SET_UPVALUE,        // upvalues[b] = RK(a)
+    REG_CLOSURE,            // a = closure of the function in constant b, followed by one
+                            // descriptor per upvalue with op set if it captures local register a
+    REG_CLOSE_UPVALUE,      // close the upvalues of register a and above
+    REG_CALL,               // call register a with the b arguments in the registers after it
+    REG_RETURN,             // return RK(a)
+} RegOpCode;
+
+// operands with this bit set refer to the constant table instead of a register
+#define RK_CONSTANT 0x8000
+#define RK_MAX      0x7fff
+
+typedef struct {
+    uint8_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} RegInstruction;
+
+typedef struct {
+    size_t count;
+    RegInstruction* code;
+    size_t* lines;
+    size_t frame_size;      // number of registers the frame needs
+} RegChunk;
+
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, size_t line);
 size_t add_constant(Chunk* chunk, Value val);
 void write_constant(Chunk* chunk, Value val, size_t line);
+ChunkMark mark_chunk(Chunk* chunk);
+void rewind_chunk(Chunk* chunk, ChunkMark mark);
+size_t add_inline_cache(Chunk* chunk);
+size_t instruction_length(Chunk* chunk, size_t offset);
+size_t stack_size(Chunk* chunk, size_t arity);
+uint8_t generic_op(uint8_t op);
+void free_reg_chunk(RegChunk* reg);
 
 void init_lines(LineArray* lines);
 void free_lines(LineArray* lines);
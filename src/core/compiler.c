@@ -6,15 +6,19 @@
 #include "compiler.h"
 #include "lexer.h"
 #include "memory.h"
+#include "peephole.h"
+#include "registers.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "../common/debug.h"
 #endif //DEBUG_PRINT_CODE
 
-Lexer lexer;
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* current_class = NULL;
+// per thread, so VMs on different threads can compile at the same time
+__thread Lexer lexer;
+__thread Parser parser;
+__thread Compiler* current = NULL;
+__thread ClassCompiler* current_class = NULL;
+__thread ChunkMark infix_start; // where the left operand of the infix rule being compiled starts
 
 static ParseRule* get_rule(TokenType type);
 static void declaration();
@@ -27,6 +31,7 @@ static void if_statement();
 static void while_statement();
 static void for_statement();
 static void block();
+static void dead_statement();
 static void expression_statement();
 static void return_statement();
 
@@ -125,10 +130,71 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2){
     write_chunk(current_chunk(), byte2, parser.previous.line);
 }
 
+static void emit_cache(){
+    size_t cache = add_inline_cache(current_chunk());
+    emit_bytes(cache, cache >> 8);
+    emit_byte(cache >> 16);
+}
+
+static void emit_slot(OpCode op, OpCode long_op, size_t slot){
+    if (slot > UINT8_MAX){
+        emit_bytes(long_op, slot);
+        emit_bytes(slot >> 8, slot >> 16);
+    } else {
+        emit_bytes(op, slot);
+    }
+}
+
+static void emit_get_local(size_t slot){
+    if (slot <= 3){
+        emit_byte(OP_GET_LOCAL_0 + slot);
+    } else {
+        emit_slot(OP_GET_LOCAL, OP_GET_LOCAL_LONG, slot);
+    }
+}
+
+static void emit_constant(Value value){
+    if (IS_NIL(value)){
+        emit_byte(OP_NIL);
+    } else if (IS_BOOL(value)){
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else if (current_chunk()->constants.count + 1 > UINT8_MAX){
+        push(value);
+        emit_byte(OP_CONSTANT_LONG);
+        write_constant(current_chunk(), value, parser.previous.line);
+        pop();
+    } else {
+        emit_bytes(OP_CONSTANT, add_constant(current_chunk(), value));
+    }
+}
+
+static bool is_falsey(Value value){
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// checks whether the code from start to the end of the chunk is a single constant load
+static bool emitted_constant(ChunkMark mark, Value* value){
+    Chunk* chunk = current_chunk();
+    size_t start = mark.code;
+    if (start >= chunk->count || start + instruction_length(chunk, start) != chunk->count) return false;
+    uint8_t* code = chunk->code + start;
+    switch (code[0]){
+        case OP_NIL:   *value = NIL_VAL; return true;
+        case OP_TRUE:  *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        case OP_CONSTANT: 
+            *value = chunk->constants.values[code[1]]; 
+            return true;
+        case OP_CONSTANT_LONG: 
+            *value = chunk->constants.values[code[1] | code[2] << 8 | code[3] << 16]; 
+            return true;
+        default: return false;
+    }
+}
+
 static void emit_return(){
     if (current->type == TYPE_INITIALIZER){
-        emit_bytes(OP_GET_LOCAL, 0);
-        emit_bytes(0, 0);
+        emit_byte(OP_GET_LOCAL_0);
     } else {
         emit_byte(OP_NIL);
     }
@@ -203,12 +269,21 @@ static int32_t resolve_upvalue(Compiler* compiler, Token* name){
 static ObjFunction* end_compiler(){
     emit_return();
     ObjFunction* fn = current->fn;
+    const char* name = fn->name != NULL ? fn->name->chars : "<Script>";
+    if (vm->options.peephole && !parser.had_error){
+        optimize_chunk(current_chunk(), name, vm->options.peephole_stats);
+    }
+    if (vm->options.registers && !parser.had_error){
+        lower_to_registers(fn, name, vm->options.register_stats);
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error){
-        disassemble_chunk(current_chunk(), fn->name != NULL ? fn->name->chars : "<Script>");
+        disassemble_chunk(current_chunk(), name);
+        if (fn->reg != NULL) disassemble_reg_chunk(fn, name);
     }
 #endif //DEBUG_PRINT_CODE
     current = current->enclosing;
+    remember_object((Obj*)fn);
     // pop();
     return fn;
 }
@@ -276,12 +351,7 @@ static void define_var(Value value){
         return;
     }
 
-    if (current_chunk()->constants.count + 1 > UINT8_MAX){
-        emit_byte(OP_DEFINE_GLOBAL_LONG);
-        write_constant(current_chunk(), value, parser.previous.line);
-    } else {
-        emit_bytes(OP_DEFINE_GLOBAL, add_constant(current_chunk(), value));
-    }
+    emit_slot(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global_slot(AS_STRING(value)));
 }
 
 static Value parse_var(const char* err_msg){
@@ -300,10 +370,12 @@ static void parse_precedence(Precedence prec){
         return;
     }
     bool can_assign = prec <= PREC_ASSIGNMENT;
+    ChunkMark start = mark_chunk(current_chunk());
     prefix_rule(can_assign);
 
     while(prec <= get_rule(parser.current.type)->precedence){
         advance();
+        infix_start = start;
         get_rule(parser.previous.type)->infix(can_assign);
     }
 
@@ -372,10 +444,14 @@ static void function(FunctionType type){
         emit_bytes(OP_CLOSURE, add_constant(current_chunk(), OBJ_VAL(function)));
     }
     for (size_t i = 0; i < function->upvalue_count; i++){
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
         size_t index = compiler.upvalues[i].index;
-        emit_bytes(index, index << 8);
-        emit_byte(index << 16);
+        uint8_t flags = compiler.upvalues[i].is_local ? UPVALUE_LOCAL : 0;
+        if (index > UINT8_MAX){
+            emit_bytes(flags | UPVALUE_LONG, index);
+            emit_bytes(index >> 8, index >> 16);
+        } else {
+            emit_bytes(flags, index);
+        }
     }
 }
 
@@ -400,12 +476,7 @@ static void function_declaration(){
         return;
     }
     
-    if (current_chunk()->constants.count + 1 > UINT8_MAX){
-        emit_byte(OP_DEFINE_GLOBAL_LONG);
-        write_constant(current_chunk(), value, parser.previous.line);
-    } else {
-        emit_bytes(OP_DEFINE_GLOBAL, add_constant(current_chunk(), value));
-    }
+    emit_slot(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global_slot(AS_STRING(value)));
     pop();
 }
 
@@ -504,8 +575,21 @@ static void print_statement(){
 
 static void if_statement(){
     consume(TOKEN_LEFT_PAREN, "Expected '(' after if keyword");
+    ChunkMark condition = mark_chunk(current_chunk());
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' in if statement");
+    
+    Value value;
+    if (emitted_constant(condition, &value)){
+        rewind_chunk(current_chunk(), condition);
+        bool taken = !is_falsey(value);
+        if (taken) statement(); else dead_statement();
+        if (match(TOKEN_ELSE)){
+            if (taken) dead_statement(); else statement();
+        }
+        return;
+    }
+
     int32_t then_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -519,14 +603,27 @@ static void if_statement(){
 }
 
 static void while_statement(){
-    int32_t loop = current_chunk()->count;
+    ChunkMark loop = mark_chunk(current_chunk());
     consume(TOKEN_LEFT_PAREN, "Expected '(' after while keyword");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' in while statement");
+
+    Value value;
+    if (emitted_constant(loop, &value)){
+        rewind_chunk(current_chunk(), loop);
+        if (is_falsey(value)){
+            dead_statement();
+        } else {
+            statement();
+            emit_loop(loop.code);
+        }
+        return;
+    }
+
     int32_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     statement();
-    emit_loop(loop);
+    emit_loop(loop.code);
 
     patch_jump(exit_jump);
     emit_byte(OP_POP);
@@ -543,14 +640,24 @@ static void for_statement(){
     } else {
         expression_statement();
     }
-    int32_t loop_start = current_chunk()->count;
+    ChunkMark condition = mark_chunk(current_chunk());
+    int32_t loop_start = condition.code;
     int32_t exit_jump = -1;
+    bool dead = false;
     if (!match(TOKEN_SEMICOLON)){
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after condition in for statement");
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        Value value;
+        if (emitted_constant(condition, &value)){
+            // a constant condition either never exits or never enters the loop
+            rewind_chunk(current_chunk(), condition);
+            dead = is_falsey(value);
+        } else {
+            exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+            emit_byte(OP_POP);
+        }
     }
+    ChunkMark body_start = mark_chunk(current_chunk());
     if (!match(TOKEN_RIGHT_PAREN)){
         int32_t body_jump = emit_jump(OP_JUMP);
         int32_t increment_start = current_chunk()->count;
@@ -567,9 +674,17 @@ static void for_statement(){
         patch_jump(exit_jump);
         emit_byte(OP_POP);
     }
+    if (dead) rewind_chunk(current_chunk(), body_start);
     end_scope();
 }
 
+// compiles a statement that can never run, so errors are still reported but no code is kept
+static void dead_statement(){
+    ChunkMark start = mark_chunk(current_chunk());
+    statement();
+    rewind_chunk(current_chunk(), start);
+}
+
 static void block(){
     while(parser.current.type != TOKEN_RIGHT_BRACE && parser.current.type != TOKEN_EOF){
         declaration();
@@ -606,12 +721,7 @@ static void expression(){
 static void number(bool can_assign){
     UNUSED(can_assign);
     double value = strtod(parser.previous.start, NULL);
-    if (current_chunk()->constants.count + 1 > UINT8_MAX){
-        emit_byte(OP_CONSTANT_LONG);
-        write_constant(current_chunk(), NUM_VAL(value), parser.previous.line);
-    } else {
-        emit_bytes(OP_CONSTANT, add_constant(current_chunk(), NUM_VAL(value)));
-    }
+    emit_constant(NUM_VAL(value));
 }
 
 static void literal(bool can_assign){
@@ -626,13 +736,7 @@ static void literal(bool can_assign){
 
 static void string(bool can_assign){
     UNUSED(can_assign);
-    Value value = OBJ_VAL(copy_string(parser.previous.start+1, parser.previous.length-2));
-    if (current_chunk()->constants.count + 1 > UINT8_MAX){
-        emit_byte(OP_CONSTANT_LONG);
-        write_constant(current_chunk(), value, parser.previous.line);
-    } else {
-        emit_bytes(OP_CONSTANT, add_constant(current_chunk(), value));
-    }
+    emit_constant(OBJ_VAL(copy_string(parser.previous.start+1, parser.previous.length-2)));
 }
 
 
@@ -658,32 +762,20 @@ static void named_variable(Token name, bool can_assign){
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        Value value = OBJ_VAL(copy_string(name.start, name.length));
-        arg = add_constant(current_chunk(), value);
+        arg = global_slot(copy_string(name.start, name.length));
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
     if (can_assign && match(TOKEN_EQUAL)){
         expression();
-        if (set_op == OP_SET_LOCAL || set_op == OP_SET_UPVALUE){
-            emit_bytes(set_op, (uint8_t)arg);
-            emit_bytes((uint8_t)(arg >> 8), (uint8_t)(arg >> 16));
-        } else if (current_chunk()->constants.count + 1 > UINT8_MAX){
-            emit_bytes(OP_SET_GLOBAL_LONG, (uint8_t)arg);
-            emit_bytes((uint8_t)(arg >> 8), (uint8_t)(arg >> 16));
-        } else {
-            emit_bytes(set_op, arg);
-        }
+        // every short variable op is directly followed by its _LONG form
+        emit_slot(set_op, set_op + 1, arg);
     } else {
-        if (get_op == OP_GET_LOCAL || get_op == OP_GET_UPVALUE){
-            emit_bytes(get_op, (uint8_t)arg);
-            emit_bytes((uint8_t)(arg >> 8), (uint8_t)(arg >> 16));
-        } else if (current_chunk()->constants.count + 1 > UINT8_MAX){
-            emit_bytes(OP_GET_GLOBAL_LONG, (uint8_t)arg);
-            emit_bytes((uint8_t)(arg >> 8), (uint8_t)(arg >> 16));
+        if (get_op == OP_GET_LOCAL){
+            emit_get_local(arg);
         } else {
-            emit_bytes(get_op, arg);
+            emit_slot(get_op, get_op + 1, arg);
         }
         while (match(TOKEN_LEFT_BRACKET)){
             indices(can_assign);
@@ -723,10 +815,71 @@ static void array(bool can_assign){
     }
 }
 
+// evaluates an operator on constant operands at compile time, operations that would
+// fail at runtime are left alone so the error is still reported when they run
+static bool fold_unary(TokenType operator, Value a, Value* result){
+    switch(operator){
+        case TOKEN_MINUS:
+            if (!IS_NUM(a)) return false;
+            *result = NUM_VAL(AS_NUM(a) * -1);
+            return true;
+        case TOKEN_BANG:
+            *result = BOOL_VAL(is_falsey(a));
+            return true;
+        default: return false;
+    }
+}
+
+static bool fold_binary(TokenType operator, Value a, Value b, Value* result){
+    if (operator == TOKEN_EQUAL_EQUAL || operator == TOKEN_BANG_EQUAL){
+        *result = BOOL_VAL(values_equal(a, b) == (operator == TOKEN_EQUAL_EQUAL));
+        return true;
+    }
+    if (operator == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)){
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        size_t length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(take_string(chars, length));
+        return true;
+    }
+    if (!IS_NUM(a) || !IS_NUM(b)) return false;
+    double x = AS_NUM(a), y = AS_NUM(b);
+    switch(operator){
+        case TOKEN_PLUS:          *result = NUM_VAL(x + y); break;
+        case TOKEN_MINUS:         *result = NUM_VAL(x - y); break;
+        case TOKEN_STAR:          *result = NUM_VAL(x * y); break;
+        case TOKEN_SLASH:
+            if (y == 0) return false;
+            *result = NUM_VAL(x / y); 
+            break;
+        case TOKEN_MOD:
+            if (x <= INT32_MIN || x >= INT32_MAX || y <= INT32_MIN || y >= INT32_MAX || (int)y == 0) return false;
+            *result = NUM_VAL((int)x % (int)y);
+            break;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); break;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(x <= y); break;
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); break;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(x >= y); break;
+        default: return false;
+    }
+    return true;
+}
+
 static void unary(bool can_assign){
     UNUSED(can_assign);
     TokenType operator = parser.previous.type;
+    ChunkMark operand = mark_chunk(current_chunk());
     parse_precedence(PREC_UNARY);
+    Value a, result;
+    if (emitted_constant(operand, &a) && fold_unary(operator, a, &result)){
+        rewind_chunk(current_chunk(), operand);
+        emit_constant(result);
+        return;
+    }
     switch(operator){
         case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
         case TOKEN_BANG: emit_byte(OP_NOT); break;
@@ -736,9 +889,19 @@ static void unary(bool can_assign){
 
 static void binary(bool can_assign){
     UNUSED(can_assign);
+    ChunkMark lhs = infix_start;
     TokenType operator = parser.previous.type;
     ParseRule* rule = get_rule(operator);
+    ChunkMark rhs = mark_chunk(current_chunk());
+    Value a;
+    bool lhs_constant = emitted_constant(lhs, &a);
     parse_precedence((Precedence)(rule->precedence+1));
+    Value b, result;
+    if (lhs_constant && emitted_constant(rhs, &b) && fold_binary(operator, a, b, &result)){
+        rewind_chunk(current_chunk(), lhs);
+        emit_constant(result);
+        return;
+    }
     switch(operator){
         case TOKEN_PLUS:           emit_byte(OP_ADD); break;
         case TOKEN_MINUS:          emit_byte(OP_SUB); break;
@@ -779,6 +942,18 @@ static void call(bool can_assign){
 
 static void and_(bool can_assign){
     UNUSED(can_assign);
+    Value value;
+    if (emitted_constant(infix_start, &value)){
+        if (is_falsey(value)){
+            ChunkMark rhs = mark_chunk(current_chunk());
+            parse_precedence(PREC_AND);
+            rewind_chunk(current_chunk(), rhs);
+        } else {
+            rewind_chunk(current_chunk(), infix_start);
+            parse_precedence(PREC_AND);
+        }
+        return;
+    }
     int32_t end_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     parse_precedence(PREC_AND);
@@ -787,6 +962,18 @@ static void and_(bool can_assign){
 
 static void or_(bool can_assign){
     UNUSED(can_assign);
+    Value value;
+    if (emitted_constant(infix_start, &value)){
+        if (is_falsey(value)){
+            rewind_chunk(current_chunk(), infix_start);
+            parse_precedence(PREC_OR);
+        } else {
+            ChunkMark rhs = mark_chunk(current_chunk());
+            parse_precedence(PREC_OR);
+            rewind_chunk(current_chunk(), rhs);
+        }
+        return;
+    }
     int32_t else_jump = emit_jump(OP_JUMP_IF_FALSE);
     int32_t end_jump = emit_jump(OP_JUMP);
     patch_jump(else_jump);
@@ -797,12 +984,29 @@ static void or_(bool can_assign){
 
 static void ternary(bool can_assign){
     UNUSED(can_assign);
+    Value value;
+    if (emitted_constant(infix_start, &value)){
+        rewind_chunk(current_chunk(), infix_start);
+        ChunkMark branch = mark_chunk(current_chunk());
+        expression();
+        consume(TOKEN_COLON, "expected ':' in ternary expression");
+        if (is_falsey(value)){
+            rewind_chunk(current_chunk(), branch);
+            expression();
+        } else {
+            branch = mark_chunk(current_chunk());
+            expression();
+            rewind_chunk(current_chunk(), branch);
+        }
+        return;
+    }
     int32_t jmp = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     expression();
     int32_t end_jmp = emit_jump(OP_JUMP);
     consume(TOKEN_COLON, "expected ':' in ternary expression");
     patch_jump(jmp);
+    emit_byte(OP_POP);
     expression();
     patch_jump(end_jmp);
 }
@@ -820,10 +1024,12 @@ static void dot(bool can_assign){
         } else {
             emit_bytes(OP_SET_PROP, add_constant(current_chunk(), name));
         }
+        emit_cache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t args = argument_list();
         emit_bytes(OP_INVOKE, add_constant(current_chunk(), name));
         emit_byte(args);
+        emit_cache();
     } else {
         if (current_chunk()->constants.count + 1 > UINT8_MAX){
             emit_byte(OP_GET_PROP_LONG);
@@ -831,6 +1037,7 @@ static void dot(bool can_assign){
         } else {
             emit_bytes(OP_GET_PROP, add_constant(current_chunk(), name));
         }
+        emit_cache();
         while (match(TOKEN_LEFT_BRACKET)){
             indices(can_assign);
         }
@@ -865,6 +1072,7 @@ static void super_(bool can_assign){
         named_variable(synthetic_token("super"), false);
         emit_bytes(OP_SUPER_INVOKE, name);
         emit_byte(args);
+        emit_cache();
     } else {
         named_variable(synthetic_token("super"), false);
         emit_bytes(OP_GET_SUPER, name);
@@ -950,6 +1158,9 @@ void mark_compiler_roots(){
         // print_obj(OBJ_VAL(compiler->fn));
         // printf("\n");
         mark_object((Obj*)compiler->fn);
+        // constants are added without write barriers, so functions still being
+        // compiled are rescanned by every minor collection
+        remember_object((Obj*)compiler->fn);
         compiler = compiler->enclosing;
     }
 }
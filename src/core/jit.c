@@ -0,0 +1,676 @@
+// mmap flags like MAP_ANONYMOUS are hidden by -std=c99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "memory.h"
+
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+
+#include <sys/mman.h>
+
+// Baseline JIT: every bytecode instruction becomes a fixed template of x86-64 code. The value
+// stack stays in memory, numbers are handled inline and everything else calls back into the
+// helpers of the VM. While native code runs the registers hold
+//   rbx = frame->slots, r12 = stack pointer, r13 = frame, r14 = QNAN, r15 = vm
+// and vm->sp is only up to date around helper calls. Calls can grow and so move the stacks,
+// rbx and r13 are reloaded after them.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+#define EXIT_OK    SIZE_MAX
+#define EXIT_ERROR (SIZE_MAX - 1)
+
+typedef struct {
+    size_t at;          // offset of the rel32 to patch
+    size_t target;      // bytecode offset it jumps to, or one of the exits
+} NativeJump;
+
+typedef struct {
+    Chunk* chunk;
+    uint8_t* code;
+    size_t count;
+    size_t cap;
+    size_t* native_at;  // bytecode offset -> native offset
+    NativeJump* jumps;
+    size_t jump_count;
+    size_t jump_cap;
+} Jit;
+
+static void* grow(void* buffer, size_t size){
+    void* result = realloc(buffer, size);
+    if (result == NULL){
+        fprintf(stderr, "Couldn't allocate JIT buffers\n");
+        exit(1);
+    }
+    return result;
+}
+
+static void byte(Jit* j, uint8_t b){
+    if (j->count == j->cap){
+        j->cap = GROW_CAP(j->cap);
+        j->code = grow(j->code, j->cap);
+    }
+    j->code[j->count++] = b;
+}
+
+static void bytes4(Jit* j, uint32_t value){
+    for (int i = 0; i < 4; i++) byte(j, value >> (8 * i));
+}
+
+static void rex_w(Jit* j, int reg, int rm){
+    byte(j, 0x48 | (reg & 8) >> 1 | (rm & 8) >> 3);
+}
+
+// [base + disp32], r12 as base needs a SIB byte
+static void modrm_mem(Jit* j, int reg, int base, int32_t disp){
+    byte(j, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) byte(j, 0x24);
+    bytes4(j, disp);
+}
+
+static void modrm_reg(Jit* j, int reg, int rm){
+    byte(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void load(Jit* j, int dst, int base, int32_t disp){
+    rex_w(j, dst, base);
+    byte(j, 0x8b);
+    modrm_mem(j, dst, base, disp);
+}
+
+#ifdef COMPRESSED_HEAP
+// zero extends the 32 bits at [base + disp] into dst
+static void load32(Jit* j, int dst, int base, int32_t disp){
+    if ((dst | base) & 8) byte(j, 0x40 | (dst & 8) >> 1 | (base & 8) >> 3);
+    byte(j, 0x8b);
+    modrm_mem(j, dst, base, disp);
+}
+#endif //COMPRESSED_HEAP
+
+static void store(Jit* j, int base, int32_t disp, int src){
+    rex_w(j, src, base);
+    byte(j, 0x89);
+    modrm_mem(j, src, base, disp);
+}
+
+static void mov_imm(Jit* j, int dst, uint64_t imm){
+    rex_w(j, 0, dst);
+    byte(j, 0xb8 + (dst & 7));
+    for (int i = 0; i < 8; i++) byte(j, imm >> (8 * i));
+}
+
+// two register instruction: mov 0x89, add 0x01, or 0x09, and 0x21, xor 0x31, cmp 0x39, test 0x85
+static void alu(Jit* j, uint8_t op, int dst, int src){
+    rex_w(j, src, dst);
+    byte(j, op);
+    modrm_reg(j, src, dst);
+}
+
+static void add_imm(Jit* j, int dst, int32_t imm){
+    rex_w(j, 0, dst);
+    byte(j, 0x81);
+    modrm_reg(j, imm < 0 ? 5 : 0, dst);
+    bytes4(j, imm < 0 ? -imm : imm);
+}
+
+static void movq_to_xmm(Jit* j, int xmm, int src){
+    byte(j, 0x66);
+    rex_w(j, xmm, src);
+    byte(j, 0x0f);
+    byte(j, 0x6e);
+    modrm_reg(j, xmm, src);
+}
+
+static void movq_from_xmm(Jit* j, int dst, int xmm){
+    byte(j, 0x66);
+    rex_w(j, xmm, dst);
+    byte(j, 0x0f);
+    byte(j, 0x7e);
+    modrm_reg(j, xmm, dst);
+}
+
+// scalar double instruction on xmm0..xmm7: addsd F2 58, subsd F2 5C, mulsd F2 59,
+// divsd F2 5E, ucomisd 66 2E, xorpd 66 57
+static void sse(Jit* j, uint8_t prefix, uint8_t op, int dst, int src){
+    byte(j, prefix);
+    byte(j, 0x0f);
+    byte(j, op);
+    modrm_reg(j, dst, src);
+}
+
+// Value in rax becomes true or false depending on condition cc
+static void set_bool(Jit* j, int cc){
+    byte(j, 0x0f); byte(j, 0x90 | cc); byte(j, 0xc0);  // setcc al
+    byte(j, 0x0f); byte(j, 0xb6); byte(j, 0xc0);       // movzx eax, al
+    mov_imm(j, RCX, FALSE_VAL);
+    alu(j, 0x01, RAX, RCX);
+}
+
+static size_t jcc(Jit* j, int cc){
+    byte(j, 0x0f);
+    byte(j, 0x80 | cc);
+    bytes4(j, 0);
+    return j->count - 4;
+}
+
+static size_t jmp(Jit* j){
+    byte(j, 0xe9);
+    bytes4(j, 0);
+    return j->count - 4;
+}
+
+static void patch_here(Jit* j, size_t at){
+    uint32_t rel = j->count - (at + 4);
+    memcpy(j->code + at, &rel, 4);
+}
+
+// jump to a bytecode offset or an exit, cc < 0 jumps unconditionally
+static void jump_to(Jit* j, int cc, size_t target){
+    if (j->jump_count == j->jump_cap){
+        j->jump_cap = GROW_CAP(j->jump_cap);
+        j->jumps = grow(j->jumps, sizeof(NativeJump) * j->jump_cap);
+    }
+    size_t at = cc < 0 ? jmp(j) : jcc(j, cc);
+    j->jumps[j->jump_count++] = (NativeJump){ .at = at, .target = target };
+}
+
+static void call(Jit* j, void* function){
+    mov_imm(j, RAX, (uint64_t)(uintptr_t)function);
+    byte(j, 0xff);
+    byte(j, 0xd0);
+}
+
+// leaves the frame with an error unless the helper that was just called returned true
+static void check_result(Jit* j){
+    byte(j, 0x84);
+    byte(j, 0xc0);
+    jump_to(j, CC_E, EXIT_ERROR);
+}
+
+// helpers see vm->sp and frame->ip past the instruction, as the interpreter would leave them,
+// so a frame a fiber suspended can go on interpreted
+static void sync(Jit* j, size_t offset){
+    store(j, R15, offsetof(VM, sp), R12);
+    mov_imm(j, RAX, (uint64_t)(uintptr_t)(j->chunk->code + offset + instruction_length(j->chunk, offset)));
+    store(j, R13, offsetof(CallFrame, ip), RAX);
+}
+
+static void reload(Jit* j){
+    load(j, R12, R15, offsetof(VM, sp));
+}
+
+static void push_rax(Jit* j){
+    store(j, R12, 0, RAX);
+    add_imm(j, R12, 8);
+}
+
+static void push_imm(Jit* j, Value value){
+    mov_imm(j, RAX, value);
+    push_rax(j);
+}
+
+// jumps to the returned patch if the Value in reg isn't a number
+static size_t check_num(Jit* j, int reg){
+    alu(j, 0x89, RSI, reg);
+    alu(j, 0x21, RSI, R14);
+    alu(j, 0x39, RSI, R14);
+    return jcc(j, CC_E);
+}
+
+static void helper_call(Jit* j, size_t offset, void* function, bool can_fail){
+    sync(j, offset);
+    call(j, function);
+    if (can_fail) check_result(j);
+    reload(j);
+}
+
+// helpers that call functions return the frame of the caller, or NULL if the call failed
+static void call_helper(Jit* j, size_t offset, void* function){
+    sync(j, offset);
+    call(j, function);
+    alu(j, 0x85, RAX, RAX);
+    jump_to(j, CC_E, EXIT_ERROR);
+    alu(j, 0x89, R13, RAX);
+    load(j, RBX, R13, offsetof(CallFrame, slots));
+    reload(j);
+}
+
+static void error(Jit* j, size_t offset, const char* message){
+    sync(j, offset);
+    mov_imm(j, RDI, (uint64_t)(uintptr_t)message);
+    call(j, jit_error);
+    jump_to(j, -1, EXIT_ERROR);
+}
+
+static void get_local(Jit* j, size_t slot){
+    load(j, RAX, RBX, slot * sizeof(Value));
+    push_rax(j);
+}
+
+// a + b or a < b of the two values on top of the stack, jit_binary covers everything but numbers
+static void binary(Jit* j, size_t offset, uint8_t op){
+    load(j, RAX, R12, -16);
+    load(j, RDX, R12, -8);
+    size_t a_not_num = check_num(j, RAX);
+    size_t b_not_num = check_num(j, RDX);
+    movq_to_xmm(j, 0, RAX);
+    movq_to_xmm(j, 1, RDX);
+    size_t by_zero = 0;
+    switch (op){
+        case OP_ADD: sse(j, 0xf2, 0x58, 0, 1); break;
+        case OP_SUB: sse(j, 0xf2, 0x5c, 0, 1); break;
+        case OP_MUL: sse(j, 0xf2, 0x59, 0, 1); break;
+        case OP_DIV:
+            sse(j, 0x66, 0x57, 2, 2);
+            sse(j, 0x66, 0x2e, 1, 2);
+            by_zero = jcc(j, CC_E);
+            sse(j, 0xf2, 0x5e, 0, 1);
+            break;
+        // NaN operands compare unordered, which sets CF, so only 'above' conditions are used
+        case OP_LESS:          sse(j, 0x66, 0x2e, 1, 0); set_bool(j, CC_A); break;
+        case OP_LESS_EQUAL:    sse(j, 0x66, 0x2e, 1, 0); set_bool(j, CC_AE); break;
+        case OP_GREATER:       sse(j, 0x66, 0x2e, 0, 1); set_bool(j, CC_A); break;
+        case OP_GREATER_EQUAL: sse(j, 0x66, 0x2e, 0, 1); set_bool(j, CC_AE); break;
+    }
+    if (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV) movq_from_xmm(j, RAX, 0);
+    store(j, R12, -16, RAX);
+    add_imm(j, R12, -8);
+    size_t done = jmp(j);
+
+    patch_here(j, a_not_num);
+    patch_here(j, b_not_num);
+    if (op == OP_DIV) patch_here(j, by_zero);
+    sync(j, offset);
+    mov_imm(j, RDI, op);
+    call(j, jit_binary);
+    check_result(j);
+    reload(j);
+    patch_here(j, done);
+}
+
+// pops two values and jumps to target unless the comparison holds
+static void compare_jump(Jit* j, size_t offset, uint8_t op, size_t target){
+    load(j, RAX, R12, -16);
+    load(j, RDX, R12, -8);
+    size_t a_not_num = check_num(j, RAX);
+    size_t b_not_num = check_num(j, RDX);
+    movq_to_xmm(j, 0, RAX);
+    movq_to_xmm(j, 1, RDX);
+    add_imm(j, R12, -16);
+    switch (op){
+        case OP_JUMP_IF_NOT_LESS:          sse(j, 0x66, 0x2e, 1, 0); jump_to(j, CC_BE, target); break;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:    sse(j, 0x66, 0x2e, 1, 0); jump_to(j, CC_B, target); break;
+        case OP_JUMP_IF_NOT_GREATER:       sse(j, 0x66, 0x2e, 0, 1); jump_to(j, CC_BE, target); break;
+        case OP_JUMP_IF_NOT_GREATER_EQUAL: sse(j, 0x66, 0x2e, 0, 1); jump_to(j, CC_B, target); break;
+    }
+    size_t done = jmp(j);
+    patch_here(j, a_not_num);
+    patch_here(j, b_not_num);
+    error(j, offset, "Operands must be numbers");
+    patch_here(j, done);
+}
+
+// rax = values_equal of the two values on top of the stack, which are popped
+static void equals(Jit* j){
+    load(j, RDI, R12, -16);
+    load(j, RSI, R12, -8);
+    add_imm(j, R12, -16);
+    call(j, values_equal);
+    byte(j, 0x84);
+    byte(j, 0xc0);
+}
+
+// jumps to target if the Value in rax is nil or false
+static void jump_if_falsey(Jit* j, size_t target){
+    mov_imm(j, RCX, NIL_VAL);
+    alu(j, 0x39, RAX, RCX);
+    jump_to(j, CC_E, target);
+    mov_imm(j, RCX, FALSE_VAL);
+    alu(j, 0x39, RAX, RCX);
+    jump_to(j, CC_E, target);
+}
+
+static size_t read_3_bytes(uint8_t* code){
+    return code[0] | code[1] << 8 | code[2] << 16;
+}
+
+static size_t jump_target(uint8_t* code, size_t offset){
+    size_t amount = read_3_bytes(code + offset + 1);
+    return code[offset] == OP_LOOP ? offset + 1 - amount : offset + 1 + amount;
+}
+
+static void upvalue_location(Jit* j, size_t index){
+    load(j, RAX, R13, offsetof(CallFrame, closure));
+    load(j, RAX, RAX, offsetof(ObjClosure, upvalues));
+#ifdef COMPRESSED_HEAP
+    load32(j, RAX, RAX, index * sizeof(HEAP_REF(ObjUpvalue)));
+    mov_imm(j, RCX, (uint64_t)(uintptr_t)heap_base);
+    alu(j, 0x01, RAX, RCX);
+#else
+    load(j, RAX, RAX, index * sizeof(ObjUpvalue*));
+#endif //COMPRESSED_HEAP
+    load(j, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void global_slot_address(Jit* j){
+    load(j, RCX, R15, offsetof(VM, global_values) + offsetof(ValueArray, values));
+}
+
+// jumps past the error unless global slot in rcx has been defined, leaves its value in rax
+static void check_defined(Jit* j, size_t offset, size_t slot){
+    load(j, RAX, RCX, slot * sizeof(Value));
+    mov_imm(j, RDX, EMPTY_VAL);
+    alu(j, 0x39, RAX, RDX);
+    size_t defined = jcc(j, CC_NE);
+    sync(j, offset);
+    mov_imm(j, RDI, slot);
+    call(j, jit_undefined_global);
+    jump_to(j, -1, EXIT_ERROR);
+    patch_here(j, defined);
+}
+
+static void translate(Jit* j, size_t offset){
+    uint8_t* code = j->chunk->code + offset;
+    Value* constants = j->chunk->constants.values;
+    InlineCache* caches = j->chunk->caches;
+    // quickened instructions get the template of the generic one, which has its own fast paths
+    uint8_t op = generic_op(code[0]);
+    switch (op){
+        case OP_CONSTANT:       push_imm(j, constants[code[1]]); break;
+        case OP_CONSTANT_LONG:  push_imm(j, constants[read_3_bytes(code + 1)]); break;
+        case OP_NIL:            push_imm(j, NIL_VAL); break;
+        case OP_TRUE:           push_imm(j, TRUE_VAL); break;
+        case OP_FALSE:          push_imm(j, FALSE_VAL); break;
+        case OP_POP:            add_imm(j, R12, -8); break;
+        case OP_POPN:           add_imm(j, R12, -8 * (int32_t)read_3_bytes(code + 1)); break;
+
+        case OP_GET_LOCAL:      get_local(j, code[1]); break;
+        case OP_GET_LOCAL_LONG: get_local(j, read_3_bytes(code + 1)); break;
+        case OP_GET_LOCAL_0: case OP_GET_LOCAL_1: case OP_GET_LOCAL_2: case OP_GET_LOCAL_3:
+            get_local(j, code[0] - OP_GET_LOCAL_0);
+            break;
+        case OP_GET_LOCAL2:
+            get_local(j, code[1]);
+            get_local(j, code[2]);
+            break;
+        case OP_SET_LOCAL: case OP_SET_LOCAL_LONG: {
+            size_t slot = code[0] == OP_SET_LOCAL ? code[1] : read_3_bytes(code + 1);
+            load(j, RAX, R12, -8);
+            store(j, RBX, slot * sizeof(Value), RAX);
+        } break;
+        case OP_INC_LOCAL: {
+            int32_t slot = code[1] * sizeof(Value);
+            Value constant = constants[code[2]];
+            load(j, RAX, RBX, slot);
+            size_t not_num = check_num(j, RAX);
+            movq_to_xmm(j, 0, RAX);
+            mov_imm(j, RCX, constant);
+            movq_to_xmm(j, 1, RCX);
+            sse(j, 0xf2, 0x58, 0, 1);
+            movq_from_xmm(j, RAX, 0);
+            store(j, RBX, slot, RAX);
+            size_t done = jmp(j);
+            patch_here(j, not_num);
+            alu(j, 0x89, RDI, RBX);
+            add_imm(j, RDI, slot);
+            mov_imm(j, RSI, constant);
+            helper_call(j, offset, jit_inc_local, true);
+            patch_here(j, done);
+        } break;
+
+        case OP_GET_UPVALUE: case OP_GET_UPVALUE_LONG:
+            upvalue_location(j, code[0] == OP_GET_UPVALUE ? code[1] : read_3_bytes(code + 1));
+            load(j, RAX, RAX, 0);
+            push_rax(j);
+            break;
+        case OP_SET_UPVALUE: case OP_SET_UPVALUE_LONG:
+            // through the VM so the store gets its write barrier
+            mov_imm(j, RDI, code[0] == OP_SET_UPVALUE ? code[1] : read_3_bytes(code + 1));
+            helper_call(j, offset, jit_set_upvalue, false);
+            break;
+
+        case OP_DEFINE_GLOBAL: case OP_DEFINE_GLOBAL_LONG: {
+            size_t slot = code[0] == OP_DEFINE_GLOBAL ? code[1] : read_3_bytes(code + 1);
+            global_slot_address(j);
+            load(j, RAX, R12, -8);
+            add_imm(j, R12, -8);
+            store(j, RCX, slot * sizeof(Value), RAX);
+        } break;
+        case OP_GET_GLOBAL: case OP_GET_GLOBAL_LONG: {
+            size_t slot = code[0] == OP_GET_GLOBAL ? code[1] : read_3_bytes(code + 1);
+            global_slot_address(j);
+            check_defined(j, offset, slot);
+            push_rax(j);
+        } break;
+        case OP_SET_GLOBAL: case OP_SET_GLOBAL_LONG: {
+            size_t slot = code[0] == OP_SET_GLOBAL ? code[1] : read_3_bytes(code + 1);
+            global_slot_address(j);
+            check_defined(j, offset, slot);
+            load(j, RAX, R12, -8);
+            store(j, RCX, slot * sizeof(Value), RAX);
+        } break;
+
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_LESS: case OP_LESS_EQUAL: case OP_GREATER: case OP_GREATER_EQUAL:
+            binary(j, offset, op);
+            break;
+        case OP_MOD:
+            mov_imm(j, RDI, OP_MOD);
+            helper_call(j, offset, jit_binary, true);
+            break;
+        case OP_EQUAL: case OP_NOT_EQUAL:
+            equals(j);
+            set_bool(j, code[0] == OP_EQUAL ? CC_NE : CC_E);
+            push_rax(j);
+            break;
+        case OP_NOT:
+            load(j, RAX, R12, -8);
+            mov_imm(j, RCX, NIL_VAL);
+            alu(j, 0x39, RAX, RCX);
+            byte(j, 0x0f); byte(j, 0x94); byte(j, 0xc2);    // sete dl
+            mov_imm(j, RCX, FALSE_VAL);
+            alu(j, 0x39, RAX, RCX);
+            byte(j, 0x0f); byte(j, 0x94); byte(j, 0xc0);    // sete al
+            byte(j, 0x08); byte(j, 0xd0);                   // or al, dl
+            byte(j, 0x84); byte(j, 0xc0);                   // test al, al
+            set_bool(j, CC_NE);
+            store(j, R12, -8, RAX);
+            break;
+        case OP_NEGATE: {
+            load(j, RAX, R12, -8);
+            size_t not_num = check_num(j, RAX);
+            movq_to_xmm(j, 0, RAX);
+            mov_imm(j, RCX, NUM_VAL(-1));
+            movq_to_xmm(j, 1, RCX);
+            sse(j, 0xf2, 0x59, 0, 1);
+            movq_from_xmm(j, RAX, 0);
+            store(j, R12, -8, RAX);
+            size_t done = jmp(j);
+            patch_here(j, not_num);
+            error(j, offset, "operand must be a number");
+            patch_here(j, done);
+        } break;
+        case OP_PRINT:          helper_call(j, offset, jit_print, false); break;
+
+        case OP_JUMP: case OP_LOOP:
+            jump_to(j, -1, jump_target(j->chunk->code, offset));
+            break;
+        case OP_JUMP_IF_FALSE:
+            load(j, RAX, R12, -8);
+            jump_if_falsey(j, jump_target(j->chunk->code, offset));
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            load(j, RAX, R12, -8);
+            add_imm(j, R12, -8);
+            jump_if_falsey(j, jump_target(j->chunk->code, offset));
+            break;
+        case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+            equals(j);
+            jump_to(j, code[0] == OP_JUMP_IF_NOT_EQUAL ? CC_E : CC_NE, jump_target(j->chunk->code, offset));
+            break;
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            compare_jump(j, offset, code[0], jump_target(j->chunk->code, offset));
+            break;
+
+        case OP_CALL:
+            mov_imm(j, RDI, code[1]);
+            call_helper(j, offset, jit_call);
+            break;
+        case OP_RETURN:
+            store(j, R15, offsetof(VM, sp), R12);
+            call(j, jit_return);
+            jump_to(j, -1, EXIT_OK);
+            break;
+        case OP_CLOSURE: case OP_CLOSURE_LONG: {
+            size_t index = code[0] == OP_CLOSURE ? code[1] : read_3_bytes(code + 1);
+            mov_imm(j, RDI, (uint64_t)(uintptr_t)AS_FUNCTION(constants[index]));
+            mov_imm(j, RSI, (uint64_t)(uintptr_t)(code + (code[0] == OP_CLOSURE ? 2 : 4)));
+            helper_call(j, offset, jit_closure, false);
+        } break;
+        case OP_CLOSE_UPVALUE:  helper_call(j, offset, jit_close_upvalue, false); break;
+
+        case OP_ARRAY: case OP_ARRAY_LONG:
+            mov_imm(j, RDI, code[0] == OP_ARRAY ? code[1] : read_3_bytes(code + 1));
+            helper_call(j, offset, jit_array, false);
+            break;
+        case OP_GET_INDEX:      helper_call(j, offset, jit_get_index, true); break;
+        case OP_SET_INDEX:      helper_call(j, offset, jit_set_index, true); break;
+
+        case OP_GET_PROP: case OP_SET_PROP: case OP_GET_PROP_LONG: case OP_SET_PROP_LONG: {
+            bool is_long = code[0] == OP_GET_PROP_LONG || code[0] == OP_SET_PROP_LONG;
+            size_t name = is_long ? read_3_bytes(code + 1) : code[1];
+            size_t cache = read_3_bytes(code + (is_long ? 4 : 2));
+            mov_imm(j, RDI, (uint64_t)(uintptr_t)AS_STRING(constants[name]));
+            mov_imm(j, RSI, (uint64_t)(uintptr_t)&caches[cache]);
+            bool get = code[0] == OP_GET_PROP || code[0] == OP_GET_PROP_LONG;
+            helper_call(j, offset, get ? (void*)jit_get_property : (void*)jit_set_property, true);
+        } break;
+        case OP_INVOKE: case OP_SUPER_INVOKE:
+            mov_imm(j, RDI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            mov_imm(j, RSI, code[2]);
+            mov_imm(j, RDX, (uint64_t)(uintptr_t)&caches[read_3_bytes(code + 3)]);
+            call_helper(j, offset, code[0] == OP_INVOKE ? (void*)jit_invoke : (void*)jit_super_invoke);
+            break;
+        case OP_CLASS: case OP_METHOD: case OP_GET_SUPER: {
+            mov_imm(j, RDI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            if (code[0] == OP_CLASS) helper_call(j, offset, jit_class, false);
+            else if (code[0] == OP_METHOD) helper_call(j, offset, jit_method, false);
+            else helper_call(j, offset, jit_get_super, true);
+        } break;
+        case OP_INHERIT:        helper_call(j, offset, jit_inherit, true); break;
+    }
+}
+
+static void prologue(Jit* j){
+    byte(j, 0x53);                          // push rbx
+    byte(j, 0x41); byte(j, 0x54);           // push r12
+    byte(j, 0x41); byte(j, 0x55);           // push r13
+    byte(j, 0x41); byte(j, 0x56);           // push r14
+    byte(j, 0x41); byte(j, 0x57);           // push r15
+    alu(j, 0x89, R13, RDI);
+    load(j, RBX, R13, offsetof(CallFrame, slots));
+    mov_imm(j, R15, (uint64_t)(uintptr_t)vm);
+    reload(j);
+    mov_imm(j, R14, QNAN);
+}
+
+static void epilogue(Jit* j, InterpreterResult result){
+    byte(j, 0xb8);                          // mov eax, result
+    bytes4(j, result);
+    byte(j, 0x41); byte(j, 0x5f);           // pop r15
+    byte(j, 0x41); byte(j, 0x5e);           // pop r14
+    byte(j, 0x41); byte(j, 0x5d);           // pop r13
+    byte(j, 0x41); byte(j, 0x5c);           // pop r12
+    byte(j, 0x5b);                          // pop rbx
+    byte(j, 0xc3);                          // ret
+}
+
+static const char* function_name(ObjFunction* function){
+    return function->name != NULL ? function->name->chars : "<Script>";
+}
+
+bool jit_compile(ObjFunction* function, bool print_stats){
+    if (function->reg != NULL){
+        if (print_stats) fprintf(stderr, "=== jit %s: kept on the register VM ===\n", function_name(function));
+        return false;
+    }
+    Chunk* chunk = &function->chunk;
+    Jit j;
+    memset(&j, 0, sizeof(Jit));
+    j.chunk = chunk;
+    j.native_at = grow(NULL, sizeof(size_t) * (chunk->count + 1));
+
+    prologue(&j);
+    for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)){
+        j.native_at[offset] = j.count;
+        translate(&j, offset);
+    }
+    size_t exit_ok = j.count;
+    epilogue(&j, INTERPRET_OK);
+    size_t exit_error = j.count;
+    epilogue(&j, INTERPRET_RUNTIME_ERR);
+
+    for (size_t i = 0; i < j.jump_count; i++){
+        NativeJump* jump = &j.jumps[i];
+        size_t target = jump->target == EXIT_OK ? exit_ok
+                      : jump->target == EXIT_ERROR ? exit_error
+                      : j.native_at[jump->target];
+        uint32_t rel = target - (jump->at + 4);
+        memcpy(j.code + jump->at, &rel, 4);
+    }
+
+    // the code is written while the mapping is writable and only then made executable
+    void* memory = mmap(NULL, j.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool mapped = memory != MAP_FAILED;
+    if (mapped){
+        memcpy(memory, j.code, j.count);
+        if (mprotect(memory, j.count, PROT_READ | PROT_EXEC) != 0){
+            munmap(memory, j.count);
+            mapped = false;
+        }
+    }
+    if (print_stats){
+        if (mapped){
+            fprintf(stderr, "=== jit %s: %zu bytes of bytecode -> %zu bytes of machine code ===\n",
+                    function_name(function), chunk->count, j.count);
+        } else {
+            fprintf(stderr, "=== jit %s: couldn't map executable memory ===\n", function_name(function));
+        }
+    }
+    if (mapped){
+        JitCode* jit = ALLOCATE(JitCode, 1);
+        jit->entry = (InterpreterResult (*)(CallFrame*))memory;
+        jit->size = j.count;
+        function->jit = jit;
+    }
+    free(j.code);
+    free(j.native_at);
+    free(j.jumps);
+    return mapped;
+}
+
+void free_jit_code(JitCode* code){
+    munmap((void*)code->entry, code->size);
+    FREE(JitCode, code);
+}
+
+#else
+
+bool jit_compile(ObjFunction* function, bool print_stats){
+    if (print_stats){
+        fprintf(stderr, "=== jit %s: native code is only generated on x86-64 Linux ===\n",
+                function->name != NULL ? function->name->chars : "<Script>");
+    }
+    return false;
+}
+
+void free_jit_code(JitCode* code){
+    FREE(JitCode, code);
+}
+
+#endif
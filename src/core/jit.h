@@ -0,0 +1,39 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "vm.h"
+
+#define JIT_DEFAULT_THRESHOLD 100
+
+typedef struct JitCode {
+    InterpreterResult (*entry)(CallFrame* frame);   // runs the frame until it returns
+    size_t size;                                     // bytes of executable memory mapped for it
+} JitCode;
+
+bool jit_compile(ObjFunction* function, bool print_stats);
+void free_jit_code(JitCode* code);
+
+// runtime entry points called by the generated code, implemented in vm.c
+CallFrame* jit_call(size_t arg_count);
+CallFrame* jit_invoke(ObjString* name, size_t arg_count, InlineCache* cache);
+CallFrame* jit_super_invoke(ObjString* name, size_t arg_count, InlineCache* cache);
+void jit_return();
+bool jit_binary(uint8_t op);
+bool jit_inc_local(Value* slot, Value constant);
+bool jit_error(const char* message);
+bool jit_undefined_global(size_t slot);
+void jit_print();
+void jit_array(size_t count);
+bool jit_get_index();
+bool jit_set_index();
+bool jit_get_property(ObjString* name, InlineCache* cache);
+bool jit_set_property(ObjString* name, InlineCache* cache);
+void jit_closure(ObjFunction* function, uint8_t* upvalues);
+void jit_set_upvalue(size_t index);
+void jit_close_upvalue();
+void jit_class(ObjString* name);
+void jit_method(ObjString* name);
+bool jit_inherit();
+bool jit_get_super(ObjString* name);
+
+#endif //_JIT_H
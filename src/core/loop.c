@@ -0,0 +1,533 @@
+// sockets and poll are hidden by -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loop.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef __unix__
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif //__unix__
+#ifdef __linux__
+#include <sys/epoll.h>
+#define IO_EVENTS 64                  // events taken from epoll at once
+#endif //__linux__
+
+void init_event_loop(EventLoop* loop){
+    loop->epoll_fd = -1;
+    loop->fds = NULL;
+    loop->fd_cap = 0;
+    loop->waiting = 0;
+    loop->finished = NULL;
+    loop->last_finished = NULL;
+    loop->tasks = NULL;
+    loop->task_next = 0;
+    loop->task_count = 0;
+    loop->task_cap = 0;
+    loop->awaited = NULL;
+    loop->awaited_result = NIL_VAL;
+}
+
+void free_event_loop(EventLoop* loop){
+    for (size_t fd = 0; fd < loop->fd_cap; fd++){
+        Descriptor* d = &loop->fds[fd];
+        FREE_ARRAY(char, d->buffer, d->cap);
+        if (d->reader != NULL) FREE(Waiter, d->reader);
+        if (d->writer != NULL) FREE(Waiter, d->writer);
+    }
+    while (loop->finished != NULL){
+        Waiter* next = loop->finished->next;
+        FREE(Waiter, loop->finished);
+        loop->finished = next;
+    }
+    FREE_ARRAY(Descriptor, loop->fds, loop->fd_cap);
+    FREE_ARRAY(ObjFiber*, loop->tasks, loop->task_cap);
+#ifdef __linux__
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+#endif //__linux__
+    init_event_loop(loop);
+}
+
+static void mark_waiter(Waiter* waiter){
+    if (waiter == NULL) return;
+    mark_object((Obj*)waiter->fiber);
+    mark_value(waiter->data);
+    mark_value(waiter->result);
+}
+
+void mark_event_loop(){
+    EventLoop* loop = &vm->loop;
+    for (size_t fd = 0; fd < loop->fd_cap; fd++){
+        mark_waiter(loop->fds[fd].reader);
+        mark_waiter(loop->fds[fd].writer);
+    }
+    for (Waiter* waiter = loop->finished; waiter != NULL; waiter = waiter->next){
+        mark_waiter(waiter);
+    }
+    for (size_t i = loop->task_next; i < loop->task_count; i++){
+        mark_object((Obj*)loop->tasks[i]);
+    }
+    mark_object((Obj*)loop->awaited);
+    mark_value(loop->awaited_result);
+}
+
+static Descriptor* descriptor(int fd){
+    EventLoop* loop = &vm->loop;
+    if ((size_t)fd >= loop->fd_cap){
+        // the collector marks the waiters of fd_cap descriptors, it only grows once they exist
+        size_t cap = loop->fd_cap;
+        while (cap <= (size_t)fd) cap = GROW_CAP(cap);
+        loop->fds = GROW_ARRAY(Descriptor, loop->fds, loop->fd_cap, cap);
+        memset(loop->fds + loop->fd_cap, 0, sizeof(Descriptor) * (cap - loop->fd_cap));
+        loop->fd_cap = cap;
+    }
+    return &loop->fds[fd];
+}
+
+// moves count bytes of the buffer into a string and drops skip bytes after them
+static Value take_buffer(Descriptor* d, size_t count, size_t skip){
+    Value string = OBJ_VAL(copy_string(d->buffer, count));
+    d->length -= count + skip;
+    memmove(d->buffer, d->buffer + count + skip, d->length);
+    return string;
+}
+
+#ifdef __unix__
+
+// writes to a closed pipe or socket fail with EPIPE instead of ending the process
+static int own(int fd){
+    static bool ignoring_sigpipe = false;
+    if (!ignoring_sigpipe){
+        signal(SIGPIPE, SIG_IGN);
+        ignoring_sigpipe = true;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    descriptor(fd)->nonblocking = true;
+    descriptor(fd)->opened = true;
+    return fd;
+}
+
+// descriptors the loop didn't open may block, they are only used once poll says they are ready
+static bool ready(int fd, short events){
+    if ((size_t)fd < vm->loop.fd_cap && vm->loop.fds[fd].nonblocking) return true;
+    struct pollfd request = { fd, events, 0 };
+    return poll(&request, 1, 0) != 0;
+}
+
+static bool would_block(){
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+bool io_is_open(int fd){
+    return fd >= 0 && (size_t)fd < vm->loop.fd_cap && vm->loop.fds[fd].opened;
+}
+
+int io_open(const char* path, const char* mode){
+    int flags;
+    if (strcmp(mode, "r") == 0) flags = O_RDONLY;
+    else if (strcmp(mode, "w") == 0) flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (strcmp(mode, "a") == 0) flags = O_WRONLY | O_CREAT | O_APPEND;
+    else return -1;
+    // regular files are always ready, reading or writing them doesn't wait on the loop
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd >= 0) descriptor(fd)->opened = true;
+    return fd;
+}
+
+bool io_pipe(int fds[2]){
+    if (pipe(fds) != 0) return false;
+    own(fds[0]);
+    own(fds[1]);
+    return true;
+}
+
+static int open_socket(Value address, struct sockaddr_storage* storage, socklen_t* length){
+    memset(storage, 0, sizeof(*storage));
+    if (IS_NUM(address)){
+        double port = AS_NUM(address);
+        if (!(port >= 1 && port <= 65535) || port != (int)port) return -1;
+        struct sockaddr_in* in = (struct sockaddr_in*)storage;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *length = sizeof(struct sockaddr_in);
+    } else if (IS_STRING(address)){
+        struct sockaddr_un* un = (struct sockaddr_un*)storage;
+        ObjString* path = AS_STRING(address);
+        if (path->length == 0 || path->length >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path->chars, path->length);
+        *length = sizeof(struct sockaddr_un);
+    } else {
+        return -1;
+    }
+    int fd = socket(storage->ss_family, SOCK_STREAM, 0);
+    return fd < 0 ? -1 : own(fd);
+}
+
+int io_listen(Value address){
+    struct sockaddr_storage storage;
+    socklen_t length;
+    int fd = open_socket(address, &storage, &length);
+    if (fd < 0) return -1;
+    int reuse = 1;
+    if (storage.ss_family == AF_INET) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr*)&storage, length) != 0 || listen(fd, SOMAXCONN) != 0){
+        io_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int io_connect(Value address, bool* in_progress){
+    struct sockaddr_storage storage;
+    socklen_t length;
+    int fd = open_socket(address, &storage, &length);
+    if (fd < 0) return -1;
+    *in_progress = false;
+    if (connect(fd, (struct sockaddr*)&storage, length) == 0) return fd;
+    if (errno == EINPROGRESS){
+        *in_progress = true;
+        return fd;
+    }
+    io_close(fd);
+    return -1;
+}
+
+// closes the descriptor, leaving its waiters to whoever registered them
+static bool forget(int fd){
+    if ((size_t)fd < vm->loop.fd_cap){
+        Descriptor* d = &vm->loop.fds[fd];
+        FREE_ARRAY(char, d->buffer, d->cap);
+        d->buffer = NULL;
+        d->length = d->cap = 0;
+        d->nonblocking = false;
+        d->opened = false;
+    }
+    return close(fd) == 0;
+}
+
+bool io_close(int fd){
+    if ((size_t)fd < vm->loop.fd_cap){
+        Descriptor* d = &vm->loop.fds[fd];
+        if (d->reader != NULL || d->writer != NULL) return false;
+    }
+    return forget(fd);
+}
+
+static bool attempt_read(Waiter* waiter){
+    int fd = waiter->fd;
+    Descriptor* d = (size_t)fd < vm->loop.fd_cap ? &vm->loop.fds[fd] : NULL;
+    if (d != NULL && d->length > 0){
+        waiter->result = take_buffer(d, waiter->size < d->length ? waiter->size : d->length, 0);
+        return true;
+    }
+    if (!ready(fd, POLLIN)) return false;
+    char chunk[IO_CHUNK];
+    ssize_t count;
+    do {
+        count = read(fd, chunk, waiter->size < IO_CHUNK ? waiter->size : IO_CHUNK);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0 && would_block()) return false;
+    waiter->result = count >= 0 ? OBJ_VAL(copy_string(chunk, count)) : NIL_VAL;
+    return true;
+}
+
+static bool attempt_read_line(Waiter* waiter){
+    int fd = waiter->fd;
+    for (;;){
+        Descriptor* d = descriptor(fd);
+        char* newline = d->length > 0 ? memchr(d->buffer, '\n', d->length) : NULL;
+        if (newline != NULL){
+            waiter->result = take_buffer(d, newline - d->buffer, 1);
+            return true;
+        }
+        if (!ready(fd, POLLIN)) return false;
+        if (d->cap < d->length + IO_CHUNK){
+            size_t old_cap = d->cap;
+            while (d->cap < d->length + IO_CHUNK) d->cap = GROW_CAP(d->cap);
+            d->buffer = GROW_ARRAY(char, d->buffer, old_cap, d->cap);
+        }
+        ssize_t count = read(fd, d->buffer + d->length, IO_CHUNK);
+        if (count > 0){
+            d->length += count;
+            continue;
+        }
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && would_block()) return false;
+        // at the end, what is left is the last line
+        waiter->result = count == 0 && d->length > 0 ? take_buffer(d, d->length, 0) : NIL_VAL;
+        return true;
+    }
+}
+
+static bool attempt_write(Waiter* waiter){
+    ObjString* data = AS_STRING(waiter->data);
+    while (waiter->size < data->length){
+        if (!ready(waiter->fd, POLLOUT)) return false;
+        ssize_t count = write(waiter->fd, data->chars + waiter->size, data->length - waiter->size);
+        if (count >= 0){
+            waiter->size += count;
+        } else if (errno != EINTR){
+            if (would_block()) return false;
+            waiter->result = NIL_VAL;
+            return true;
+        }
+    }
+    waiter->result = NUM_VAL(data->length);
+    return true;
+}
+
+static bool attempt_accept(Waiter* waiter){
+    if (!ready(waiter->fd, POLLIN)) return false;
+    int fd = accept(waiter->fd, NULL, NULL);
+    if (fd < 0 && (would_block() || errno == EINTR || errno == ECONNABORTED)) return false;
+    waiter->result = fd >= 0 ? NUM_VAL(own(fd)) : NIL_VAL;
+    return true;
+}
+
+static bool attempt_connect(Waiter* waiter){
+    struct pollfd request = { waiter->fd, POLLOUT, 0 };
+    if (poll(&request, 1, 0) == 0) return false;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(waiter->fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0){
+        waiter->result = NUM_VAL(waiter->fd);
+    } else {
+        forget(waiter->fd);
+        waiter->result = NIL_VAL;
+    }
+    return true;
+}
+
+bool io_attempt(Waiter* waiter){
+    switch (waiter->operation){
+        case IO_READ: return attempt_read(waiter);
+        case IO_READ_LINE: return attempt_read_line(waiter);
+        case IO_WRITE: return attempt_write(waiter);
+        case IO_ACCEPT: return attempt_accept(waiter);
+        case IO_CONNECT: return attempt_connect(waiter);
+    }
+    return true;
+}
+
+static void finish(Waiter* waiter){
+    EventLoop* loop = &vm->loop;
+    waiter->done = true;
+    waiter->next = NULL;
+    if (loop->last_finished != NULL) loop->last_finished->next = waiter;
+    else loop->finished = waiter;
+    loop->last_finished = waiter;
+}
+
+static Waiter** side_of(Waiter* waiter){
+    Descriptor* d = descriptor(waiter->fd);
+    return waiter->operation == IO_WRITE || waiter->operation == IO_CONNECT ? &d->writer : &d->reader;
+}
+
+#ifdef __linux__
+
+// keeps the events registered with epoll in line with the waiters of the descriptor
+static bool watch(int fd){
+    EventLoop* loop = &vm->loop;
+    if (loop->epoll_fd < 0 && (loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) return false;
+    Descriptor* d = &loop->fds[fd];
+    uint32_t events = (d->reader != NULL ? EPOLLIN : 0) | (d->writer != NULL ? EPOLLOUT : 0);
+    if (events == d->events) return true;
+    struct epoll_event event = { .events = events, .data.fd = fd };
+    int op = d->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, fd, &event) != 0 && events != 0) return false;
+    d->events = events;
+    return true;
+}
+
+#else //__linux__
+
+static bool watch(int fd){
+    UNUSED(fd);
+    return true;
+}
+
+#endif //__linux__
+
+bool io_wait(Waiter* waiter){
+    Waiter** side = side_of(waiter);
+    if (*side != NULL) return false;
+    *side = waiter;
+    vm->loop.waiting++;
+    if (watch(waiter->fd)) return true;
+    io_cancel(waiter);
+    return false;
+}
+
+void io_cancel(Waiter* waiter){
+    EventLoop* loop = &vm->loop;
+    if (waiter->done){
+        Waiter* previous = NULL;
+        for (Waiter* w = loop->finished; w != NULL; previous = w, w = w->next){
+            if (w != waiter) continue;
+            if (previous != NULL) previous->next = w->next;
+            else loop->finished = w->next;
+            if (loop->last_finished == w) loop->last_finished = previous;
+            break;
+        }
+        return;
+    }
+    Waiter** side = side_of(waiter);
+    if (*side != waiter) return;
+    *side = NULL;
+    loop->waiting--;
+    watch(waiter->fd);
+}
+
+static void retry(Waiter* waiter){
+    if (waiter == NULL || !io_attempt(waiter)) return;
+    io_cancel(waiter);
+    finish(waiter);
+}
+
+#ifdef __linux__
+
+static void wait_for_events(){
+    struct epoll_event events[IO_EVENTS];
+    int count = epoll_wait(vm->loop.epoll_fd, events, IO_EVENTS, -1);
+    for (int i = 0; i < count; i++){
+        int fd = events[i].data.fd;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) retry(vm->loop.fds[fd].reader);
+        if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) retry(vm->loop.fds[fd].writer);
+    }
+}
+
+#else //__linux__
+
+static void wait_for_events(){
+    EventLoop* loop = &vm->loop;
+    struct pollfd* requests = ALLOCATE(struct pollfd, loop->waiting);
+    size_t count = 0;
+    for (size_t fd = 0; fd < loop->fd_cap && count < loop->waiting; fd++){
+        Descriptor* d = &loop->fds[fd];
+        if (d->reader == NULL && d->writer == NULL) continue;
+        short events = (d->reader != NULL ? POLLIN : 0) | (d->writer != NULL ? POLLOUT : 0);
+        requests[count++] = (struct pollfd){ fd, events, 0 };
+    }
+    size_t waiting = loop->waiting;
+    if (poll(requests, count, -1) > 0){
+        for (size_t i = 0; i < count; i++){
+            short events = requests[i].revents;
+            if (events & (POLLIN | POLLHUP | POLLERR)) retry(loop->fds[requests[i].fd].reader);
+            if (events & (POLLOUT | POLLHUP | POLLERR)) retry(loop->fds[requests[i].fd].writer);
+        }
+    }
+    FREE_ARRAY(struct pollfd, requests, waiting);
+}
+
+#endif //__linux__
+
+#else //__unix__
+
+bool io_is_open(int fd){
+    UNUSED(fd);
+    return false;
+}
+
+int io_open(const char* path, const char* mode){
+    UNUSED(path); UNUSED(mode);
+    return -1;
+}
+
+bool io_pipe(int fds[2]){
+    UNUSED(fds);
+    return false;
+}
+
+int io_listen(Value address){
+    UNUSED(address);
+    return -1;
+}
+
+int io_connect(Value address, bool* in_progress){
+    UNUSED(address); UNUSED(in_progress);
+    return -1;
+}
+
+bool io_close(int fd){
+    UNUSED(fd);
+    return false;
+}
+
+// without a way to wait for readiness only lines of stdin can be read, and they block
+bool io_attempt(Waiter* waiter){
+    waiter->result = NIL_VAL;
+    if (waiter->operation != IO_READ_LINE) return true;
+    Descriptor* d = descriptor(0);
+    int c;
+    while ((c = fgetc(stdin)) != EOF && c != '\n'){
+        if (d->cap < d->length + 1){
+            size_t old_cap = d->cap;
+            d->cap = GROW_CAP(d->cap);
+            d->buffer = GROW_ARRAY(char, d->buffer, old_cap, d->cap);
+        }
+        d->buffer[d->length++] = (char)c;
+    }
+    if (c != EOF || d->length > 0) waiter->result = take_buffer(d, d->length, 0);
+    return true;
+}
+
+bool io_wait(Waiter* waiter){
+    UNUSED(waiter);
+    return false;
+}
+
+void io_cancel(Waiter* waiter){
+    UNUSED(waiter);
+}
+
+static void wait_for_events(){}
+
+#endif //__unix__
+
+Waiter* io_next(){
+    EventLoop* loop = &vm->loop;
+    while (loop->finished == NULL && loop->waiting > 0) wait_for_events();
+    Waiter* waiter = loop->finished;
+    if (waiter != NULL){
+        loop->finished = waiter->next;
+        if (loop->finished == NULL) loop->last_finished = NULL;
+    }
+    return waiter;
+}
+
+bool io_pending(){
+    EventLoop* loop = &vm->loop;
+    return loop->task_next < loop->task_count || loop->waiting > 0 || loop->finished != NULL;
+}
+
+void queue_task(ObjFiber* fiber){
+    EventLoop* loop = &vm->loop;
+    if (loop->task_count + 1 > loop->task_cap){
+        size_t old_cap = loop->task_cap;
+        loop->task_cap = GROW_CAP(loop->task_cap);
+        loop->tasks = GROW_ARRAY(ObjFiber*, loop->tasks, old_cap, loop->task_cap);
+    }
+    loop->tasks[loop->task_count++] = fiber;
+}
+
+ObjFiber* next_task(){
+    EventLoop* loop = &vm->loop;
+    if (loop->task_next == loop->task_count) return NULL;
+    ObjFiber* fiber = loop->tasks[loop->task_next++];
+    if (loop->task_next == loop->task_count) loop->task_next = loop->task_count = 0;
+    return fiber;
+}
@@ -0,0 +1,89 @@
+#ifndef _LOOP_H
+#define _LOOP_H
+
+#include "../common/object.h"
+
+// The event loop of a VM. An I/O operation that would block suspends the fiber calling it until
+// its descriptor is ready, while the script waits it runs the loop itself, resuming the fibers
+// whose operations finished and starting the tasks queued by async. Descriptors are plain numbers
+// to scripts. Readiness comes from epoll on Linux and poll on other unix systems, elsewhere only
+// reading lines from stdin works.
+
+#define IO_CHUNK 16384                // most bytes a single read takes from a descriptor
+
+typedef enum {
+    IO_READ,                          // up to size bytes
+    IO_READ_LINE,                     // bytes up to the next newline, which is dropped
+    IO_WRITE,                         // all of data, size counts the bytes written so far
+    IO_ACCEPT,
+    IO_CONNECT,                       // finishes a connect that was in progress
+} IOOperation;
+
+typedef struct Waiter {
+    IOOperation operation;
+    int fd;
+    size_t size;
+    Value data;
+    ObjFiber* fiber;                  // fiber to resume once the operation finished, NULL for the script
+    bool done;
+    Value result;
+    struct Waiter* next;              // next finished waiter
+} Waiter;
+
+typedef struct {
+    char* buffer;                     // bytes read past the last line
+    size_t length;
+    size_t cap;
+    Waiter* reader;                   // waiting to read or accept
+    Waiter* writer;                   // waiting to write or connect
+    uint32_t events;                  // events registered with epoll
+    bool nonblocking;                 // opened by the loop, operations on it never block
+    bool opened;                      // opened by the script, which may use and close it
+} Descriptor;
+
+typedef struct {
+    int epoll_fd;                     // -1 until an operation first had to wait
+    Descriptor* fds;                  // indexed by file descriptor
+    size_t fd_cap;
+    size_t waiting;                   // waiters registered for readiness
+    Waiter* finished;                 // finished waiters not taken by io_next yet
+    Waiter* last_finished;
+    ObjFiber** tasks;                 // fibers queued by async
+    size_t task_next;                 // next queued fiber to start
+    size_t task_count;
+    size_t task_cap;
+    ObjFiber* awaited;                // fiber whose result the script waits for in resume
+    Value awaited_result;
+} EventLoop;
+
+// the functions below work on the loop of the bound VM
+void init_event_loop(EventLoop* loop);
+void free_event_loop(EventLoop* loop);
+void mark_event_loop();
+
+// descriptors opened here never block, -1 if opening failed. An address is a port on
+// the loopback interface or the path of a unix domain socket. Only these are open as far
+// as io_is_open goes, descriptors the process or the loop itself holds aren't
+bool io_is_open(int fd);
+int io_open(const char* path, const char* mode);
+bool io_pipe(int fds[2]);
+int io_listen(Value address);
+int io_connect(Value address, bool* in_progress);
+bool io_close(int fd);
+
+// tries the operation without blocking, true once it finished and result holds its result
+bool io_attempt(Waiter* waiter);
+// tries the operation again every time its descriptor gets ready, false if another waiter
+// already waits on that side of the descriptor or it can't be watched
+bool io_wait(Waiter* waiter);
+// forgets a waiter that is registered or finished but wasn't taken by io_next
+void io_cancel(Waiter* waiter);
+// blocks until a waiter finished and returns it, NULL when none waits anymore
+Waiter* io_next();
+// true while tasks are queued or waiters haven't been taken by io_next
+bool io_pending();
+
+void queue_task(ObjFiber* fiber);
+ObjFiber* next_task();
+
+#endif //_LOOP_H
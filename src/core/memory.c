@@ -1,7 +1,49 @@
+#define _POSIX_C_SOURCE 200112L
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "memory.h"
 #include "compiler.h"
+#include "jit.h"
+
+#ifdef __unix__
+#include <pthread.h>
+#include <sched.h>
+
+#define MARK_BATCH 64                 // gray objects a marker hands over for stealing at once
+
+typedef struct Marking Marking;
+
+// every marking thread works off a private gray stack and moves a batch to its
+// shared one whenever that ran empty, idle markers steal half of a shared stack
+typedef struct {
+    Obj** local;
+    size_t local_count;
+    size_t local_cap;
+    pthread_mutex_t lock;             // guards the shared stack
+    Obj** shared;
+    size_t shared_count;
+    size_t shared_cap;
+    size_t index;
+    Marking* marking;
+} Marker;
+
+// the markers of one parallel mark of vm
+struct Marking {
+    VM* vm;
+    Marker markers[GC_MAX_THREADS];
+    size_t marker_count;
+    size_t idle_markers;
+};
+
+static __thread Marker* current_marker; // set while the thread takes part in a parallel mark
+
+// while the background sweeper runs it shares the allocator with the program
+static __thread bool holds_heap_lock;
+
+static void start_sweeper();
+#endif //__unix__
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
@@ -10,18 +52,73 @@
 #endif //DEBUG_LOG_GC
 
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size){
-    vm.bytes_allocated += new_size - old_size;
-    if (new_size > old_size){
-#ifdef DEBUG_STRESS_GC
-        collect_garbage();
-#else //DEBUG_STRESS_GC
-        if (vm.bytes_allocated > vm.next_GC){
-            collect_garbage();
-        }
-#endif
+static void gc_step(size_t budget);
+void free_object(Obj* object);
+
+// set while visit_references walks an object, mark_object hands it the references instead
+static __thread void (*reference_visitor)(Obj* child, void* context);
+static __thread void* visitor_context;
+
+// nested calls on a thread that already holds the heap lock go through
+static bool lock_heap(){
+#ifdef __unix__
+    if (!vm->sweeper_running || holds_heap_lock) return false;
+    pthread_mutex_lock(&vm->heap_lock);
+    holds_heap_lock = true;
+    return true;
+#else //__unix__
+    return false;
+#endif //__unix__
+}
+
+static void unlock_heap(bool locked){
+#ifdef __unix__
+    if (!locked) return;
+    holds_heap_lock = false;
+    pthread_mutex_unlock(&vm->heap_lock);
+#else //__unix__
+    (void)locked;
+#endif //__unix__
+}
+
+// wall clock time, the collector's own threads would count towards clock()
+static double now(){
+#ifdef __unix__
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+#else //__unix__
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif //__unix__
+}
+
+// blocks up to SLAB_MAX_SIZE come from the size classes of vm->slab, larger ones from malloc
+static void release_block(void* pointer, size_t size){
+    if (size <= SLAB_MAX_SIZE){
+        slab_free(&vm->slab, pointer, size);
+    } else {
+        free(pointer);
     }
-    
+}
+
+static void collect_if_needed(){
+    if (vm->options.gc_stress){
+        collect_young();
+        gc_step(vm->gc_phase == GC_IDLE ? 0 : 1);
+        return;
+    }
+    if (vm->gc_phase != GC_IDLE){
+        gc_step(vm->options.gc_budget);
+    } else if (vm->bytes_allocated > vm->next_GC){
+        gc_step(0);
+    }
+    if (vm->young_bytes > vm->options.gc_nursery){
+        collect_young();
+    }
+}
+
+static void* resize_block(void* pointer, size_t old_size, size_t new_size){
+#ifdef DEBUG_NO_SLAB
     if (new_size == 0){
         free(pointer);
         return NULL;
@@ -33,6 +130,103 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size){
         exit(1);
     }
     return result;
+#else //DEBUG_NO_SLAB
+    if (new_size == 0){
+        if (pointer != NULL) release_block(pointer, old_size);
+        return NULL;
+    }
+
+    bool was_small = old_size <= SLAB_MAX_SIZE;
+    bool is_small = new_size <= SLAB_MAX_SIZE;
+    if (pointer != NULL && !was_small && !is_small){
+        void* result = realloc(pointer, new_size);
+        if (result == NULL) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        return result;
+    }
+    if (pointer != NULL && was_small && is_small && SLAB_CLASS(old_size) == SLAB_CLASS(new_size)){
+        return pointer;
+    }
+
+    void* result;
+    if (is_small){
+        result = slab_alloc(&vm->slab, new_size);
+    } else {
+        result = malloc(new_size);
+        if (result == NULL) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        vm->slab.large_allocs++;
+    }
+    if (pointer != NULL){
+        memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        release_block(pointer, old_size);
+    }
+    return result;
+#endif //DEBUG_NO_SLAB
+}
+
+void* reallocate(void* pointer, size_t old_size, size_t new_size){
+    if (new_size > old_size) collect_if_needed();
+    bool locked = lock_heap();
+    vm->bytes_allocated += new_size - old_size;
+    if (vm->bytes_allocated > vm->telemetry.peak_heap) vm->telemetry.peak_heap = vm->bytes_allocated;
+    void* result = resize_block(pointer, old_size, new_size);
+    unlock_heap(locked);
+    return result;
+}
+
+static void release_dead(void* object){
+    free_object((Obj*)object);
+}
+
+static void track_young(Obj* object){
+    if (vm->young_count + 1 > vm->young_cap){
+        vm->young_cap = GROW_CAP(vm->young_cap);
+        vm->young = (Obj**)realloc(vm->young, sizeof(Obj*) * vm->young_cap);
+        if (vm->young == NULL) {
+            fprintf(stderr, "Couldn't realloc young objects\n");
+            exit(1);
+        }
+    }
+    vm->young[vm->young_count++] = object;
+}
+
+// objects come from their own size classes, which are swept lazily: a class that
+// ran out of free blocks sweeps its next unswept page before taking a fresh one
+Obj* allocate_object(size_t size, ObjType type){
+    collect_if_needed();
+    bool locked = lock_heap();
+    vm->bytes_allocated += size;
+    if (vm->bytes_allocated > vm->telemetry.peak_heap) vm->telemetry.peak_heap = vm->bytes_allocated;
+    vm->telemetry.allocated[type]++;
+    vm->telemetry.allocated_bytes[type] += size;
+#ifndef DEBUG_NO_SLAB
+    if (size <= SLAB_MAX_SIZE){
+        size_t class_index = SLAB_CLASS(size);
+        SizeClass* size_class = &vm->slab.objects[class_index];
+        if (size_class->free == NULL && size_class->sweep != NULL){
+            double start = now();
+            while (size_class->free == NULL && size_class->sweep != NULL){
+                slab_sweep_page(&vm->slab, class_index, release_dead);
+            }
+            vm->telemetry.sweep_time += now() - start;
+        }
+    }
+#endif //DEBUG_NO_SLAB
+    bool is_large;
+    Obj* object = (Obj*)slab_alloc_object(&vm->slab, size, &is_large);
+    unlock_heap(locked);
+    object->type = type;
+    object->is_large = is_large;
+    object->is_old = false;
+    object->is_remembered = false;
+    track_young(object);
+    vm->young_bytes += size;
+    return object;
 }
 
 void free_object(Obj* object){
@@ -41,105 +235,211 @@ void free_object(Obj* object){
     print_value(OBJ_VAL(object));
     printf("\n");
 #endif //DEBUG_LOG_GC
+    bool locked = lock_heap();
+    size_t freed_before = vm->bytes_allocated;
+    size_t size = 0;
     switch (object->type){
         case OBJ_STRING: {
-            FREE(ObjString, object);
+            size = sizeof(ObjString) + sizeof(char) * (((ObjString*)object)->length + 1);
         } break;
         case OBJ_ARRAY: {
             free_value_array(&((ObjArray*)object)->elements);
-            FREE(ObjArray, object);
+            size = sizeof(ObjArray);
         } break;
         case OBJ_FUNCTION: {
-            free_chunk(&((ObjFunction*)object)->chunk);
-            FREE(ObjFunction, object);
+            ObjFunction* function = (ObjFunction*)object;
+            free_chunk(&function->chunk);
+            if (function->reg != NULL) free_reg_chunk(function->reg);
+            if (function->jit != NULL) free_jit_code(function->jit);
+            size = sizeof(ObjFunction);
         } break;
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            size = sizeof(ObjNative);
         } break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(HEAP_REF(ObjUpvalue), closure->upvalues, closure->upvalue_count);
+            size = sizeof(ObjClosure);
         } break;
         case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            size = sizeof(ObjUpvalue);
         } break;
         case OBJ_CLASS: {
             // free_object(((ObjClass*)object)->init);
             free_table(&((ObjClass*)object)->methods);
-            FREE(ObjClass, object);
+            size = sizeof(ObjClass);
         } break;
         case OBJ_INSTANCE: {
-            free_table(&((ObjInstance*)object)->fields);
-            FREE(ObjInstance, object);
+            ObjInstance* instance = (ObjInstance*)object;
+            if (instance->fields != instance->inline_fields){
+                FREE_ARRAY(Value, instance->fields, instance->field_cap);
+            }
+            size = sizeof(ObjInstance) + sizeof(Value) * instance->inline_cap;
         } break;
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            size = sizeof(ObjBoundMethod);
+        } break;
+        case OBJ_SHAPE: {
+            free_table(&((ObjShape*)object)->transitions);
+            free_table(&((ObjShape*)object)->index);
+            size = sizeof(ObjShape);
+        } break;
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            if (fiber->stack.values != NULL){
+                FREE_ARRAY(Value, fiber->stack.values, fiber->stack.value_cap);
+                FREE_ARRAY(CallFrame, fiber->stack.frames, fiber->stack.frame_cap);
+            }
+            size = sizeof(ObjFiber);
         } break;
     }
+    vm->bytes_allocated -= size;
+    vm->telemetry.freed[object->type]++;
+    vm->telemetry.freed_bytes[object->type] += freed_before - vm->bytes_allocated;
+    slab_free_object(&vm->slab, object, size, object->is_large);
+    unlock_heap(locked);
 }
 
 void free_objects(){
-    Obj* obj = vm.objects;
-    while (obj != NULL){
-        Obj* next = obj->next;
-        free_object(obj);
-        obj = next;
+    stop_sweeper();
+    slab_for_each_object(&vm->slab, release_dead);
+    free(vm->young);
+    free(vm->gray_stack);
+    free(vm->remembered);
+}
+void remember_object(Obj* object){
+    if (!object->is_old || object->is_remembered) return;
+    object->is_remembered = true;
+    if (vm->remembered_count + 1 > vm->remembered_cap){
+        vm->remembered_cap = GROW_CAP(vm->remembered_cap);
+        vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->remembered_cap);
+        if (vm->remembered == NULL) {
+            fprintf(stderr, "Couldn't realloc remembered set\n");
+            exit(1);
+        }
+    }
+    vm->remembered[vm->remembered_count++] = object;
+}
+
+static void forget_remembered(){
+    for (size_t i = 0; i < vm->remembered_count; i++){
+        vm->remembered[i]->is_remembered = false;
+    }
+    vm->remembered_count = 0;
+}
+
+static void push_to(Obj*** stack, size_t* count, size_t* cap, Obj* object){
+    if (*count + 1 > *cap){
+        *cap = GROW_CAP(*cap);
+        *stack = (Obj**)realloc(*stack, sizeof(Obj*) * *cap);
+        if (*stack == NULL) {
+            fprintf(stderr, "Couldn't realloc GC stack\n");
+            exit(1);
+        }
     }
-    free(vm.gray_stack);
+    (*stack)[(*count)++] = object;
 }
 
+static void push_gray(Obj* object){
+    push_to(&vm->gray_stack, &vm->gray_count, &vm->gray_cap, object);
+}
+
+#ifdef __unix__
+// returns whether another marker got there first
+static bool test_and_mark(Obj* object){
+    if (object->is_large) return __atomic_exchange_n(&LARGE_HEADER(object)->is_marked, true, __ATOMIC_RELAXED);
+    return slab_test_and_set_bit(SLAB_PAGE_OF(object)->marked, object);
+}
+#endif //__unix__
+
 void mark_object(Obj* object){
     if (object == NULL) return;
-    if (object->is_marked) return;
+    if (reference_visitor != NULL){
+        reference_visitor(object, visitor_context);
+        return;
+    }
+    // a minor collection only marks young objects and a full one only old objects,
+    // the other generation is live as far as they are concerned
+    if (object->is_old == vm->collecting_young) return;
+#ifdef __unix__
+    if (current_marker != NULL){
+        if (!test_and_mark(object)){
+            push_to(&current_marker->local, &current_marker->local_count, &current_marker->local_cap, object);
+        }
+        return;
+    }
+#endif //__unix__
+    if (is_marked(object)) return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark type %s ", (void*)object, obj_type_tostring(object->type));
     print_value(OBJ_VAL(object));
     printf("\n");
 #endif //DEBUG_LOG_GC
-    object->is_marked = true;
-
-    if (vm.gray_count + 1 > vm.gray_cap){
-        vm.gray_cap = GROW_CAP(vm.gray_cap);
-        vm.gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_cap);
-        if (vm.gray_stack == NULL) {
-            fprintf(stderr, "Couldn't realloc GC stack\n");
-            exit(1);
-        }
-    }
-    vm.gray_stack[vm.gray_count++] = object;
+    set_marked(object, true);
+    push_gray(object);
 }
 
 void mark_value(Value value){
     if (IS_OBJ(value)) mark_object(AS_OBJ(value));
 }
 
+static void mark_array(ValueArray* array){
+    for (size_t i = 0; i < array->count; i++){
+        mark_value(array->values[i]);
+    }
+}
+
+static void mark_call_stack(CallStack* stack){
+    for (Value* slot = stack->values; slot < stack->top; slot++){
+        mark_value(*slot);
+    }
+    for (size_t i = 0; i < stack->frame_count; i++){
+        mark_object((Obj*)stack->frames[i].closure);
+    }
+    for (ObjUpvalue* upval = stack->open_upvalues; upval != NULL; upval = upval->next){
+        mark_object((Obj*)upval);
+    }
+}
+
 static void mark_roots(){
     // mark stack
-    for (Value* slot = vm.stack; slot < vm.sp; slot++){
+    for (Value* slot = vm->stack; slot < vm->sp; slot++){
         mark_value(*slot);
     }
 
     // closures
-    for (size_t i = 0; i < vm.frame_count; i++){
-        mark_object((Obj*)vm.frames[i].closure);
+    for (size_t i = 0; i < vm->frame_count; i++){
+        mark_object((Obj*)vm->frames[i].closure);
     }
 
     // open upvalues
-    for (ObjUpvalue* upval = vm.open_upvalues; upval != NULL; upval = upval->next){
+    for (ObjUpvalue* upval = vm->open_upvalues; upval != NULL; upval = upval->next){
         mark_object((Obj*)upval);
     }
 
+    // the script and the fibers waiting on the running one are reached from it
+    if (vm->fiber != NULL){
+        mark_object((Obj*)vm->fiber);
+        mark_call_stack(&vm->script);
+    }
+    mark_event_loop();
+
     // globals
-    table_mark(&vm.globals);
+    mark_array(&vm->global_values);
+    mark_array(&vm->global_names);
+    table_mark(&vm->global_slots);
     // compiler objects
     mark_compiler_roots();
-    // mark_object((Obj*)vm.init_string);
+    // mark_object((Obj*)vm->init_string);
 }
 
-static void mark_array(ValueArray* array){
-    for (size_t i = 0; i < array->count; i++){
-        mark_value(array->values[i]);
+static void mark_inline_caches(Chunk* chunk){
+    for (size_t i = 0; i < chunk->cache_count; i++){
+        InlineCache* cache = &chunk->caches[i];
+        for (uint8_t j = 0; j < cache->count; j++){
+            mark_object(cache->entries[j].shape);
+            mark_value(cache->entries[j].value);
+        }
     }
 }
 
@@ -156,6 +456,7 @@ static void blacken_object(Obj* object){
             ObjFunction* function = (ObjFunction*)object;
             mark_object((Obj*)function->name);
             mark_array(&function->chunk.constants);
+            mark_inline_caches(&function->chunk);
         } break;
         case OBJ_ARRAY: {
             ObjArray* arr = (ObjArray*)object;
@@ -166,71 +467,418 @@ static void blacken_object(Obj* object){
             mark_object((Obj*)class_obj->init);
             mark_object((Obj*)class_obj->name);
             table_mark(&class_obj->methods);
+            mark_object((Obj*)class_obj->shape);
         } break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             mark_object((Obj*)closure->function);
             for (int i = 0; i < closure->upvalue_count; i++){
-                mark_object((Obj*)closure->upvalues[i]);
+                mark_object((Obj*)CLOSURE_UPVALUE(closure, i));
             }
         } break;
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            mark_object((Obj*)instance->instance_of);
-            table_mark(&instance->fields);
+            ObjShape* shape = INSTANCE_SHAPE(instance);
+            mark_object((Obj*)INSTANCE_CLASS(instance));
+            mark_object((Obj*)shape);
+            for (uint32_t i = 0; i < shape->field_count; i++){
+                mark_value(instance->fields[i]);
+            }
         } break;
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
             mark_value(bound->receiver);
             mark_object((Obj*)bound->method);
         } break;
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            mark_object((Obj*)shape->parent);
+            mark_object((Obj*)shape->key);
+            table_mark(&shape->transitions);
+            table_mark(&shape->index);
+            mark_object((Obj*)shape->indexed);
+        } break;
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            mark_object((Obj*)fiber->caller);
+            // the stack of the running fiber is the VM's and marked as a root, a finished one is dead
+            if (fiber->state != FIBER_RUNNING && fiber->state != FIBER_DONE){
+                mark_call_stack(&fiber->stack);
+            }
+        } break;
     }
 }
 
-static void trace_references(){
-    while(vm.gray_count > 0){
-        Obj* object = vm.gray_stack[--vm.gray_count];
+// calls visit for every object this one references, as marking would trace them,
+// without touching mark bits or the gray stack
+void visit_references(Obj* object, void (*visit)(Obj* child, void* context), void* context){
+    reference_visitor = visit;
+    visitor_context = context;
+    blacken_object(object);
+    reference_visitor = NULL;
+}
+
+// a minor collection can run in the middle of incremental marking, it only
+// traces what it pushed on top of the gray objects already waiting
+static void trace_references(size_t base){
+    while(vm->gray_count > base){
+        Obj* object = vm->gray_stack[--vm->gray_count];
         blacken_object(object);
     }
 }
 
-static void sweep(){
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while(object != NULL){
-        if (object->is_marked){
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
+#ifdef __unix__
+static void share_work(Marker* self){
+    if (self->local_count < 2 * MARK_BATCH) return;
+    if (__atomic_load_n(&self->shared_count, __ATOMIC_ACQUIRE) > 0) return;
+    pthread_mutex_lock(&self->lock);
+    size_t count = self->shared_count;
+    for (size_t i = 0; i < MARK_BATCH; i++){
+        push_to(&self->shared, &count, &self->shared_cap, self->local[--self->local_count]);
+    }
+    __atomic_store_n(&self->shared_count, count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&self->lock);
+}
+
+// a marker takes its own shared stack back whole and half of anyone else's
+static bool steal(Marker* self, Marker* victim){
+    if (__atomic_load_n(&victim->shared_count, __ATOMIC_ACQUIRE) == 0) return false;
+    pthread_mutex_lock(&victim->lock);
+    size_t count = victim->shared_count;
+    size_t take = victim == self ? count : (count + 1) / 2;
+    for (size_t i = 0; i < take; i++){
+        push_to(&self->local, &self->local_count, &self->local_cap, victim->shared[--count]);
+    }
+    __atomic_store_n(&victim->shared_count, count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&victim->lock);
+    return take > 0;
+}
+
+static bool has_shared_work(Marking* marking){
+    for (size_t i = 0; i < marking->marker_count; i++){
+        if (__atomic_load_n(&marking->markers[i].shared_count, __ATOMIC_ACQUIRE) > 0) return true;
+    }
+    return false;
+}
+
+static Obj* next_gray(Marker* self){
+    Marking* marking = self->marking;
+    for (size_t i = 0; i < marking->marker_count && self->local_count == 0; i++){
+        steal(self, &marking->markers[(self->index + i) % marking->marker_count]);
+    }
+    if (self->local_count == 0) return NULL;
+    return self->local[--self->local_count];
+}
+
+// idle markers never push, so once all of them are idle no gray object is left anywhere
+static void* run_marker(void* arg){
+    Marker* self = (Marker*)arg;
+    Marking* marking = self->marking;
+    vm = marking->vm;
+    current_marker = self;
+    for (;;){
+        Obj* object = next_gray(self);
+        if (object != NULL){
+            blacken_object(object);
+            share_work(self);
+            continue;
+        }
+        __atomic_add_fetch(&marking->idle_markers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&marking->idle_markers, __ATOMIC_SEQ_CST) < marking->marker_count &&
+               !has_shared_work(marking)){
+            sched_yield();
+        }
+        if (__atomic_load_n(&marking->idle_markers, __ATOMIC_SEQ_CST) == marking->marker_count) break;
+        __atomic_sub_fetch(&marking->idle_markers, 1, __ATOMIC_SEQ_CST);
+    }
+    current_marker = NULL;
+    return NULL;
+}
+
+// traces everything gray with vm->options.gc_threads threads, the calling one included.
+// The program is stopped meanwhile, so only the mark bits are written concurrently
+static void mark_in_parallel(){
+    Marking marking = {.vm = vm, .marker_count = vm->options.gc_threads, .idle_markers = 0};
+    Marker* markers = marking.markers;
+    for (size_t i = 0; i < marking.marker_count; i++){
+        markers[i] = (Marker){.index = i, .marking = &marking};
+        pthread_mutex_init(&markers[i].lock, NULL);
+    }
+    // roots are dealt out to the shared stacks, a marker that fails to start loses nothing
+    for (size_t i = 0; i < vm->gray_count; i++){
+        Marker* marker = &markers[i % marking.marker_count];
+        push_to(&marker->shared, &marker->shared_count, &marker->shared_cap, vm->gray_stack[i]);
+    }
+    vm->gray_count = 0;
+
+    pthread_t threads[GC_MAX_THREADS];
+    bool started[GC_MAX_THREADS];
+    for (size_t i = 1; i < marking.marker_count; i++){
+        started[i] = pthread_create(&threads[i], NULL, run_marker, &markers[i]) == 0;
+        if (!started[i]) __atomic_add_fetch(&marking.idle_markers, 1, __ATOMIC_SEQ_CST);
+    }
+    run_marker(&markers[0]);
+    for (size_t i = 1; i < marking.marker_count; i++){
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < marking.marker_count; i++){
+        free(markers[i].local);
+        free(markers[i].shared);
+        pthread_mutex_destroy(&markers[i].lock);
+    }
+}
+#endif //__unix__
+
+// young survivors are not moved, they just count as old from now on. While a full
+// collection is marking they join it gray, their old children still need tracing
+static void promote(Obj* object){
+    object->is_old = true;
+    if (vm->gc_phase != GC_MARKING){
+        set_marked(object, false);
+        return;
+    }
+    push_gray(object);
+}
+
+static void sweep_young(){
+    for (size_t i = 0; i < vm->young_count; i++){
+        Obj* object = vm->young[i];
+        if (is_marked(object)){
+            promote(object);
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL){
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
-            free_object(unreached);
+            free_object(object);
         }
     }
+    vm->young_count = 0;
+    vm->young_bytes = 0;
 }
 
-void collect_garbage(){
+static void record_pause(double start){
+    double pause = now() - start;
+    if (pause > vm->max_pause) vm->max_pause = pause;
+    vm->gc_time += pause;
+}
+
+void collect_young(){
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytes_allocated;
+#endif //DEBUG_LOG_GC
+    double start = now();
+
+    size_t base = vm->gray_count;
+    vm->collecting_young = true;
+    mark_roots();
+    for (size_t i = 0; i < vm->remembered_count; i++){
+        blacken_object(vm->remembered[i]);
+    }
+    trace_references(base);
+    vm->collecting_young = false;
+    table_remove_white_marked_obj(&vm->strings, true);
+    sweep_young();
+    forget_remembered();
+    vm->minor_count++;
+
+    record_pause(start);
+    vm->telemetry.minor_time += now() - start;
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+            before - vm->bytes_allocated, before, vm->bytes_allocated);
+#endif //DEBUG_LOG_GC
+}
+
+// the nursery is emptied first, so a full collection starts out with old objects only
+static void start_marking(){
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
 #endif //DEBUG_LOG_GC
+    collect_young();
+    vm->gc_phase = GC_MARKING;
+    mark_roots();
+}
 
+// roots aren't behind write barriers and young objects aren't traced, so both are
+// dealt with once more before the weak string table is pruned. Emptying the nursery
+// here means objects allocated while sweeping only land on pages already swept
+static void finish_marking(){
+    collect_young();
     mark_roots();
-    trace_references();
-    table_remove_white_marked_obj(&vm.strings);
-    sweep();
+    trace_references(0);
+    table_remove_white_marked_obj(&vm->strings, false);
+    slab_start_sweep(&vm->slab);
+    vm->gc_phase = GC_SWEEPING;
+#ifdef __unix__
+    if (vm->options.gc_sweeper) start_sweeper();
+#endif //__unix__
+}
 
-    vm.next_GC = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+// returns whether anything is left to sweep
+static bool sweep_objects(size_t budget){
+    size_t swept = slab_sweep_large(&vm->slab, budget, release_dead);
+    for (size_t i = 0; i < SLAB_CLASSES && swept < budget; i++){
+        while (vm->slab.objects[i].sweep != NULL && swept < budget){
+            swept += slab_sweep_page(&vm->slab, i, release_dead);
+        }
+    }
+    return slab_sweeping(&vm->slab);
+}
 
+#ifdef __unix__
+// sweeps with the heap lock taken for one budget at a time, the program keeps
+// allocating in between and sweeps pages itself when it runs out of free blocks
+static void* run_sweeper(void* arg){
+    vm = (VM*)arg;
+    bool sweeping = true;
+    while (sweeping){
+        pthread_mutex_lock(&vm->heap_lock);
+        holds_heap_lock = true;
+        sweeping = sweep_objects(vm->options.gc_budget);
+        holds_heap_lock = false;
+        pthread_mutex_unlock(&vm->heap_lock);
+    }
+    __atomic_store_n(&vm->sweeper_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void start_sweeper(){
+    vm->sweeper_done = false;
+    vm->sweeper_running = true;
+    if (pthread_create(&vm->sweeper, NULL, run_sweeper, vm) != 0) vm->sweeper_running = false;
+}
+#endif //__unix__
+
+void stop_sweeper(){
+#ifdef __unix__
+    if (!vm->sweeper_running) return;
+    pthread_join(vm->sweeper, NULL);
+    vm->sweeper_running = false;
+#endif //__unix__
+}
+
+// sets the heap size at which the next full collection starts, from what's live now
+static void pace_next_collection(){
+    size_t live = vm->bytes_allocated;
+    switch (vm->options.gc_pacing){
+        case PACE_GROWTH: vm->next_GC = live * vm->options.gc_growth; break;
+        case PACE_HEAP: {
+            // once the live heap outgrows the target it still needs some room, or every allocation collects
+            vm->next_GC = vm->options.gc_heap_target;
+            if (vm->next_GC < live + live / 8) vm->next_GC = live + live / 8;
+        } break;
+        case PACE_CPU: {
+            double elapsed = now() - vm->cycle_start;
+            double percent = elapsed > 0 ? (vm->gc_time - vm->cycle_gc_time) / elapsed * 100 : 0;
+            if (percent > vm->options.gc_cpu_target){
+                vm->gc_growth *= 1.5;
+                if (vm->gc_growth > GC_MAX_GROWTH) vm->gc_growth = GC_MAX_GROWTH;
+            } else if (percent < vm->options.gc_cpu_target / 2){
+                vm->gc_growth /= 1.25;
+                if (vm->gc_growth < GC_MIN_GROWTH) vm->gc_growth = GC_MIN_GROWTH;
+            }
+            vm->next_GC = live * vm->gc_growth;
+        } break;
+    }
+    vm->cycle_start = now();
+    vm->cycle_gc_time = vm->gc_time;
+}
+
+void init_gc_pacing(){
+    vm->gc_growth = vm->options.gc_growth;
+    vm->cycle_start = now();
+    vm->cycle_gc_time = vm->gc_time;
+    if (vm->options.gc_pacing == PACE_HEAP) vm->next_GC = vm->options.gc_heap_target;
+}
+
+static void sweep(size_t budget){
+#ifdef __unix__
+    // a step only checks on the sweeper, unless it has to finish the collection
+    if (vm->sweeper_running){
+        if (budget != SIZE_MAX && !__atomic_load_n(&vm->sweeper_done, __ATOMIC_ACQUIRE)) return;
+        stop_sweeper();
+    }
+#endif //__unix__
+    if (sweep_objects(budget)) return;
+
+    vm->gc_phase = GC_IDLE;
+    pace_next_collection();
+    vm->major_count++;
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-            before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_GC);
+    printf("   %zu bytes allocated, next at %zu\n", vm->bytes_allocated, vm->next_GC);
 #endif //DEBUG_LOG_GC
-}
\ No newline at end of file
+}
+
+// does a bounded amount of full collection work, a budget of 0 only starts a collection
+static void gc_step(size_t budget){
+    double start = now();
+    double minor_time = vm->telemetry.minor_time;
+    GCPhase phase = vm->gc_phase;
+    switch (vm->gc_phase){
+        case GC_IDLE: {
+            start_marking();
+#ifdef __unix__
+            // marking threads can't run alongside the program, so they mark all at once
+            if (vm->options.gc_threads > 1){
+                mark_in_parallel();
+                finish_marking();
+            }
+#endif //__unix__
+        } break;
+        case GC_MARKING: {
+            while (vm->gray_count > 0 && budget-- > 0){
+                blacken_object(vm->gray_stack[--vm->gray_count]);
+            }
+            if (vm->gray_count == 0) finish_marking();
+        } break;
+        case GC_SWEEPING: sweep(budget); break;
+    }
+    record_pause(start);
+    // the nursery collections a step starts with count as minor time
+    double elapsed = now() - start - (vm->telemetry.minor_time - minor_time);
+    if (phase == GC_SWEEPING){
+        vm->telemetry.sweep_time += elapsed;
+    } else {
+        vm->telemetry.mark_time += elapsed;
+    }
+}
+
+void collect_garbage(){
+    if (vm->gc_phase == GC_IDLE) gc_step(0);
+    while (vm->gc_phase != GC_IDLE) gc_step(SIZE_MAX);
+}
+
+void write_gc_json(const char* path){
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (out == NULL){
+        fprintf(stderr, "Could not open file [%s]\n", path);
+        return;
+    }
+    GCTelemetry* telemetry = &vm->telemetry;
+    size_t freed_bytes = 0;
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) freed_bytes += telemetry->freed_bytes[type];
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"collections\": {\"minor\": %zu, \"full\": %zu},\n", vm->minor_count, vm->major_count);
+    fprintf(out, "  \"time_ms\": {\"minor\": %.3f, \"mark\": %.3f, \"sweep\": %.3f, \"total\": %.3f, \"longest_pause\": %.3f},\n",
+            telemetry->minor_time * 1000, telemetry->mark_time * 1000, telemetry->sweep_time * 1000,
+            vm->gc_time * 1000, vm->max_pause * 1000);
+    fprintf(out, "  \"heap\": {\"current\": %zu, \"peak\": %zu, \"freed\": %zu, \"next_collection\": %zu},\n",
+            vm->bytes_allocated, telemetry->peak_heap, freed_bytes, vm->next_GC);
+    fprintf(out, "  \"strings\": {\"interned\": %zu, \"capacity\": %zu},\n", vm->strings.count, vm->strings.cap);
+    fprintf(out, "  \"objects\": {\n");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++){
+        fprintf(out, "    \"%s\": {\"allocated\": %zu, \"allocated_bytes\": %zu, \"freed\": %zu, \"freed_bytes\": %zu}%s\n",
+                obj_type_name(type), telemetry->allocated[type], telemetry->allocated_bytes[type],
+                telemetry->freed[type], telemetry->freed_bytes[type], type + 1 < OBJ_TYPE_COUNT ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    if (out != stdout) fclose(out);
+}
+
+void print_gc_stats(){
+    printf("=== gc: %zu minor collections, %zu full collections, longest pause %.3f ms ===\n",
+           vm->minor_count, vm->major_count, vm->max_pause * 1000);
+}
@@ -5,7 +5,15 @@
 #include "../common/object.h"
 #include "vm.h"
 
+#define GC_INITIAL_HEAP (1024*1024)   // heap size of the first full collection
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_GROWTH 1.25            // bounds of the growth factor PACE_CPU adapts
+#define GC_MAX_GROWTH 16
+#define GC_DEFAULT_HEAP_TARGET (64*1024*1024)
+#define GC_DEFAULT_CPU_TARGET 5       // percent
+#define GC_DEFAULT_NURSERY (256*1024) // bytes of new objects between minor collections
+#define GC_DEFAULT_BUDGET 512         // objects traced or swept per allocation during a full collection
+#define GC_MAX_THREADS 64             // upper bound for --gc-threads
 
 #define GROW_CAP(cap) ((cap) < 8 ? 8 : (cap) * 2)
 #define GROW_ARRAY(type, ptr, old_count, new_count) \
@@ -19,11 +27,48 @@
 
 #define FREE(type, ptr) reallocate(ptr, sizeof(type), 0)
 
+// must follow every store of a reference into an object that may already be old,
+// so minor collections can find young objects that only old objects point to
+// and an incremental full collection doesn't miss objects stored into traced ones
+#define WRITE_BARRIER(owner, value) \
+    do { if (IS_OBJ(value)) write_barrier((Obj*)(owner), AS_OBJ(value)); } while (0)
+#define WRITE_BARRIER_OBJ(owner, child) \
+    do { if ((child) != NULL) write_barrier((Obj*)(owner), (Obj*)(child)); } while (0)
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
 void free_objects();
 void collect_garbage();
+void collect_young();
+void stop_sweeper();
+void remember_object(Obj* object);
 void mark_object(Obj* object);
 void mark_value(Value value);
+void visit_references(Obj* object, void (*visit)(Obj* child, void* context), void* context);
+Obj* allocate_object(size_t size, ObjType type);
+void print_gc_stats();
+void write_gc_json(const char* path);
+void init_gc_pacing();
+
+static inline bool is_marked(Obj* object){
+    if (object->is_large) return LARGE_HEADER(object)->is_marked;
+    return slab_bit(SLAB_PAGE_OF(object)->marked, object);
+}
+
+static inline void set_marked(Obj* object, bool marked){
+    if (object->is_large){
+        LARGE_HEADER(object)->is_marked = marked;
+    } else {
+        slab_set_bit(SLAB_PAGE_OF(object)->marked, object, marked);
+    }
+}
+
+static inline void write_barrier(Obj* owner, Obj* child){
+    if (!child->is_old){
+        remember_object(owner);
+    } else if (vm->gc_phase == GC_MARKING){
+        mark_object(child);
+    }
+}
 
 #endif //_MEMORY_H
 
@@ -26,9 +26,17 @@ OPCODE(op_get_global_long)
 OPCODE(op_set_global)
 OPCODE(op_set_global_long)
 OPCODE(op_get_local)
+OPCODE(op_get_local_long)
+OPCODE(op_get_local_0)
+OPCODE(op_get_local_1)
+OPCODE(op_get_local_2)
+OPCODE(op_get_local_3)
 OPCODE(op_set_local)
+OPCODE(op_set_local_long)
 OPCODE(op_get_upvalue)
+OPCODE(op_get_upvalue_long)
 OPCODE(op_set_upvalue)
+OPCODE(op_set_upvalue_long)
 OPCODE(op_get_prop)
 OPCODE(op_get_prop_long)
 OPCODE(op_set_prop)
@@ -50,4 +58,22 @@ OPCODE(op_invoke)
 OPCODE(op_inherit)
 OPCODE(op_get_super)
 OPCODE(op_super_invoke)
-OPCODE(op_return)
\ No newline at end of file
+OPCODE(op_return)
+OPCODE(op_pop_jump_if_false)
+OPCODE(op_jump_if_not_equal)
+OPCODE(op_jump_if_equal)
+OPCODE(op_jump_if_not_less)
+OPCODE(op_jump_if_not_less_equal)
+OPCODE(op_jump_if_not_greater)
+OPCODE(op_jump_if_not_greater_equal)
+OPCODE(op_inc_local)
+OPCODE(op_get_local2)
+OPCODE(op_add_num)
+OPCODE(op_add_str)
+OPCODE(op_sub_num)
+OPCODE(op_mul_num)
+OPCODE(op_div_num)
+OPCODE(op_less_num)
+OPCODE(op_less_equal_num)
+OPCODE(op_greater_num)
+OPCODE(op_greater_equal_num)
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "peephole.h"
+#include "memory.h"
+#include "../common/object.h"
+
+typedef enum {
+    FUSE_POP_JUMP,
+    FUSE_COMPARE_JUMP,
+    FUSE_INC_LOCAL,
+    FUSE_GET_LOCAL2,
+    FUSE_COUNT,
+} FuseKind;
+
+static const char* fuse_names[FUSE_COUNT] = {
+    [FUSE_POP_JUMP]     = "pop+jump",
+    [FUSE_COMPARE_JUMP] = "compare+jump",
+    [FUSE_INC_LOCAL]    = "inc local",
+    [FUSE_GET_LOCAL2]   = "get local pair",
+};
+
+typedef struct {
+    size_t offset;      // offset of the jump in the rewritten code
+    size_t target;      // target of the jump in the original code
+    bool backwards;
+} JumpPatch;
+
+typedef struct {
+    Chunk* chunk;
+    size_t* ins;        // start offsets of the original instructions
+    size_t ins_count;
+    bool* is_target;    // original offsets that some jump lands on
+    size_t* lines;      // line of every original byte
+    size_t* new_offset; // original instruction start -> rewritten offset
+
+    uint8_t* out;       // rewritten code
+    size_t* out_lines;
+    size_t out_count;
+    size_t out_ins_count;
+
+    JumpPatch* patches;
+    size_t patch_count;
+    size_t fused[FUSE_COUNT];
+} Peephole;
+
+static size_t read_3_bytes(uint8_t* code){
+    return code[0] | code[1] << 8 | code[2] << 16;
+}
+
+static bool is_forward_jump(uint8_t op){
+    switch (op){
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static size_t jump_target(uint8_t* code, size_t offset){
+    size_t amount = read_3_bytes(code + offset + 1);
+    return code[offset] == OP_LOOP ? offset + 1 - amount : offset + 1 + amount;
+}
+
+static uint8_t op_at(Peephole* p, size_t i){
+    return p->chunk->code[p->ins[i]];
+}
+
+// instructions i+1 .. i+n-1 must exist and can't be jumped into
+static bool fusible(Peephole* p, size_t i, size_t n){
+    if (i + n > p->ins_count) return false;
+    for (size_t k = 1; k < n; k++){
+        if (p->is_target[p->ins[i+k]]) return false;
+    }
+    return true;
+}
+
+static void emit(Peephole* p, uint8_t byte, size_t line){
+    p->out_lines[p->out_count] = line;
+    p->out[p->out_count++] = byte;
+}
+
+static void emit_3_bytes(Peephole* p, size_t value, size_t line){
+    emit(p, value, line);
+    emit(p, value >> 8, line);
+    emit(p, value >> 16, line);
+}
+
+static void emit_jump(Peephole* p, uint8_t op, size_t target, size_t line){
+    p->patches[p->patch_count++] = (JumpPatch){
+        .offset = p->out_count,
+        .target = target,
+        .backwards = op == OP_LOOP,
+    };
+    emit(p, op, line);
+    emit_3_bytes(p, 0, line);
+}
+
+static uint8_t compare_jump(uint8_t op){
+    switch (op){
+        case OP_EQUAL:         return OP_JUMP_IF_NOT_EQUAL;
+        case OP_NOT_EQUAL:     return OP_JUMP_IF_EQUAL;
+        case OP_LESS:          return OP_JUMP_IF_NOT_LESS;
+        case OP_LESS_EQUAL:    return OP_JUMP_IF_NOT_LESS_EQUAL;
+        case OP_GREATER:       return OP_JUMP_IF_NOT_GREATER;
+        case OP_GREATER_EQUAL: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+        default:               return OP_RETURN;
+    }
+}
+
+// reads the slot of a local read that fits in one byte
+static bool short_local(Peephole* p, size_t i, uint8_t* slot){
+    uint8_t* code = p->chunk->code + p->ins[i];
+    if (code[0] == OP_GET_LOCAL){
+        *slot = code[1];
+        return true;
+    }
+    if (code[0] >= OP_GET_LOCAL_0 && code[0] <= OP_GET_LOCAL_3){
+        *slot = code[0] - OP_GET_LOCAL_0;
+        return true;
+    }
+    return false;
+}
+
+// OP_JUMP_IF_FALSE leaves the condition on the stack for both paths, so it can only be
+// turned into a popping jump when the false path starts by popping it as well
+static bool jump_pops_condition(Peephole* p, size_t i){
+    if (op_at(p, i) != OP_JUMP_IF_FALSE) return false;
+    size_t target = jump_target(p->chunk->code, p->ins[i]);
+    return target < p->chunk->count && p->chunk->code[target] == OP_POP;
+}
+
+// tries to replace the instructions starting at index i with a superinstruction,
+// returns the number of original instructions consumed or 0 if nothing matched
+static size_t fuse(Peephole* p, size_t i){
+    uint8_t* code = p->chunk->code;
+    size_t offset = p->ins[i];
+    size_t line = p->lines[offset];
+
+    // <compare> OP_JUMP_IF_FALSE OP_POP -> OP_JUMP_IF_NOT_<compare>
+    if (compare_jump(code[offset]) != OP_RETURN && fusible(p, i, 3) &&
+        jump_pops_condition(p, i+1) && op_at(p, i+2) == OP_POP)
+    {
+        emit_jump(p, compare_jump(code[offset]), jump_target(code, p->ins[i+1]) + 1, line);
+        p->fused[FUSE_COMPARE_JUMP]++;
+        return 3;
+    }
+
+    // OP_JUMP_IF_FALSE OP_POP -> OP_POP_JUMP_IF_FALSE
+    if (fusible(p, i, 2) && jump_pops_condition(p, i) && op_at(p, i+1) == OP_POP){
+        emit_jump(p, OP_POP_JUMP_IF_FALSE, jump_target(code, offset) + 1, line);
+        p->fused[FUSE_POP_JUMP]++;
+        return 2;
+    }
+
+    uint8_t a, b;
+    // OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD, OP_SET_LOCAL a, OP_POP -> OP_INC_LOCAL a k
+    if (fusible(p, i, 5) && short_local(p, i, &a) &&
+        op_at(p, i+1) == OP_CONSTANT && op_at(p, i+2) == OP_ADD &&
+        op_at(p, i+3) == OP_SET_LOCAL && op_at(p, i+4) == OP_POP)
+    {
+        uint8_t constant = code[p->ins[i+1] + 1];
+        if (a == code[p->ins[i+3] + 1] && IS_NUM(p->chunk->constants.values[constant])){
+            emit(p, OP_INC_LOCAL, line);
+            emit(p, a, line);
+            emit(p, constant, line);
+            p->fused[FUSE_INC_LOCAL]++;
+            return 5;
+        }
+    }
+
+    // OP_GET_LOCAL a, OP_GET_LOCAL b -> OP_GET_LOCAL2 a b
+    if (fusible(p, i, 2) && short_local(p, i, &a) && short_local(p, i+1, &b)){
+        emit(p, OP_GET_LOCAL2, line);
+        emit(p, a, line);
+        emit(p, b, line);
+        p->fused[FUSE_GET_LOCAL2]++;
+        return 2;
+    }
+    return 0;
+}
+
+static void print_stats(Peephole* p, const char* name){
+    fprintf(stderr, "=== peephole %s: %zu -> %zu instructions, %zu -> %zu bytes ===\n",
+            name, p->ins_count, p->out_ins_count, p->chunk->count, p->out_count);
+    for (int kind = 0; kind < FUSE_COUNT; kind++){
+        if (p->fused[kind] > 0) fprintf(stderr, "  %-16s %zu\n", fuse_names[kind], p->fused[kind]);
+    }
+}
+
+void optimize_chunk(Chunk* chunk, const char* name, bool print_stats_flag){
+    if (chunk->count == 0) return;
+    Peephole p;
+    memset(&p, 0, sizeof(Peephole));
+    p.chunk = chunk;
+    p.ins = malloc(sizeof(size_t) * chunk->count);
+    p.is_target = calloc(chunk->count + 1, sizeof(bool));
+    p.lines = malloc(sizeof(size_t) * chunk->count);
+    p.new_offset = malloc(sizeof(size_t) * (chunk->count + 1));
+    // fusing two single byte local reads grows the code, so leave room for that
+    p.out = malloc(chunk->count * 2);
+    p.out_lines = malloc(sizeof(size_t) * chunk->count * 2);
+    p.patches = malloc(sizeof(JumpPatch) * chunk->count);
+    if (p.ins == NULL || p.is_target == NULL || p.lines == NULL || p.new_offset == NULL ||
+        p.out == NULL || p.out_lines == NULL || p.patches == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate peephole buffers\n");
+        exit(1);
+    }
+
+    size_t byte = 0;
+    for (size_t i = 0; i < chunk->lines.count; i++){
+        for (size_t j = 0; j < chunk->lines.lines_t[i].count; j++){
+            p.lines[byte++] = chunk->lines.lines_t[i].line_num;
+        }
+    }
+
+    for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)){
+        p.ins[p.ins_count++] = offset;
+        uint8_t op = chunk->code[offset];
+        if (op == OP_LOOP || is_forward_jump(op)){
+            size_t target = jump_target(chunk->code, offset);
+            p.is_target[target] = true;
+            // fused jumps skip the pop at the target, so the byte after it becomes a target too
+            if (op == OP_JUMP_IF_FALSE && target < chunk->count) p.is_target[target + 1] = true;
+        }
+    }
+
+    for (size_t i = 0; i < p.ins_count;){
+        size_t offset = p.ins[i];
+        p.new_offset[offset] = p.out_count;
+        p.out_ins_count++;
+        size_t consumed = fuse(&p, i);
+        if (consumed > 0){
+            i += consumed;
+            continue;
+        }
+        uint8_t op = chunk->code[offset];
+        if (op == OP_LOOP || is_forward_jump(op)){
+            emit_jump(&p, op, jump_target(chunk->code, offset), p.lines[offset]);
+        } else {
+            size_t length = instruction_length(chunk, offset);
+            for (size_t k = 0; k < length; k++) emit(&p, chunk->code[offset + k], p.lines[offset]);
+        }
+        i++;
+    }
+    p.new_offset[chunk->count] = p.out_count;
+
+    for (size_t i = 0; i < p.patch_count; i++){
+        JumpPatch* patch = &p.patches[i];
+        size_t target = p.new_offset[patch->target];
+        size_t amount = patch->backwards ? patch->offset + 1 - target : target - (patch->offset + 1);
+        p.out[patch->offset + 1] = amount;
+        p.out[patch->offset + 2] = amount >> 8;
+        p.out[patch->offset + 3] = amount >> 16;
+    }
+
+    if (print_stats_flag) print_stats(&p, name);
+
+    if (p.out_count > chunk->cap){
+        size_t old_cap = chunk->cap;
+        chunk->cap = p.out_count;
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_cap, chunk->cap);
+    }
+    memcpy(chunk->code, p.out, p.out_count);
+    chunk->count = p.out_count;
+    free_lines(&chunk->lines);
+    for (size_t i = 0; i < p.out_count; i++) write_lines(&chunk->lines, p.out_lines[i]);
+
+    free(p.ins);
+    free(p.is_target);
+    free(p.lines);
+    free(p.new_offset);
+    free(p.out);
+    free(p.out_lines);
+    free(p.patches);
+}
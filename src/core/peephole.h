@@ -0,0 +1,8 @@
+#ifndef _PEEPHOLE_H
+#define _PEEPHOLE_H
+
+#include "chunk.h"
+
+void optimize_chunk(Chunk* chunk, const char* name, bool print_stats);
+
+#endif //_PEEPHOLE_H
@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "registers.h"
+#include "memory.h"
+
+// Lowers the stack bytecode of a function to register code. Stack slot n of a frame becomes
+// register n, so locals keep their slot and temporaries live right above them. Pushes of
+// locals and constants don't copy anything, the slot only remembers which operand holds its
+// value, and the instruction that pops it reads that operand directly.
+
+typedef struct {
+    size_t index;       // register instruction to patch
+    size_t target;      // target in the stack code
+} RegJump;
+
+typedef struct {
+    Chunk* chunk;
+    size_t* ins;            // start offsets of the stack instructions
+    size_t ins_count;
+    bool* is_target;
+    size_t* lines;
+    int32_t* depth_at;      // stack depth at every jump target, -1 while unknown
+    bool* skipped;          // jump targets that were dropped because their depth wasn't known yet
+    size_t* label;          // stack offset -> register instruction
+
+    uint16_t* stack;        // operand that holds the value of every stack slot
+    size_t depth;
+    size_t max_depth;
+    bool reachable;
+    bool has_closures;      // locals may be changed through upvalues while a call runs
+    size_t line;
+    size_t last_write;      // instruction whose destination can still be changed
+
+    RegInstruction* code;
+    size_t* code_lines;
+    size_t count;
+    size_t cap;
+
+    RegJump* jumps;
+    size_t jump_count;
+    size_t jump_cap;
+
+    const char* failure;
+    size_t failure_offset;
+} Lowering;
+
+static void* grow(void* ptr, size_t size){
+    void* result = realloc(ptr, size);
+    if (result == NULL){
+        fprintf(stderr, "Couldn't allocate register code buffers\n");
+        exit(1);
+    }
+    return result;
+}
+
+static size_t emit(Lowering* l, RegOpCode op, uint16_t a, uint16_t b, uint16_t c){
+    if (l->count + 1 > l->cap){
+        l->cap = GROW_CAP(l->cap);
+        l->code = grow(l->code, sizeof(RegInstruction) * l->cap);
+        l->code_lines = grow(l->code_lines, sizeof(size_t) * l->cap);
+    }
+    l->code[l->count] = (RegInstruction){ .op = op, .a = a, .b = b, .c = c };
+    l->code_lines[l->count] = l->line;
+    return l->count++;
+}
+
+static bool fail(Lowering* l, const char* reason, size_t offset){
+    if (l->failure == NULL){
+        l->failure = reason;
+        l->failure_offset = offset;
+    }
+    return false;
+}
+
+static bool push_operand(Lowering* l, uint16_t operand){
+    if (l->depth + 1 > RK_MAX) return fail(l, "too many registers", 0);
+    l->stack[l->depth++] = operand;
+    if (l->depth > l->max_depth) l->max_depth = l->depth;
+    return true;
+}
+
+static uint16_t pop_operand(Lowering* l){
+    return l->stack[--l->depth];
+}
+
+static void materialize(Lowering* l, size_t slot){
+    if (l->stack[slot] != slot){
+        emit(l, REG_MOVE, slot, l->stack[slot], 0);
+        l->stack[slot] = slot;
+    }
+}
+
+static void flush_from(Lowering* l, size_t slot){
+    for (; slot < l->depth; slot++) materialize(l, slot);
+}
+
+// slots that still read the old value of a local need their own copy before it's overwritten
+static void before_write(Lowering* l, size_t slot){
+    for (size_t i = slot + 1; i < l->depth; i++){
+        if (l->stack[i] == slot) materialize(l, i);
+    }
+}
+
+static bool merge_depth(Lowering* l, size_t target, size_t offset){
+    if (l->depth_at[target] == -1){
+        l->depth_at[target] = l->depth;
+    } else if ((size_t)l->depth_at[target] != l->depth){
+        return fail(l, "inconsistent stack depth", offset);
+    }
+    return true;
+}
+
+static bool emit_jump(Lowering* l, RegOpCode op, size_t target, uint16_t b, uint16_t c, size_t offset){
+    if (l->jump_count + 1 > l->jump_cap){
+        l->jump_cap = GROW_CAP(l->jump_cap);
+        l->jumps = grow(l->jumps, sizeof(RegJump) * l->jump_cap);
+    }
+    l->jumps[l->jump_count++] = (RegJump){ .index = emit(l, op, 0, b, c), .target = target };
+    return merge_depth(l, target, offset);
+}
+
+static bool push_result(Lowering* l, RegOpCode op, uint16_t b, uint16_t c){
+    size_t dest = l->depth;
+    l->last_write = emit(l, op, dest, b, c);
+    return push_operand(l, dest);
+}
+
+static bool constant(Lowering* l, size_t index, size_t offset){
+    if (index > RK_MAX) return fail(l, "constant index too large", offset);
+    return push_operand(l, index | RK_CONSTANT);
+}
+
+static bool literal(Lowering* l, Value value, size_t offset){
+    ValueArray* constants = &l->chunk->constants;
+    for (size_t i = 0; i < constants->count; i++){
+        Value other = constants->values[i];
+        if ((IS_NIL(value) && IS_NIL(other)) ||
+            (IS_BOOL(value) && IS_BOOL(other) && AS_BOOL(value) == AS_BOOL(other))){
+            return constant(l, i, offset);
+        }
+    }
+    return constant(l, add_constant(l->chunk, value), offset);
+}
+
+static bool get_local(Lowering* l, size_t slot, size_t offset){
+    if (slot >= l->depth) return fail(l, "local outside of the frame", offset);
+    materialize(l, slot);
+    return push_operand(l, slot);
+}
+
+static bool set_local(Lowering* l, size_t slot, size_t offset){
+    if (slot + 1 >= l->depth) return fail(l, "local outside of the frame", offset);
+    size_t top = l->depth - 1;
+    uint16_t value = l->stack[top];
+    before_write(l, slot);
+    if (value != slot){
+        if (value == top && l->last_write == l->count - 1 && l->code[l->last_write].a == top){
+            // write the result of the previous instruction straight into the local
+            l->code[l->last_write].a = slot;
+            l->stack[top] = slot;
+        } else {
+            emit(l, REG_MOVE, slot, value, 0);
+        }
+    }
+    l->stack[slot] = slot;
+    return true;
+}
+
+static bool binary(Lowering* l, RegOpCode op){
+    uint16_t b = pop_operand(l);
+    uint16_t a = pop_operand(l);
+    return push_result(l, op, a, b);
+}
+
+static size_t read_3_bytes(uint8_t* code){
+    return code[0] | code[1] << 8 | code[2] << 16;
+}
+
+static size_t jump_target(uint8_t* code, size_t offset){
+    size_t amount = read_3_bytes(code + offset + 1);
+    return code[offset] == OP_LOOP ? offset + 1 - amount : offset + 1 + amount;
+}
+
+static bool is_jump(uint8_t op){
+    switch (op){
+        case OP_JUMP: case OP_LOOP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static RegOpCode compare_jump(uint8_t op){
+    switch (op){
+        case OP_JUMP_IF_NOT_EQUAL:          return REG_JUMP_IF_NOT_EQUAL;
+        case OP_JUMP_IF_EQUAL:              return REG_JUMP_IF_EQUAL;
+        case OP_JUMP_IF_NOT_LESS:           return REG_JUMP_IF_NOT_LESS;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:     return REG_JUMP_IF_NOT_LESS_EQUAL;
+        case OP_JUMP_IF_NOT_GREATER:        return REG_JUMP_IF_NOT_GREATER;
+        default:                            return REG_JUMP_IF_NOT_GREATER_EQUAL;
+    }
+}
+
+static bool lower_instruction(Lowering* l, size_t offset){
+    uint8_t* code = l->chunk->code + offset;
+    switch (code[0]){
+        case OP_CONSTANT:       return constant(l, code[1], offset);
+        case OP_CONSTANT_LONG:  return constant(l, read_3_bytes(code + 1), offset);
+        case OP_NIL:            return literal(l, NIL_VAL, offset);
+        case OP_TRUE:           return literal(l, BOOL_VAL(true), offset);
+        case OP_FALSE:          return literal(l, BOOL_VAL(false), offset);
+
+        case OP_GET_LOCAL:      return get_local(l, code[1], offset);
+        case OP_GET_LOCAL_LONG: return get_local(l, read_3_bytes(code + 1), offset);
+        case OP_GET_LOCAL_0: case OP_GET_LOCAL_1: case OP_GET_LOCAL_2: case OP_GET_LOCAL_3:
+            return get_local(l, code[0] - OP_GET_LOCAL_0, offset);
+        case OP_GET_LOCAL2:     return get_local(l, code[1], offset) && get_local(l, code[2], offset);
+        case OP_SET_LOCAL:      return set_local(l, code[1], offset);
+        case OP_SET_LOCAL_LONG: return set_local(l, read_3_bytes(code + 1), offset);
+        case OP_INC_LOCAL: {
+            size_t slot = code[1];
+            if (slot >= l->depth) return fail(l, "local outside of the frame", offset);
+            before_write(l, slot);
+            emit(l, REG_ADD, slot, l->stack[slot], code[2] | RK_CONSTANT);
+            l->stack[slot] = slot;
+            return true;
+        }
+
+        case OP_GET_GLOBAL: case OP_GET_GLOBAL_LONG: {
+            size_t slot = code[0] == OP_GET_GLOBAL ? code[1] : read_3_bytes(code + 1);
+            return push_result(l, REG_GET_GLOBAL, slot, slot >> 16);
+        }
+        case OP_SET_GLOBAL: case OP_SET_GLOBAL_LONG: {
+            size_t slot = code[0] == OP_SET_GLOBAL ? code[1] : read_3_bytes(code + 1);
+            emit(l, REG_SET_GLOBAL, l->stack[l->depth - 1], slot, slot >> 16);
+            return true;
+        }
+        case OP_DEFINE_GLOBAL: case OP_DEFINE_GLOBAL_LONG: {
+            size_t slot = code[0] == OP_DEFINE_GLOBAL ? code[1] : read_3_bytes(code + 1);
+            emit(l, REG_DEFINE_GLOBAL, pop_operand(l), slot, slot >> 16);
+            return true;
+        }
+
+        case OP_ADD:            return binary(l, REG_ADD);
+        case OP_SUB:            return binary(l, REG_SUB);
+        case OP_MUL:            return binary(l, REG_MUL);
+        case OP_DIV:            return binary(l, REG_DIV);
+        case OP_MOD:            return binary(l, REG_MOD);
+        case OP_EQUAL:          return binary(l, REG_EQUAL);
+        case OP_NOT_EQUAL:      return binary(l, REG_NOT_EQUAL);
+        case OP_LESS:           return binary(l, REG_LESS);
+        case OP_LESS_EQUAL:     return binary(l, REG_LESS_EQUAL);
+        case OP_GREATER:        return binary(l, REG_GREATER);
+        case OP_GREATER_EQUAL:  return binary(l, REG_GREATER_EQUAL);
+        case OP_NOT:            return push_result(l, REG_NOT, pop_operand(l), 0);
+        case OP_NEGATE:         return push_result(l, REG_NEGATE, pop_operand(l), 0);
+
+        case OP_PRINT:
+            emit(l, REG_PRINT, pop_operand(l), 0, 0);
+            return true;
+        case OP_POP:
+            pop_operand(l);
+            return true;
+        case OP_POPN: {
+            size_t count = read_3_bytes(code + 1);
+            if (count > l->depth) return fail(l, "popping below the frame", offset);
+            l->depth -= count;
+            return true;
+        }
+
+        case OP_JUMP: case OP_LOOP:
+            flush_from(l, 0);
+            l->reachable = false;
+            return emit_jump(l, REG_JUMP, jump_target(l->chunk->code, offset), 0, 0, offset);
+        case OP_JUMP_IF_FALSE:
+            flush_from(l, 0);
+            return emit_jump(l, REG_JUMP_IF_FALSE, jump_target(l->chunk->code, offset), l->depth - 1, 0, offset);
+        case OP_POP_JUMP_IF_FALSE: {
+            uint16_t condition = pop_operand(l);
+            flush_from(l, 0);
+            return emit_jump(l, REG_JUMP_IF_FALSE, jump_target(l->chunk->code, offset), condition, 0, offset);
+        }
+        case OP_JUMP_IF_NOT_EQUAL: case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+            uint16_t b = pop_operand(l);
+            uint16_t a = pop_operand(l);
+            flush_from(l, 0);
+            return emit_jump(l, compare_jump(code[0]), jump_target(l->chunk->code, offset), a, b, offset);
+        }
+
+        case OP_GET_UPVALUE:        return push_result(l, REG_GET_UPVALUE, code[1], 0);
+        case OP_GET_UPVALUE_LONG:   return push_result(l, REG_GET_UPVALUE, read_3_bytes(code + 1), 0);
+        case OP_SET_UPVALUE: case OP_SET_UPVALUE_LONG: {
+            size_t index = code[0] == OP_SET_UPVALUE ? code[1] : read_3_bytes(code + 1);
+            if (index > UINT16_MAX) return fail(l, "upvalue index too large", offset);
+            emit(l, REG_SET_UPVALUE, l->stack[l->depth - 1], index, 0);
+            return true;
+        }
+        case OP_CLOSURE: case OP_CLOSURE_LONG: {
+            size_t index = code[0] == OP_CLOSURE ? code[1] : read_3_bytes(code + 1);
+            if (index > UINT16_MAX) return fail(l, "constant index too large", offset);
+            // captured locals have to live in their own register
+            flush_from(l, 0);
+            if (!push_result(l, REG_CLOSURE, index, 0)) return false;
+            l->last_write = SIZE_MAX;
+            ObjFunction* function = AS_FUNCTION(l->chunk->constants.values[index]);
+            uint8_t* upvalue = code + (code[0] == OP_CLOSURE ? 2 : 4);
+            for (size_t i = 0; i < function->upvalue_count; i++){
+                size_t slot = upvalue[1];
+                if (upvalue[0] & UPVALUE_LONG) slot |= upvalue[2] << 8 | upvalue[3] << 16;
+                if (slot > UINT16_MAX) return fail(l, "upvalue index too large", offset);
+                emit(l, upvalue[0] & UPVALUE_LOCAL, slot, 0, 0);
+                upvalue += upvalue[0] & UPVALUE_LONG ? 4 : 2;
+            }
+            return true;
+        }
+        case OP_CLOSE_UPVALUE:
+            materialize(l, l->depth - 1);
+            emit(l, REG_CLOSE_UPVALUE, l->depth - 1, 0, 0);
+            pop_operand(l);
+            return true;
+
+        case OP_CALL: {
+            size_t arg_count = code[1];
+            if (arg_count + 1 > l->depth) return fail(l, "call outside of the frame", offset);
+            size_t base = l->depth - arg_count - 1;
+            // the callee can't touch slots below its own, so only the callee and arguments need
+            // copies, unless a closure of this function can change locals through an upvalue
+            flush_from(l, l->has_closures ? 0 : base);
+            emit(l, REG_CALL, base, arg_count, 0);
+            l->depth = base + 1;
+            return true;
+        }
+        case OP_RETURN:
+            emit(l, REG_RETURN, pop_operand(l), 0, 0);
+            l->reachable = false;
+            return true;
+
+        default:
+            return fail(l, "unsupported instruction", offset);
+    }
+}
+
+// lowers the whole function once, returns false if it has to be lowered again because
+// a backward jump revealed the depth of code that was dropped as unreachable
+static bool lower_pass(Lowering* l, ObjFunction* function){
+    Chunk* chunk = l->chunk;
+    l->count = 0;
+    l->jump_count = 0;
+    l->depth = function->arity + 1;
+    l->max_depth = l->depth;
+    for (size_t i = 0; i < l->depth; i++) l->stack[i] = i;
+    l->reachable = true;
+    l->last_write = SIZE_MAX;
+
+    for (size_t i = 0; i < l->ins_count; i++){
+        size_t offset = l->ins[i];
+        l->line = l->lines[offset];
+        if (l->is_target[offset]){
+            if (l->reachable){
+                flush_from(l, 0);
+                if (!merge_depth(l, offset, offset)) return true;
+            } else if (l->depth_at[offset] != -1){
+                l->depth = l->depth_at[offset];
+                for (size_t slot = 0; slot < l->depth; slot++) l->stack[slot] = slot;
+                l->reachable = true;
+            } else {
+                l->skipped[offset] = true;
+            }
+            l->last_write = SIZE_MAX;
+        }
+        l->label[offset] = l->count;
+        // code that no jump reaches is dropped
+        if (!l->reachable) continue;
+        if (!lower_instruction(l, offset)) return true;
+    }
+    l->label[chunk->count] = l->count;
+
+    bool done = true;
+    for (size_t i = 0; i < l->ins_count; i++){
+        size_t offset = l->ins[i];
+        if (l->skipped[offset] && l->depth_at[offset] != -1) done = false;
+        l->skipped[offset] = false;
+    }
+    return done;
+}
+
+static bool lower(Lowering* l, ObjFunction* function){
+    Chunk* chunk = l->chunk;
+    for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)){
+        l->ins[l->ins_count++] = offset;
+        if (is_jump(chunk->code[offset])) l->is_target[jump_target(chunk->code, offset)] = true;
+        if (chunk->code[offset] == OP_CLOSURE || chunk->code[offset] == OP_CLOSURE_LONG) l->has_closures = true;
+    }
+
+    while (!lower_pass(l, function));
+    if (l->failure != NULL) return false;
+
+    if (l->count > UINT16_MAX) return fail(l, "too many instructions", 0);
+    for (size_t i = 0; i < l->jump_count; i++){
+        l->code[l->jumps[i].index].a = l->label[l->jumps[i].target];
+    }
+    return true;
+}
+
+bool lower_to_registers(ObjFunction* function, const char* name, bool print_stats){
+    Chunk* chunk = &function->chunk;
+    if (chunk->count == 0) return false;
+    Lowering l;
+    memset(&l, 0, sizeof(Lowering));
+    l.chunk = chunk;
+    l.ins = malloc(sizeof(size_t) * chunk->count);
+    l.is_target = calloc(chunk->count + 1, sizeof(bool));
+    l.skipped = calloc(chunk->count + 1, sizeof(bool));
+    l.lines = malloc(sizeof(size_t) * chunk->count);
+    l.depth_at = malloc(sizeof(int32_t) * (chunk->count + 1));
+    l.label = malloc(sizeof(size_t) * (chunk->count + 1));
+    l.stack = malloc(sizeof(uint16_t) * (RK_MAX + 1));
+    if (l.ins == NULL || l.is_target == NULL || l.skipped == NULL || l.lines == NULL || l.depth_at == NULL ||
+        l.label == NULL || l.stack == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate register code buffers\n");
+        exit(1);
+    }
+    for (size_t i = 0; i <= chunk->count; i++) l.depth_at[i] = -1;
+
+    size_t byte = 0;
+    for (size_t i = 0; i < chunk->lines.count; i++){
+        for (size_t j = 0; j < chunk->lines.lines_t[i].count; j++){
+            l.lines[byte++] = chunk->lines.lines_t[i].line_num;
+        }
+    }
+
+    bool lowered = lower(&l, function);
+    if (print_stats){
+        if (lowered){
+            fprintf(stderr, "=== registers %s: %zu -> %zu instructions, %zu registers ===\n",
+                    name, l.ins_count, l.count, l.max_depth);
+        } else {
+            fprintf(stderr, "=== registers %s: kept on the stack VM, %s at offset %zu ===\n",
+                    name, l.failure, l.failure_offset);
+        }
+    }
+
+    if (lowered){
+        RegInstruction* code = ALLOCATE(RegInstruction, l.count);
+        size_t* lines = ALLOCATE(size_t, l.count);
+        memcpy(code, l.code, sizeof(RegInstruction) * l.count);
+        memcpy(lines, l.code_lines, sizeof(size_t) * l.count);
+        RegChunk* reg = ALLOCATE(RegChunk, 1);
+        reg->count = l.count;
+        reg->code = code;
+        reg->lines = lines;
+        reg->frame_size = l.max_depth;
+        function->reg = reg;
+    }
+
+    free(l.ins);
+    free(l.is_target);
+    free(l.skipped);
+    free(l.lines);
+    free(l.depth_at);
+    free(l.label);
+    free(l.stack);
+    free(l.code);
+    free(l.code_lines);
+    free(l.jumps);
+    return lowered;
+}
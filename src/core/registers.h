@@ -0,0 +1,8 @@
+#ifndef _REGISTERS_H
+#define _REGISTERS_H
+
+#include "../common/object.h"
+
+bool lower_to_registers(ObjFunction* function, const char* name, bool print_stats);
+
+#endif //_REGISTERS_H
@@ -0,0 +1,32 @@
+OPCODE(reg_move)
+OPCODE(reg_get_global)
+OPCODE(reg_set_global)
+OPCODE(reg_define_global)
+OPCODE(reg_add)
+OPCODE(reg_sub)
+OPCODE(reg_mul)
+OPCODE(reg_div)
+OPCODE(reg_mod)
+OPCODE(reg_equal)
+OPCODE(reg_not_equal)
+OPCODE(reg_less)
+OPCODE(reg_less_equal)
+OPCODE(reg_greater)
+OPCODE(reg_greater_equal)
+OPCODE(reg_not)
+OPCODE(reg_negate)
+OPCODE(reg_print)
+OPCODE(reg_jump)
+OPCODE(reg_jump_if_false)
+OPCODE(reg_jump_if_not_equal)
+OPCODE(reg_jump_if_equal)
+OPCODE(reg_jump_if_not_less)
+OPCODE(reg_jump_if_not_less_equal)
+OPCODE(reg_jump_if_not_greater)
+OPCODE(reg_jump_if_not_greater_equal)
+OPCODE(reg_get_upvalue)
+OPCODE(reg_set_upvalue)
+OPCODE(reg_closure)
+OPCODE(reg_close_upvalue)
+OPCODE(reg_call)
+OPCODE(reg_return)
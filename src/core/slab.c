@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200112L
+// MAP_ANONYMOUS and MAP_NORESERVE are hidden by -std=c99
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "slab.h"
+
+static void out_of_memory(){
+    fprintf(stderr, "Allocation failed\n");
+    exit(1);
+}
+
+#ifdef COMPRESSED_HEAP
+#include <sys/mman.h>
+#include <pthread.h>
+
+// every slab page and large object is carved from one reservation so that references
+// to objects fit in 32 bits. The first page is never handed out, offset 0 stands for NULL.
+// All VMs of the process share the region, their slabs take pages from it under region_lock
+char* heap_base = NULL;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct RegionRun {
+    struct RegionRun* next;
+    size_t size;
+} RegionRun;
+
+static char* region_top;              // memory from here on has not been handed out yet
+static RegionRun* region_free;        // freed runs below region_top, sorted by address, neighbours merged
+
+static void reserve_region(){
+    void* memory = mmap(NULL, HEAP_REGION_SIZE + SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) out_of_memory();
+    heap_base = (char*)(((uintptr_t)memory + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    region_top = heap_base + SLAB_PAGE_SIZE;
+    region_free = NULL;
+}
+
+// physical memory of the whole pages in the range goes back to the system
+static void discard(char* start, char* end){
+    uintptr_t first = ((uintptr_t)start + 4095) & ~(uintptr_t)4095;
+    uintptr_t last = (uintptr_t)end & ~(uintptr_t)4095;
+    if (first < last) madvise((void*)first, last - first, MADV_DONTNEED);
+}
+
+static void release_run(void* pointer, size_t size){
+    char* start = (char*)pointer;
+    size = (size + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE;
+    RegionRun** link = &region_free;
+    RegionRun* prev = NULL;
+    while (*link != NULL && (char*)*link < start){
+        prev = *link;
+        link = &(*link)->next;
+    }
+    RegionRun* next = *link;
+    if (prev != NULL && (char*)prev + prev->size == start){
+        prev->size += size;
+    } else {
+        RegionRun* run = (RegionRun*)start;
+        run->size = size;
+        run->next = next;
+        *link = run;
+        prev = run;
+    }
+    if (next != NULL && (char*)prev + prev->size == (char*)next){
+        prev->size += next->size;
+        prev->next = next->next;
+    }
+    // the last run shrinks the region instead
+    if (prev->next == NULL && (char*)prev + prev->size == region_top){
+        region_top = (char*)prev;
+        RegionRun** last = &region_free;
+        while (*last != prev) last = &(*last)->next;
+        *last = NULL;
+        discard(region_top, region_top + prev->size);
+    }
+}
+
+// first fit among the freed runs, then from the top of the region
+static void* take_run(size_t size, size_t align){
+    size = (size + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE;
+    for (RegionRun** link = &region_free; *link != NULL; link = &(*link)->next){
+        RegionRun* run = *link;
+        char* start = (char*)(((uintptr_t)run + align - 1) & ~(uintptr_t)(align - 1));
+        char* end = (char*)run + run->size;
+        if (start + size > end) continue;
+        if (start > (char*)run){
+            run->size = start - (char*)run;
+        } else {
+            *link = run->next;
+        }
+        if (start + size < end) release_run(start + size, end - (start + size));
+        return start;
+    }
+    char* start = (char*)(((uintptr_t)region_top + align - 1) & ~(uintptr_t)(align - 1));
+    if (start + size > heap_base + HEAP_REGION_SIZE) out_of_memory();
+    char* gap = region_top;
+    region_top = start + size;
+    if (start > gap) release_run(gap, start - gap);
+    return start;
+}
+
+static void* region_alloc(size_t size, size_t align){
+    pthread_mutex_lock(&region_lock);
+    void* memory = take_run(size, align);
+    pthread_mutex_unlock(&region_lock);
+    return memory;
+}
+
+static void region_release(void* pointer, size_t size){
+    pthread_mutex_lock(&region_lock);
+    release_run(pointer, size);
+    pthread_mutex_unlock(&region_lock);
+}
+#endif //COMPRESSED_HEAP
+
+static void release_page(SlabPage* page){
+#ifdef COMPRESSED_HEAP
+    region_release(page, SLAB_PAGE_SIZE);
+#else
+    free(page);
+#endif //COMPRESSED_HEAP
+}
+
+static void release_large(LargeObject* header){
+#ifdef COMPRESSED_HEAP
+    region_release(header, LARGE_HEADER_SIZE + header->size);
+#else
+    free(header);
+#endif //COMPRESSED_HEAP
+}
+
+void init_slab(SlabAllocator* slab){
+#ifdef COMPRESSED_HEAP
+    pthread_mutex_lock(&region_lock);
+    if (heap_base == NULL) reserve_region();
+    pthread_mutex_unlock(&region_lock);
+#endif //COMPRESSED_HEAP
+    for (size_t i = 0; i < SLAB_CLASSES; i++){
+        slab->blocks[i] = (SizeClass){0};
+        slab->objects[i] = (SizeClass){0};
+    }
+    slab->large = NULL;
+    slab->sweep_large = NULL;
+    slab->large_allocs = 0;
+}
+
+static void free_pages(SizeClass* size_class){
+    SlabPage* page = size_class->pages;
+    while (page != NULL){
+        SlabPage* next = page->next;
+        release_page(page);
+        page = next;
+    }
+}
+
+static void free_large(LargeObject* header){
+    while (header != NULL){
+        LargeObject* next = header->next;
+        release_large(header);
+        header = next;
+    }
+}
+
+void free_slab(SlabAllocator* slab){
+    for (size_t i = 0; i < SLAB_CLASSES; i++){
+        free_pages(&slab->blocks[i]);
+        free_pages(&slab->objects[i]);
+    }
+    free_large(slab->large);
+    free_large(slab->sweep_large);
+    init_slab(slab);
+}
+
+// pages are aligned to their size so the page of any block is found by masking its address
+static void new_page(SizeClass* size_class){
+#ifdef COMPRESSED_HEAP
+    void* memory = region_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+#else
+    void* memory;
+    if (posix_memalign(&memory, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE) != 0) out_of_memory();
+#endif //COMPRESSED_HEAP
+    SlabPage* page = (SlabPage*)memory;
+    memset(page, 0, sizeof(SlabPage));
+    page->next = size_class->pages;
+    size_class->pages = page;
+    size_class->bump = (char*)page + SLAB_HEADER_SIZE;
+    size_class->end = (char*)page + SLAB_PAGE_SIZE;
+    size_class->page_count++;
+}
+
+static void* alloc_from(SizeClass* size_class, size_t block_size){
+    void* block;
+    if (size_class->free != NULL){
+        block = size_class->free;
+        size_class->free = size_class->free->next;
+    } else {
+        if (size_class->bump == NULL || size_class->bump + block_size > size_class->end) new_page(size_class);
+        block = size_class->bump;
+        size_class->bump += block_size;
+    }
+    size_class->allocs++;
+    if (++size_class->in_use > size_class->peak) size_class->peak = size_class->in_use;
+    return block;
+}
+
+static void free_to(SizeClass* size_class, void* pointer){
+    SlabBlock* block = (SlabBlock*)pointer;
+    block->next = size_class->free;
+    size_class->free = block;
+    size_class->in_use--;
+}
+
+void* slab_alloc(SlabAllocator* slab, size_t size){
+    return alloc_from(&slab->blocks[SLAB_CLASS(size)], SLAB_BLOCK_SIZE(SLAB_CLASS(size)));
+}
+
+void slab_free(SlabAllocator* slab, void* pointer, size_t size){
+    free_to(&slab->blocks[SLAB_CLASS(size)], pointer);
+}
+
+void* slab_alloc_object(SlabAllocator* slab, size_t size, bool* is_large){
+#ifndef DEBUG_NO_SLAB
+    if (size <= SLAB_MAX_SIZE){
+        *is_large = false;
+        void* block = alloc_from(&slab->objects[SLAB_CLASS(size)], SLAB_BLOCK_SIZE(SLAB_CLASS(size)));
+        slab_set_bit(SLAB_PAGE_OF(block)->allocated, block, true);
+        return block;
+    }
+#endif //DEBUG_NO_SLAB
+    *is_large = true;
+#ifdef COMPRESSED_HEAP
+    LargeObject* header = (LargeObject*)region_alloc(LARGE_HEADER_SIZE + size, SLAB_GRANULE);
+#else
+    LargeObject* header = (LargeObject*)malloc(LARGE_HEADER_SIZE + size);
+    if (header == NULL) out_of_memory();
+#endif //COMPRESSED_HEAP
+    header->prev = NULL;
+    header->next = slab->large;
+    if (slab->large != NULL) slab->large->prev = header;
+    slab->large = header;
+    header->size = size;
+    header->is_marked = false;
+    slab->large_allocs++;
+    return LARGE_OBJECT(header);
+}
+
+// large objects the sweeper frees are already unhooked from its list
+void slab_free_object(SlabAllocator* slab, void* object, size_t size, bool is_large){
+    if (is_large){
+        LargeObject* header = LARGE_HEADER(object);
+        if (header->prev != NULL){
+            header->prev->next = header->next;
+        } else if (slab->large == header){
+            slab->large = header->next;
+        } else if (slab->sweep_large == header){
+            slab->sweep_large = header->next;
+        }
+        if (header->next != NULL) header->next->prev = header->prev;
+        release_large(header);
+        return;
+    }
+    SlabPage* page = SLAB_PAGE_OF(object);
+    slab_set_bit(page->allocated, object, false);
+    slab_set_bit(page->marked, object, false);
+    free_to(&slab->objects[SLAB_CLASS(size)], object);
+}
+
+// every object page becomes unswept and the free lists are dropped, sweeping a page
+// puts all of its free blocks back, the ones freed before and the dead objects
+void slab_start_sweep(SlabAllocator* slab){
+    for (size_t i = 0; i < SLAB_CLASSES; i++){
+        SizeClass* size_class = &slab->objects[i];
+        size_class->free = NULL;
+        size_class->bump = NULL;
+        size_class->end = NULL;
+        size_class->sweep = size_class->pages;
+    }
+    slab->sweep_large = slab->large;
+    slab->large = NULL;
+}
+
+bool slab_sweeping(SlabAllocator* slab){
+    if (slab->sweep_large != NULL) return true;
+    for (size_t i = 0; i < SLAB_CLASSES; i++){
+        if (slab->objects[i].sweep != NULL) return true;
+    }
+    return false;
+}
+
+// release gets every allocated object on the page that isn't marked and has to
+// give it back with slab_free_object, returns the number of blocks visited
+size_t slab_sweep_page(SlabAllocator* slab, size_t class_index, void (*release)(void* object)){
+    SizeClass* size_class = &slab->objects[class_index];
+    SlabPage* page = size_class->sweep;
+    size_class->sweep = page->next;
+    size_t block_size = SLAB_BLOCK_SIZE(class_index);
+    size_t blocks = 0;
+    char* end = (char*)page + SLAB_PAGE_SIZE;
+    for (char* block = (char*)page + SLAB_HEADER_SIZE; block + block_size <= end; block += block_size){
+        blocks++;
+        if (!slab_bit(page->allocated, block)){
+            ((SlabBlock*)block)->next = size_class->free;
+            size_class->free = (SlabBlock*)block;
+        } else if (!slab_bit(page->marked, block)){
+            release(block);
+        }
+    }
+    memset(page->marked, 0, sizeof(page->marked));
+    return blocks;
+}
+
+// survivors move back to the live list, returns the number of objects visited
+size_t slab_sweep_large(SlabAllocator* slab, size_t budget, void (*release)(void* object)){
+    size_t visited = 0;
+    while (slab->sweep_large != NULL && visited < budget){
+        LargeObject* header = slab->sweep_large;
+        slab->sweep_large = header->next;
+        if (slab->sweep_large != NULL) slab->sweep_large->prev = NULL;
+        visited++;
+        if (header->is_marked){
+            header->is_marked = false;
+            header->prev = NULL;
+            header->next = slab->large;
+            if (slab->large != NULL) slab->large->prev = header;
+            slab->large = header;
+        } else {
+            header->prev = NULL;
+            header->next = NULL;
+            release(LARGE_OBJECT(header));
+        }
+    }
+    return visited;
+}
+
+// visit may free the object it is given
+void slab_for_each_object(SlabAllocator* slab, void (*visit)(void* object)){
+    for (size_t i = 0; i < SLAB_CLASSES; i++){
+        size_t block_size = SLAB_BLOCK_SIZE(i);
+        for (SlabPage* page = slab->objects[i].pages; page != NULL; page = page->next){
+            char* end = (char*)page + SLAB_PAGE_SIZE;
+            for (char* block = (char*)page + SLAB_HEADER_SIZE; block + block_size <= end; block += block_size){
+                if (slab_bit(page->allocated, block)) visit(block);
+            }
+        }
+    }
+    LargeObject* lists[] = {slab->large, slab->sweep_large};
+    for (int i = 0; i < 2; i++){
+        for (LargeObject* header = lists[i], *next; header != NULL; header = next){
+            next = header->next;
+            visit(LARGE_OBJECT(header));
+        }
+    }
+}
+
+static void print_classes(const char* title, SizeClass* classes){
+    printf("%-8s %6s %10s %10s %12s %6s\n", title, "size", "in use", "peak", "allocations", "pages");
+    for (size_t i = 0; i < SLAB_CLASSES; i++){
+        SizeClass* size_class = &classes[i];
+        if (size_class->allocs == 0) continue;
+        printf("%-8s %6zu %10zu %10zu %12zu %6zu\n", "", SLAB_BLOCK_SIZE(i),
+               size_class->in_use, size_class->peak, size_class->allocs, size_class->page_count);
+    }
+}
+
+void print_slab_stats(SlabAllocator* slab){
+    printf("=== slab allocator ===\n");
+    print_classes("objects", slab->objects);
+    print_classes("blocks", slab->blocks);
+    printf("larger than %d bytes: %zu allocations from malloc\n", SLAB_MAX_SIZE, slab->large_allocs);
+}
@@ -0,0 +1,102 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "../common/common.h"
+
+#define SLAB_GRANULE 16                                 // block sizes are multiples of this
+#define SLAB_MAX_SIZE 256                               // larger blocks go to malloc
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_PAGE_SIZE (64 * 1024)                      // memory carved up at once for one size class, aligned to its size
+#define SLAB_PAGE_GRANULES (SLAB_PAGE_SIZE / SLAB_GRANULE)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_GRANULES / 64)
+
+#ifdef COMPRESSED_HEAP
+#define HEAP_REGION_SIZE ((size_t)1 << 32)              // address space reserved for the heap, offsets into it fit in 32 bits
+#endif //COMPRESSED_HEAP
+
+#define SLAB_CLASS(size) (((size) + SLAB_GRANULE - 1) / SLAB_GRANULE - 1)
+#define SLAB_BLOCK_SIZE(size_class) (((size_class) + 1) * SLAB_GRANULE)
+
+typedef struct SlabBlock {
+    struct SlabBlock* next;
+} SlabBlock;
+
+// objects keep their mark bit here instead of in their header, one bit per granule
+// of the page, so sweeping a page only touches the dead objects on it
+typedef struct SlabPage {
+    struct SlabPage* next;            // next page of the same size class
+    uint64_t allocated[SLAB_BITMAP_WORDS]; // bit set at the first granule of every object on the page
+    uint64_t marked[SLAB_BITMAP_WORDS];    // bit set at the first granule of every marked object
+} SlabPage;
+
+#define SLAB_HEADER_SIZE ((sizeof(SlabPage) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+#define SLAB_PAGE_OF(block) ((SlabPage*)((uintptr_t)(block) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+#define SLAB_GRANULE_OF(block) (((uintptr_t)(block) & (SLAB_PAGE_SIZE - 1)) / SLAB_GRANULE)
+
+// objects too large for a size class get this header in front of them
+typedef struct LargeObject {
+    struct LargeObject* prev;
+    struct LargeObject* next;
+    size_t size;
+    bool is_marked;
+} LargeObject;
+
+#define LARGE_HEADER_SIZE ((sizeof(LargeObject) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+#define LARGE_HEADER(object) ((LargeObject*)((char*)(object) - LARGE_HEADER_SIZE))
+#define LARGE_OBJECT(header) ((void*)((char*)(header) + LARGE_HEADER_SIZE))
+
+typedef struct {
+    SlabBlock* free;                  // freed blocks of this size, reused first
+    char* bump;                       // next untouched block in the newest page
+    char* end;                        // end of the newest page
+    SlabPage* pages;                  // every page of this class
+    SlabPage* sweep;                  // next page the sweeper hasn't visited, NULL when done
+    size_t in_use;                    // blocks handed out and not freed yet
+    size_t peak;                      // highest in_use seen
+    size_t allocs;                    // blocks handed out in total
+    size_t page_count;                // pages carved up for this class
+} SizeClass;
+
+typedef struct {
+    SizeClass blocks[SLAB_CLASSES];   // segregated free lists for plain memory
+    SizeClass objects[SLAB_CLASSES];  // segregated free lists for heap objects, their pages carry mark bits
+    LargeObject* large;               // objects too large for a size class
+    LargeObject* sweep_large;         // large objects the sweeper hasn't visited yet
+    size_t large_allocs;              // blocks too large for a size class
+} SlabAllocator;
+
+void init_slab(SlabAllocator* slab);
+void free_slab(SlabAllocator* slab);
+void* slab_alloc(SlabAllocator* slab, size_t size);
+void slab_free(SlabAllocator* slab, void* pointer, size_t size);
+void* slab_alloc_object(SlabAllocator* slab, size_t size, bool* is_large);
+void slab_free_object(SlabAllocator* slab, void* object, size_t size, bool is_large);
+void slab_start_sweep(SlabAllocator* slab);
+bool slab_sweeping(SlabAllocator* slab);
+size_t slab_sweep_page(SlabAllocator* slab, size_t class_index, void (*release)(void* object));
+size_t slab_sweep_large(SlabAllocator* slab, size_t budget, void (*release)(void* object));
+void slab_for_each_object(SlabAllocator* slab, void (*visit)(void* object));
+void print_slab_stats(SlabAllocator* slab);
+
+static inline bool slab_bit(const uint64_t* bitmap, void* block){
+    size_t bit = SLAB_GRANULE_OF(block);
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void slab_set_bit(uint64_t* bitmap, void* block, bool value){
+    size_t bit = SLAB_GRANULE_OF(block);
+    if (value){
+        bitmap[bit / 64] |= (uint64_t)1 << (bit % 64);
+    } else {
+        bitmap[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+    }
+}
+
+// sets the bit from any thread, returns whether it was already set
+static inline bool slab_test_and_set_bit(uint64_t* bitmap, void* block){
+    size_t bit = SLAB_GRANULE_OF(block);
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    return (__atomic_fetch_or(&bitmap[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+#endif //_SLAB_H
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "memory.h"
+#include "vm.h"
+
+typedef struct {
+    uint8_t kind;
+    char label[SNAPSHOT_LABEL_MAX];
+    uint32_t id;
+} Root;
+
+// the snapshot keeps its own bookkeeping on malloc, so taking one never triggers a collection
+typedef struct {
+    Obj** objects;                    // objects found so far, indexed by their id
+    size_t count;
+    size_t cap;
+    Obj** keys;                       // open addressing set of the objects found, ids alongside
+    uint32_t* ids;
+    size_t key_cap;
+    Root* roots;
+    size_t root_count;
+    size_t root_cap;
+    uint32_t* edges;                  // references of the object being written
+    size_t edge_count;
+    size_t edge_cap;
+} Snapshot;
+
+static void* grow(void* pointer, size_t* cap, size_t size){
+    *cap = GROW_CAP(*cap);
+    pointer = realloc(pointer, size * *cap);
+    if (pointer == NULL){
+        fprintf(stderr, "Couldn't realloc heap snapshot\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+static size_t hash_pointer(Obj* object){
+    return ((uintptr_t)object >> 4) * 2654435761u;
+}
+
+static void insert_key(Snapshot* snapshot, Obj* object, uint32_t id){
+    size_t index = hash_pointer(object) & (snapshot->key_cap - 1);
+    while (snapshot->keys[index] != NULL) index = (index + 1) & (snapshot->key_cap - 1);
+    snapshot->keys[index] = object;
+    snapshot->ids[index] = id;
+}
+
+static void grow_keys(Snapshot* snapshot){
+    free(snapshot->keys);
+    free(snapshot->ids);
+    snapshot->key_cap = snapshot->key_cap < 64 ? 64 : snapshot->key_cap * 2;
+    snapshot->keys = (Obj**)calloc(snapshot->key_cap, sizeof(Obj*));
+    snapshot->ids = (uint32_t*)malloc(sizeof(uint32_t) * snapshot->key_cap);
+    if (snapshot->keys == NULL || snapshot->ids == NULL){
+        fprintf(stderr, "Couldn't realloc heap snapshot\n");
+        exit(1);
+    }
+    for (size_t id = 0; id < snapshot->count; id++){
+        insert_key(snapshot, snapshot->objects[id], id);
+    }
+}
+
+// objects get the next id the first time they are seen
+static uint32_t id_of(Snapshot* snapshot, Obj* object){
+    if ((snapshot->count + 1) * 2 > snapshot->key_cap) grow_keys(snapshot);
+    size_t index = hash_pointer(object) & (snapshot->key_cap - 1);
+    while (snapshot->keys[index] != NULL){
+        if (snapshot->keys[index] == object) return snapshot->ids[index];
+        index = (index + 1) & (snapshot->key_cap - 1);
+    }
+    if (snapshot->count + 1 > snapshot->cap){
+        snapshot->objects = (Obj**)grow(snapshot->objects, &snapshot->cap, sizeof(Obj*));
+    }
+    uint32_t id = snapshot->count++;
+    snapshot->objects[id] = object;
+    snapshot->keys[index] = object;
+    snapshot->ids[index] = id;
+    return id;
+}
+
+static void add_root(Snapshot* snapshot, SnapshotRoot kind, const char* label, Obj* object){
+    if (snapshot->root_count + 1 > snapshot->root_cap){
+        snapshot->roots = (Root*)grow(snapshot->roots, &snapshot->root_cap, sizeof(Root));
+    }
+    Root* root = &snapshot->roots[snapshot->root_count++];
+    root->kind = kind;
+    snprintf(root->label, sizeof(root->label), "%s", label);
+    root->id = id_of(snapshot, object);
+}
+
+static void find_stack_roots(Snapshot* snapshot, CallStack* stack){
+    char label[SNAPSHOT_LABEL_MAX];
+    for (Value* slot = stack->values; slot < stack->top; slot++){
+        if (!IS_OBJ(*slot)) continue;
+        snprintf(label, sizeof(label), "slot %d", (int)(slot - stack->values));
+        add_root(snapshot, ROOT_STACK, label, AS_OBJ(*slot));
+    }
+    for (size_t i = 0; i < stack->frame_count; i++){
+        ObjString* name = stack->frames[i].closure->function->name;
+        add_root(snapshot, ROOT_FRAME, name != NULL ? name->chars : "<Script>", (Obj*)stack->frames[i].closure);
+    }
+    for (ObjUpvalue* upvalue = stack->open_upvalues; upvalue != NULL; upvalue = upvalue->next){
+        add_root(snapshot, ROOT_UPVALUE, "", (Obj*)upvalue);
+    }
+}
+
+// the same roots mark_roots starts from, the names of the globals are left out.
+// While a fiber runs, the script's stack comes first and the fiber's stack after it
+static void find_roots(Snapshot* snapshot){
+    CallStack running = { vm->stack, vm->sp, vm->stack_cap, vm->frames, vm->frame_count, vm->frame_cap, vm->open_upvalues };
+    if (vm->fiber != NULL) find_stack_roots(snapshot, &vm->script);
+    find_stack_roots(snapshot, &running);
+    for (size_t i = 0; i < vm->global_values.count; i++){
+        Value value = vm->global_values.values[i];
+        if (!IS_OBJ(value)) continue;
+        add_root(snapshot, ROOT_GLOBAL, AS_CSTRING(vm->global_names.values[i]), AS_OBJ(value));
+    }
+}
+
+static void add_edge(Obj* child, void* context){
+    Snapshot* snapshot = (Snapshot*)context;
+    uint32_t id = id_of(snapshot, child);
+    if (snapshot->edge_count + 1 > snapshot->edge_cap){
+        snapshot->edges = (uint32_t*)grow(snapshot->edges, &snapshot->edge_cap, sizeof(uint32_t));
+    }
+    snapshot->edges[snapshot->edge_count++] = id;
+}
+
+// the object together with the arrays and tables it owns
+static size_t shallow_size(Obj* object){
+    switch (object->type){
+        case OBJ_STRING: return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+        case OBJ_ARRAY: return sizeof(ObjArray) + sizeof(Value) * ((ObjArray*)object)->elements.cap;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            return sizeof(ObjFunction) + chunk->cap + sizeof(Line) * chunk->lines.cap +
+                   sizeof(Value) * chunk->constants.cap + sizeof(InlineCache) * chunk->cache_cap;
+        }
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_CLOSURE: return sizeof(ObjClosure) + sizeof(HEAP_REF(ObjUpvalue)) * ((ObjClosure*)object)->upvalue_count;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_CLASS: return sizeof(ObjClass) + sizeof(Entry) * ((ObjClass*)object)->methods.cap;
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            size_t size = sizeof(ObjInstance) + sizeof(Value) * instance->inline_cap;
+            if (instance->fields != instance->inline_fields) size += sizeof(Value) * instance->field_cap;
+            return size;
+        }
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            return sizeof(ObjShape) + sizeof(Entry) * (shape->transitions.cap + shape->index.cap);
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            return sizeof(ObjFiber) + sizeof(Value) * fiber->stack.value_cap + sizeof(CallFrame) * fiber->stack.frame_cap;
+        }
+    }
+    return 0;
+}
+
+static ObjString* label_of(Obj* object){
+    switch (object->type){
+        case OBJ_STRING: return (ObjString*)object;
+        case OBJ_FUNCTION: return ((ObjFunction*)object)->name;
+        case OBJ_CLOSURE: return ((ObjClosure*)object)->function->name;
+        case OBJ_BOUND_METHOD: return ((ObjBoundMethod*)object)->method->function->name;
+        case OBJ_CLASS: return ((ObjClass*)object)->name;
+        case OBJ_INSTANCE: return INSTANCE_CLASS((ObjInstance*)object)->name;
+        default: return NULL;
+    }
+}
+
+static void write_u8(FILE* out, uint8_t value){
+    fwrite(&value, 1, 1, out);
+}
+
+static void write_u16(FILE* out, uint16_t value){
+    fwrite(&value, 2, 1, out);
+}
+
+static void write_u32(FILE* out, uint32_t value){
+    fwrite(&value, 4, 1, out);
+}
+
+static void write_label(FILE* out, const char* label, size_t length){
+    if (length > SNAPSHOT_LABEL_MAX) length = SNAPSHOT_LABEL_MAX;
+    write_u16(out, length);
+    fwrite(label, 1, length, out);
+}
+
+// walks everything reachable from the roots breadth first, writing every object as it
+// is reached. Objects are read in place, neither mark bits nor the gray stack are touched
+bool write_heap_snapshot(const char* path){
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) return false;
+
+    Snapshot snapshot = {0};
+    find_roots(&snapshot);
+
+    fwrite(SNAPSHOT_MAGIC, 1, 4, out);
+    write_u8(out, OBJ_TYPE_COUNT);
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++){
+        const char* name = obj_type_name(type);
+        write_u8(out, strlen(name));
+        fwrite(name, 1, strlen(name), out);
+    }
+    write_u32(out, snapshot.root_count);
+    for (size_t i = 0; i < snapshot.root_count; i++){
+        Root* root = &snapshot.roots[i];
+        write_u8(out, root->kind);
+        write_label(out, root->label, strlen(root->label));
+        write_u32(out, root->id);
+    }
+
+    for (size_t id = 0; id < snapshot.count; id++){
+        Obj* object = snapshot.objects[id];
+        snapshot.edge_count = 0;
+        visit_references(object, add_edge, &snapshot);
+
+        ObjString* label = label_of(object);
+        write_u8(out, object->type);
+        write_u32(out, shallow_size(object));
+        if (label != NULL){
+            write_label(out, label->chars, label->length);
+        } else {
+            write_label(out, "", 0);
+        }
+        write_u32(out, snapshot.edge_count);
+        if (snapshot.edge_count > 0) fwrite(snapshot.edges, sizeof(uint32_t), snapshot.edge_count, out);
+    }
+    write_u8(out, SNAPSHOT_END);
+
+    free(snapshot.objects);
+    free(snapshot.keys);
+    free(snapshot.ids);
+    free(snapshot.roots);
+    free(snapshot.edges);
+    bool written = !ferror(out);
+    fclose(out);
+    return written;
+}
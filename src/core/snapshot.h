@@ -0,0 +1,29 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A heap snapshot holds every object reachable from the roots, numbered in the order
+// they were found. Integers are in the byte order of the machine that wrote it:
+//   "YHS1"
+//   u8 type count, then a u8 length and the name of every object type
+//   u32 root count, then per root: u8 kind, u16 label length, label, u32 object id
+//   per object in id order: u8 type, u32 shallow size, u16 label length, label,
+//                           u32 edge count, u32 id of every object it references
+//   u8 SNAPSHOT_END
+// The label is the string itself, or the name of the function, class or class of the instance
+#define SNAPSHOT_MAGIC "YHS1"
+#define SNAPSHOT_END 0xFF
+#define SNAPSHOT_LABEL_MAX 64
+
+typedef enum {
+    ROOT_STACK,                       // slot of the value stack
+    ROOT_FRAME,                       // closure of an active call frame
+    ROOT_UPVALUE,                     // open upvalue
+    ROOT_GLOBAL,                      // global variable, labelled with its name
+} SnapshotRoot;
+
+bool write_heap_snapshot(const char* path);
+
+#endif //_SNAPSHOT_H
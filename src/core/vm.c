@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
@@ -9,11 +10,19 @@
 #include "vm.h"
 #include "compiler.h"
 #include "memory.h"
+#include "jit.h"
+#include "cache.h"
+#include "snapshot.h"
+#include "worker.h"
 
-VM vm;
+__thread VM* vm = NULL;
 
 static void define_native(const char* name, NativeFn function, size_t arity);
 static void run_time_error(const char* fmt, ...);
+static InterpreterResult run(size_t base);
+static InterpreterResult run_nested(size_t base);
+static bool call(ObjClosure* closure, uint8_t arg_count);
+static void reset_stack();
 
 static NativeResult native_len(int arg_count, Value* args){
     UNUSED(arg_count);
@@ -32,23 +41,487 @@ static NativeResult native_clock(int arg_count, Value* args){
     return NATIVE_SUCC(NUM_VAL((double)clock() / CLOCKS_PER_SEC));
 }
 
-static NativeResult native_stdin(int arg_count, Value* args){
+static void set_stat(ObjInstance* stats, const char* name, double value){
+    push(OBJ_VAL(copy_string(name, strlen(name))));
+    instance_set_field(stats, AS_STRING(vm->sp[-1]), NUM_VAL(value));
+    pop();
+}
+
+// returns an instance with a field per counter, times are in milliseconds
+static NativeResult native_gc_stats(int arg_count, Value* args){
+    UNUSED(arg_count); UNUSED(args);
+    push(OBJ_VAL(copy_string("GCStats", 7)));
+    ObjClass* class_obj = new_class(AS_STRING(vm->sp[-1]));
+    vm->sp[-1] = OBJ_VAL(class_obj);
+    ObjInstance* stats = new_instance(class_obj);
+    vm->sp[-1] = OBJ_VAL(stats);
+
+    GCTelemetry* telemetry = &vm->telemetry;
+    set_stat(stats, "minor_collections", vm->minor_count);
+    set_stat(stats, "full_collections", vm->major_count);
+    set_stat(stats, "minor_time", telemetry->minor_time * 1000);
+    set_stat(stats, "mark_time", telemetry->mark_time * 1000);
+    set_stat(stats, "sweep_time", telemetry->sweep_time * 1000);
+    set_stat(stats, "longest_pause", vm->max_pause * 1000);
+    set_stat(stats, "heap", vm->bytes_allocated);
+    set_stat(stats, "peak_heap", telemetry->peak_heap);
+    set_stat(stats, "interned_strings", vm->strings.count);
+    size_t freed_bytes = 0;
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++){
+        char name[32];
+        snprintf(name, sizeof(name), "%s_objects", obj_type_name(type));
+        set_stat(stats, name, telemetry->allocated[type]);
+        snprintf(name, sizeof(name), "%s_bytes", obj_type_name(type));
+        set_stat(stats, name, telemetry->allocated_bytes[type]);
+        freed_bytes += telemetry->freed_bytes[type];
+    }
+    set_stat(stats, "freed_bytes", freed_bytes);
+    return NATIVE_SUCC(pop());
+}
+
+static NativeResult native_heap_snapshot(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!IS_STRING(*args)){
+        run_time_error("heap_snapshot expects the path of the file to write");
+        return NATIVE_ERROR();
+    }
+    return NATIVE_SUCC(BOOL_VAL(write_heap_snapshot(AS_CSTRING(*args))));
+}
+
+// turns a failed worker or channel operation into a runtime error
+static bool worker_error(WorkerResult result, const char* operation, uint32_t id){
+    switch (result){
+        case WORKER_OK: return false;
+        case WORKER_UNKNOWN: run_time_error("%s: no worker or channel %u", operation, id); break;
+        case WORKER_FAILED: run_time_error("%s: worker %u failed", operation, id); break;
+        case WORKER_CLOSED: run_time_error("%s: channel %u was closed", operation, id); break;
+        case WORKER_FOREIGN: run_time_error("%s: the value holds functions compiled against other globals", operation); break;
+        case WORKER_UNCOPYABLE: run_time_error("%s: the value holds a fiber, which can't be copied to another VM", operation); break;
+    }
+    return true;
+}
+
+static bool worker_id(Value value, const char* operation, uint32_t* id){
+    if (!IS_NUM(value) || !(AS_NUM(value) >= 0 && AS_NUM(value) <= UINT32_MAX)){
+        run_time_error("%s expects the id of a worker or channel", operation);
+        return false;
+    }
+    *id = (uint32_t)AS_NUM(value);
+    return true;
+}
+
+// runs fn with the elements of args as arguments on a worker VM, returns the id to join it with
+static NativeResult native_spawn(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!IS_CLOSURE(args[0]) && !IS_NATIVE(args[0]) && !IS_CLASS(args[0]) && !IS_BOUND(args[0])){
+        run_time_error("spawn expects a function to run on the worker");
+        return NATIVE_ERROR();
+    }
+    if (!IS_ARRAY(args[1]) || AS_ARRAY(args[1])->elements.count > UINT8_MAX){
+        run_time_error("spawn expects an array of at most %d arguments", UINT8_MAX);
+        return NATIVE_ERROR();
+    }
+    uint32_t id = 0;
+    if (worker_error(spawn_worker(args[0], args[1], &id), "spawn", id)) return NATIVE_ERROR();
+    return NATIVE_SUCC(NUM_VAL(id));
+}
+
+// waits for the worker and returns a copy of what its function returned
+static NativeResult native_join(int arg_count, Value* args){
+    UNUSED(arg_count);
+    uint32_t id;
+    Value result;
+    if (!worker_id(*args, "join", &id) || worker_error(join_worker(id, &result), "join", id)) return NATIVE_ERROR();
+    return NATIVE_SUCC(result);
+}
+
+static NativeResult native_channel(int arg_count, Value* args){
     UNUSED(arg_count); UNUSED(args);
-    char* s = NULL;
-    size_t count = 0;
-    size_t cap = 0;
-    char c;
-    while((c = fgetc(stdin)) != '\n'){
-        if (cap < count + 1){
-            size_t old_cap = cap;
-            cap = GROW_CAP(cap);
-            s = GROW_ARRAY(char, s, old_cap, cap);
+    return NATIVE_SUCC(NUM_VAL(new_channel()));
+}
+
+static NativeResult native_send(int arg_count, Value* args){
+    UNUSED(arg_count);
+    uint32_t id;
+    if (!worker_id(args[0], "send", &id) || worker_error(channel_send(id, args[1]), "send", id)) return NATIVE_ERROR();
+    return NATIVE_SUCC(NIL_VAL);
+}
+
+// blocks until a message arrives on the channel
+static NativeResult native_receive(int arg_count, Value* args){
+    UNUSED(arg_count);
+    uint32_t id;
+    Value value;
+    if (!worker_id(*args, "receive", &id) || worker_error(channel_receive(id, &value), "receive", id)) return NATIVE_ERROR();
+    return NATIVE_SUCC(value);
+}
+
+static NativeResult native_fiber(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!IS_CLOSURE(*args) || AS_CLOSURE(*args)->function->arity > 1){
+        run_time_error("fiber expects a function taking at most one argument");
+        return NATIVE_ERROR();
+    }
+    return NATIVE_SUCC(OBJ_VAL(new_fiber(AS_CLOSURE(*args))));
+}
+
+// stores into a stack skip the write barrier, so a fiber that stops running gets it for
+// everything on its stack before the collector may trace it as an old or already traced object
+static void save_stack(ObjFiber* fiber){
+    CallStack* stack = fiber != NULL ? &fiber->stack : &vm->script;
+    *stack = (CallStack){ vm->stack, vm->sp, vm->stack_cap, vm->frames, vm->frame_count, vm->frame_cap, vm->open_upvalues };
+    if (fiber == NULL || (!fiber->obj.is_old && vm->gc_phase != GC_MARKING)) return;
+    for (Value* slot = stack->values; slot < stack->top; slot++){
+        WRITE_BARRIER(fiber, *slot);
+    }
+    for (size_t i = 0; i < stack->frame_count; i++){
+        WRITE_BARRIER_OBJ(fiber, stack->frames[i].closure);
+    }
+    for (ObjUpvalue* upvalue = stack->open_upvalues; upvalue != NULL; upvalue = upvalue->next){
+        WRITE_BARRIER_OBJ(fiber, upvalue);
+    }
+}
+
+static void load_stack(ObjFiber* fiber){
+    CallStack* stack = fiber != NULL ? &fiber->stack : &vm->script;
+    vm->stack = stack->values;
+    vm->sp = stack->top;
+    vm->stack_cap = stack->value_cap;
+    vm->frames = stack->frames;
+    vm->frame_count = stack->frame_count;
+    vm->frame_cap = stack->frame_cap;
+    vm->open_upvalues = stack->open_upvalues;
+    vm->fiber = fiber;
+    if (fiber != NULL) fiber->state = FIBER_RUNNING;
+}
+
+static bool parked(ObjFiber* fiber){
+    return fiber->state == FIBER_BLOCKED || fiber->state == FIBER_WAITING;
+}
+
+// runs the fiber until it yields, returns or parks to wait on I/O, result is the value it yielded
+// or returned. A new fiber gets value as argument, any other one as result of the call it stopped in
+static bool switch_to(ObjFiber* fiber, Value value, Value* result){
+    ObjFiber* previous = vm->fiber;
+    bool started = fiber->state == FIBER_NEW;
+    save_stack(previous);
+    if (previous != NULL) previous->state = FIBER_WAITING;
+    load_stack(fiber);
+    bool called = true;
+    if (started){
+        ObjClosure* function = AS_CLOSURE(vm->stack[0]);
+        if (function->function->arity == 1) push(value);
+        called = call(function, function->function->arity);
+    } else {
+        push(value);
+    }
+    InterpreterResult status = called ? run_nested(0) : INTERPRET_RUNTIME_ERR;
+
+    // yielding and parking unwind the frames of the fiber as if it failed, yield leaves its value on top
+    if (status != INTERPRET_OK && fiber->state == FIBER_RUNNING){
+        // an error ends every fiber on the way back to the script
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        load_stack(previous);
+        reset_stack();
+        return false;
+    }
+    *result = status == INTERPRET_OK || fiber->state == FIBER_SUSPENDED ? pop() : NIL_VAL;
+    if (status == INTERPRET_OK){
+        // every frame returned and closed its upvalues, nothing points into the stack anymore
+        fiber->state = FIBER_DONE;
+        FREE_ARRAY(Value, vm->stack, vm->stack_cap);
+        FREE_ARRAY(CallFrame, vm->frames, vm->frame_cap);
+        vm->stack = vm->sp = NULL;
+        vm->frames = NULL;
+        vm->stack_cap = vm->frame_cap = 0;
+    }
+    save_stack(fiber);
+    if (!parked(fiber)) fiber->caller = NULL;
+    load_stack(previous);
+    return true;
+}
+
+// stops the running fiber in the native call at args, resuming it pushes the result of the call
+static NativeResult park(Value* args, FiberState state){
+    vm->sp = args - 1;
+    vm->fiber->state = state;
+    return NATIVE_ERROR();
+}
+
+// resumes a parked fiber with the result it waited for. What it yields or returns goes to the fiber
+// that waits on it in turn, until one of them parks again or the first fiber of the chain is reached
+static bool wake_fibers(ObjFiber* fiber, Value value){
+    for (;;){
+        ObjFiber* waiting = fiber->caller;
+        if (!switch_to(fiber, value, &value)){
+            while (waiting != NULL){
+                ObjFiber* next = waiting->caller;
+                waiting->state = FIBER_DONE;
+                waiting->caller = NULL;
+                waiting = next;
+            }
+            return false;
+        }
+        if (parked(fiber)) return true;
+        if (waiting == NULL){
+            if (fiber == vm->loop.awaited){
+                vm->loop.awaited = NULL;
+                vm->loop.awaited_result = value;
+            }
+            return true;
+        }
+        fiber = waiting;
+    }
+}
+
+// starts a task queued by async, or waits until an I/O operation finished and wakes the fiber
+// that waited on it. Only the script runs the loop, false once a fiber failed
+static bool step_event_loop(){
+    ObjFiber* task = next_task();
+    if (task != NULL) return task->state != FIBER_NEW || wake_fibers(task, NIL_VAL);
+    Waiter* waiter = io_next();
+    if (waiter == NULL){
+        run_time_error("Every fiber is waiting and nothing is left to wake them");
+        return false;
+    }
+    // the script takes the result of its own operations
+    if (waiter->fiber == NULL) return true;
+    ObjFiber* fiber = waiter->fiber;
+    Value result = waiter->result;
+    FREE(Waiter, waiter);
+    return wake_fibers(fiber, result);
+}
+
+static bool drain_event_loop(){
+    while (io_pending()){
+        if (!step_event_loop()) return false;
+    }
+    return true;
+}
+
+static bool await_fiber(ObjFiber* fiber, Value* result){
+    vm->loop.awaited = fiber;
+    while (vm->loop.awaited != NULL){
+        if (!step_event_loop()){
+            vm->loop.awaited = NULL;
+            return false;
         }
-        s[count++] = c;
     }
-    NativeResult res = NATIVE_SUCC(OBJ_VAL(copy_string(s, count)));
-    FREE(char, s);
-    return res;
+    *result = vm->loop.awaited_result;
+    vm->loop.awaited_result = NIL_VAL;
+    return true;
+}
+
+// runs the fiber until it yields or returns, the value it yielded or returned is the result.
+// The first resume passes value to the function of the fiber, later ones return it from yield
+static NativeResult native_resume(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!IS_FIBER(args[0])){
+        run_time_error("resume expects a fiber");
+        return NATIVE_ERROR();
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_DONE){
+        run_time_error("Can't resume a fiber that finished");
+        return NATIVE_ERROR();
+    } else if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED){
+        run_time_error("Can't resume a fiber that is running or waiting");
+        return NATIVE_ERROR();
+    }
+
+    fiber->caller = vm->fiber;
+    WRITE_BARRIER_OBJ(fiber, vm->fiber);
+    Value value;
+    if (!switch_to(fiber, args[1], &value)) return NATIVE_ERROR();
+    if (parked(fiber)){
+        // it waits on I/O and so does this fiber, the script can't park and runs the event loop instead
+        if (vm->fiber != NULL) return park(args, FIBER_WAITING);
+        if (!await_fiber(fiber, &value)) return NATIVE_ERROR();
+    }
+    return NATIVE_SUCC(value);
+}
+
+// suspends the running fiber and makes the resume that started it return value
+static NativeResult native_yield(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (vm->fiber == NULL){
+        run_time_error("yield can only be called inside a fiber");
+        return NATIVE_ERROR();
+    }
+    // the value takes the place of the call, resume pushes the value it is given there
+    vm->sp = args - 1;
+    push(*args);
+    vm->fiber->state = FIBER_SUSPENDED;
+    return NATIVE_ERROR();
+}
+
+static NativeResult native_is_done(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!IS_FIBER(*args)){
+        run_time_error("is_done expects a fiber");
+        return NATIVE_ERROR();
+    }
+    return NATIVE_SUCC(BOOL_VAL(AS_FIBER(*args)->state == FIBER_DONE));
+}
+
+// queues a new fiber that the event loop starts while the script waits, at the latest when it ends
+static NativeResult native_async(int arg_count, Value* args){
+    NativeResult fiber = native_fiber(arg_count, args);
+    if (!fiber.success) return fiber;
+    push(fiber.result);
+    queue_task(AS_FIBER(fiber.result));
+    pop();
+    return fiber;
+}
+
+static NativeResult native_wait(int arg_count, Value* args){
+    UNUSED(arg_count); UNUSED(args);
+    if (vm->fiber != NULL){
+        run_time_error("wait can only be called by the script");
+        return NATIVE_ERROR();
+    }
+    return drain_event_loop() ? NATIVE_SUCC(NIL_VAL) : NATIVE_ERROR();
+}
+
+// finishes the operation at once if it can. Otherwise the running fiber parks until it finished,
+// while the script runs the event loop instead
+static NativeResult wait_io(Waiter request, Value* args, const char* name){
+    if (io_attempt(&request)) return NATIVE_SUCC(request.result);
+    Waiter* waiter = ALLOCATE(Waiter, 1);
+    *waiter = request;
+    waiter->fiber = vm->fiber;
+    if (!io_wait(waiter)){
+        FREE(Waiter, waiter);
+        run_time_error("%s: can't wait on descriptor %d, another fiber may already wait on it", name, request.fd);
+        return NATIVE_ERROR();
+    }
+    if (vm->fiber != NULL) return park(args, FIBER_BLOCKED);
+    bool done = true;
+    while (done && !waiter->done) done = step_event_loop();
+    Value result = waiter->result;
+    io_cancel(waiter);
+    FREE(Waiter, waiter);
+    return done ? NATIVE_SUCC(result) : NATIVE_ERROR();
+}
+
+static Waiter io_request(IOOperation operation, int fd, size_t size, Value data){
+    return (Waiter){ .operation = operation, .fd = fd, .size = size, .data = data, .fiber = NULL,
+                     .done = false, .result = NIL_VAL, .next = NULL };
+}
+
+// scripts only reach the descriptors they opened, and stdin, stdout and stderr unless closing
+static bool descriptor_arg(Value value, const char* name, bool standard, int* fd){
+    if (!IS_NUM(value) || !(AS_NUM(value) >= 0 && AS_NUM(value) <= INT32_MAX) ||
+        AS_NUM(value) != (int)AS_NUM(value) ||
+        !((standard && AS_NUM(value) <= 2) || io_is_open((int)AS_NUM(value)))){
+        run_time_error("%s expects an open file descriptor", name);
+        return false;
+    }
+    *fd = (int)AS_NUM(value);
+    return true;
+}
+
+static NativeResult native_open(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]) || strlen(AS_CSTRING(args[1])) != 1 ||
+        strchr("rwa", AS_CSTRING(args[1])[0]) == NULL){
+        run_time_error("open expects a path and a mode of \"r\", \"w\" or \"a\"");
+        return NATIVE_ERROR();
+    }
+    int fd = io_open(AS_CSTRING(args[0]), AS_CSTRING(args[1]));
+    return NATIVE_SUCC(fd >= 0 ? NUM_VAL(fd) : NIL_VAL);
+}
+
+static NativeResult native_close(int arg_count, Value* args){
+    UNUSED(arg_count);
+    int fd;
+    if (!descriptor_arg(*args, "close", false, &fd)) return NATIVE_ERROR();
+    return NATIVE_SUCC(BOOL_VAL(io_close(fd)));
+}
+
+// returns up to size bytes, "" at the end of the input and nil when reading failed
+static NativeResult native_read(int arg_count, Value* args){
+    UNUSED(arg_count);
+    int fd;
+    if (!descriptor_arg(args[0], "read", true, &fd)) return NATIVE_ERROR();
+    if (!IS_NUM(args[1]) || !(AS_NUM(args[1]) >= 1)){
+        run_time_error("read expects a positive number of bytes");
+        return NATIVE_ERROR();
+    }
+    size_t size = AS_NUM(args[1]) < IO_CHUNK ? (size_t)AS_NUM(args[1]) : IO_CHUNK;
+    return wait_io(io_request(IO_READ, fd, size, NIL_VAL), args, "read");
+}
+
+// returns the next line without its newline, nil at the end of the input
+static NativeResult native_read_line(int arg_count, Value* args){
+    UNUSED(arg_count);
+    int fd;
+    if (!descriptor_arg(*args, "read_line", true, &fd)) return NATIVE_ERROR();
+    return wait_io(io_request(IO_READ_LINE, fd, 0, NIL_VAL), args, "read_line");
+}
+
+static NativeResult native_stdin(int arg_count, Value* args){
+    UNUSED(arg_count);
+    return wait_io(io_request(IO_READ_LINE, 0, 0, NIL_VAL), args, "input");
+}
+
+// returns the number of bytes written, which is all of them, or nil when writing failed
+static NativeResult native_write(int arg_count, Value* args){
+    UNUSED(arg_count);
+    int fd;
+    if (!descriptor_arg(args[0], "write", true, &fd)) return NATIVE_ERROR();
+    if (!IS_STRING(args[1])){
+        run_time_error("write expects a string");
+        return NATIVE_ERROR();
+    }
+    // print goes through stdio, what it buffered comes first
+    if (fd == 1) fflush(stdout);
+    return wait_io(io_request(IO_WRITE, fd, 0, args[1]), args, "write");
+}
+
+// returns the read and the write end of a new pipe
+static NativeResult native_pipe(int arg_count, Value* args){
+    UNUSED(arg_count); UNUSED(args);
+    int fds[2];
+    if (!io_pipe(fds)) return NATIVE_SUCC(NIL_VAL);
+    ObjArray* ends = take_array();
+    push(OBJ_VAL(ends));
+    write_value_array(&ends->elements, NUM_VAL(fds[0]));
+    write_value_array(&ends->elements, NUM_VAL(fds[1]));
+    return NATIVE_SUCC(pop());
+}
+
+static bool address_arg(Value value, const char* name){
+    if (!IS_NUM(value) && !IS_STRING(value)){
+        run_time_error("%s expects a port or the path of a unix socket", name);
+        return false;
+    }
+    return true;
+}
+
+static NativeResult native_listen(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!address_arg(*args, "listen")) return NATIVE_ERROR();
+    int fd = io_listen(*args);
+    return NATIVE_SUCC(fd >= 0 ? NUM_VAL(fd) : NIL_VAL);
+}
+
+static NativeResult native_accept(int arg_count, Value* args){
+    UNUSED(arg_count);
+    int fd;
+    if (!descriptor_arg(*args, "accept", true, &fd)) return NATIVE_ERROR();
+    return wait_io(io_request(IO_ACCEPT, fd, 0, NIL_VAL), args, "accept");
+}
+
+static NativeResult native_connect(int arg_count, Value* args){
+    UNUSED(arg_count);
+    if (!address_arg(*args, "connect")) return NATIVE_ERROR();
+    bool in_progress;
+    int fd = io_connect(*args, &in_progress);
+    if (fd < 0) return NATIVE_SUCC(NIL_VAL);
+    if (!in_progress) return NATIVE_SUCC(NUM_VAL(fd));
+    return wait_io(io_request(IO_CONNECT, fd, 0, NIL_VAL), args, "connect");
 }
 
 static NativeResult native_sqrt(int arg_count, Value* args){
@@ -61,38 +534,198 @@ static NativeResult native_sqrt(int arg_count, Value* args){
 }
 
 static void reset_stack(){
-    vm.sp = vm.stack;
-    vm.frame_count = 0;
-    vm.open_upvalues = NULL;
+    vm->sp = vm->stack;
+    vm->frame_count = 0;
+    vm->open_upvalues = NULL;
+}
+
+// entry points run on the VM they are given and hand the thread back to the one it ran before
+static VM* bind_VM(VM* machine){
+    VM* previous = vm;
+    vm = machine;
+    return previous;
 }
 
-void init_VM(){
+void init_VM_options(VMOptions* options){
+    options->peephole = true;
+    options->peephole_stats = false;
+    options->quicken = true;
+    options->ic_stats = false;
+    options->cache = true;
+    options->registers = false;
+    options->register_stats = false;
+    options->jit = false;
+    options->jit_stats = false;
+    options->jit_threshold = JIT_DEFAULT_THRESHOLD;
+    options->max_frames = DEFAULT_MAX_FRAMES;
+    options->max_stack = DEFAULT_MAX_STACK;
+    options->gc_budget = GC_DEFAULT_BUDGET;
+    options->gc_threads = 1;
+    options->gc_sweeper = false;
+    options->gc_stress = false;
+    options->gc_pacing = PACE_GROWTH;
+    options->gc_growth = GC_HEAP_GROW_FACTOR;
+    options->gc_heap_target = GC_DEFAULT_HEAP_TARGET;
+    options->gc_cpu_target = GC_DEFAULT_CPU_TARGET;
+    options->gc_nursery = GC_DEFAULT_NURSERY;
+    options->gc_stats = false;
+    options->gc_json = NULL;
+    options->heap_snapshot = NULL;
+    options->alloc_stats = false;
+}
+
+void init_VM(VM* machine, VMOptions options){
+    VM* previous = bind_VM(machine);
+    vm->options = options;
+    vm->stack = NULL;
+    vm->stack_cap = 0;
+    vm->frames = NULL;
+    vm->frame_cap = 0;
+    vm->native_depth = 0;
+    vm->fiber = NULL;
+    vm->script = (CallStack){0};
+    init_event_loop(&vm->loop);
     reset_stack();
-    vm.objects = NULL;
+    init_slab(&vm->slab);
+    vm->young = NULL;
+    vm->young_count = 0;
+    vm->young_cap = 0;
+    vm->young_bytes = 0;
+    vm->collecting_young = false;
+    vm->remembered_count = 0;
+    vm->remembered_cap = 0;
+    vm->remembered = NULL;
+    vm->gc_phase = GC_IDLE;
+    vm->minor_count = 0;
+    vm->major_count = 0;
+    vm->max_pause = 0;
+    vm->gc_time = 0;
+    vm->telemetry = (GCTelemetry){0};
 
-    vm.gray_cap = 0;
-    vm.gray_count = 0;
-    vm.gray_stack = NULL;
-    vm.bytes_allocated = 0;
-    vm.next_GC = 1024*1024;
+    vm->gray_cap = 0;
+    vm->gray_count = 0;
+    vm->gray_stack = NULL;
+    vm->bytes_allocated = 0;
+    vm->next_GC = GC_INITIAL_HEAP;
+    init_gc_pacing();
+#ifdef __unix__
+    pthread_mutex_init(&vm->heap_lock, NULL);
+#endif //__unix__
+    vm->sweeper_running = false;
+    vm->sweeper_done = false;
 
-    init_table(&vm.globals);
-    init_table(&vm.strings);
+    init_value_array(&vm->global_values);
+    init_value_array(&vm->global_names);
+    init_table(&vm->global_slots);
+    init_table(&vm->strings);
+    // the script's stacks start out below the limits, so growing them is where the limits apply
+    size_t stack_cap = options.max_stack < STACK_INITIAL ? options.max_stack : STACK_INITIAL;
+    size_t frame_cap = options.max_frames < FRAMES_INITIAL ? options.max_frames : FRAMES_INITIAL;
+    vm->stack = ALLOCATE(Value, stack_cap);
+    vm->stack_cap = stack_cap;
+    vm->frames = ALLOCATE(CallFrame, frame_cap);
+    vm->frame_cap = frame_cap;
+    reset_stack();
 
-    // vm.init_string = NULL;
-    // vm.init_string = copy_string("init", 4);
+    // vm->init_string = NULL;
+    // vm->init_string = copy_string("init", 4);
 
     define_native("clock", native_clock, 0);
     define_native("sqrt", native_sqrt, 1);
     define_native("input", native_stdin, 0);
     define_native("len", native_len, 1);
+    define_native("gc_stats", native_gc_stats, 0);
+    define_native("heap_snapshot", native_heap_snapshot, 1);
+    define_native("spawn", native_spawn, 2);
+    define_native("join", native_join, 1);
+    define_native("channel", native_channel, 0);
+    define_native("send", native_send, 2);
+    define_native("receive", native_receive, 1);
+    define_native("fiber", native_fiber, 1);
+    define_native("resume", native_resume, 2);
+    define_native("yield", native_yield, 1);
+    define_native("is_done", native_is_done, 1);
+    define_native("async", native_async, 1);
+    define_native("wait", native_wait, 0);
+    define_native("open", native_open, 2);
+    define_native("close", native_close, 1);
+    define_native("read", native_read, 2);
+    define_native("read_line", native_read_line, 1);
+    define_native("write", native_write, 2);
+    define_native("pipe", native_pipe, 0);
+    define_native("listen", native_listen, 1);
+    define_native("accept", native_accept, 1);
+    define_native("connect", native_connect, 1);
+    vm = previous;
 }
 
-void free_VM(){
-    free_table(&vm.globals);
-    free_table(&vm.strings);
-    // vm.init_string = NULL;
+static void print_function_caches(void* object){
+    if (((Obj*)object)->type != OBJ_FUNCTION) return;
+    ObjFunction* function = (ObjFunction*)object;
+    if (function->chunk.cache_count == 0) return;
+    print_inline_caches(&function->chunk, function->name != NULL ? function->name->chars : "<Script>");
+}
+
+static void print_ic_stats(){
+    slab_for_each_object(&vm->slab, print_function_caches);
+}
+
+void free_VM(VM* machine){
+    VM* previous = bind_VM(machine);
+    stop_workers();
+    stop_sweeper();
+    free_event_loop(&vm->loop);
+    if (vm->options.gc_json != NULL) write_gc_json(vm->options.gc_json);
+    if (vm->options.heap_snapshot != NULL && !write_heap_snapshot(vm->options.heap_snapshot)){
+        fprintf(stderr, "Could not write heap snapshot [%s]\n", vm->options.heap_snapshot);
+    }
+    if (vm->options.ic_stats) print_ic_stats();
+    free_value_array(&vm->global_values);
+    free_value_array(&vm->global_names);
+    free_table(&vm->global_slots);
+    free_table(&vm->strings);
+    // vm->init_string = NULL;
+    if (vm->fiber != NULL){
+        save_stack(vm->fiber);
+        load_stack(NULL);
+    }
+    FREE_ARRAY(Value, vm->stack, vm->stack_cap);
+    FREE_ARRAY(CallFrame, vm->frames, vm->frame_cap);
+    if (vm->options.gc_stats) print_gc_stats();
+    if (vm->options.alloc_stats) print_slab_stats(&vm->slab);
     free_objects();
+    free_slab(&vm->slab);
+#ifdef __unix__
+    pthread_mutex_destroy(&vm->heap_lock);
+#endif //__unix__
+    vm = previous != machine ? previous : NULL;
+}
+
+#define TRACE_EDGE 10
+
+static void print_frame(CallFrame* frame){
+    ObjFunction* function = frame->closure->function;
+    size_t line = function->reg != NULL
+        ? function->reg->lines[frame->reg_ip - function->reg->code - 1]
+        : get_line(&function->chunk.lines, (size_t)(frame->ip - function->chunk.code - 1));
+    fprintf(stderr, "[line %d] in ", line);
+    if (function->name == NULL){
+        fprintf(stderr, "script\n");
+    } else {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
+}
+
+// deep traces only show the calls at both ends
+static void print_trace(CallFrame* frames, size_t frame_count){
+    for (size_t i = frame_count; i > 0; i--){
+        if (frame_count > 2 * TRACE_EDGE && i == frame_count - TRACE_EDGE){
+            fprintf(stderr, "... %zu more calls\n", frame_count - 2 * TRACE_EDGE);
+            i = TRACE_EDGE + 1;
+            continue;
+        }
+        print_frame(&frames[i - 1]);
+    }
 }
 
 static void run_time_error(const char* fmt, ...){
@@ -102,35 +735,32 @@ static void run_time_error(const char* fmt, ...){
     va_end(args);
 
     fprintf(stderr, "\n");
-    if (vm.frame_count == 0){
+    if (vm->frame_count == 0){
         reset_stack();
         return;
     }
 
-    for (int i = vm.frame_count - 1; i >= 0; i--){
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
-        size_t line = get_line(&frame->closure->function->chunk.lines, (size_t)(frame->ip - frame->closure->function->chunk.code - 1));
-        fprintf(stderr, "[line %d] in ", line);
-        if (function->name == NULL){
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+    print_trace(vm->frames, vm->frame_count);
+    // followed by the fibers waiting on the running one, down to the script
+    if (vm->fiber != NULL){
+        for (ObjFiber* caller = vm->fiber->caller; caller != NULL; caller = caller->caller){
+            print_trace(caller->stack.frames, caller->stack.frame_count);
         }
+        print_trace(vm->script.frames, vm->script.frame_count);
     }
     reset_stack();
 }
 
 void push(Value val){
-    *(vm.sp++) = val;
+    *(vm->sp++) = val;
 }
 
 Value pop(){
-    return *(--vm.sp);
+    return *(--vm->sp);
 }
 
 Value peek(int dist){
-    return vm.sp[-1 - dist];
+    return vm->sp[-1 - dist];
 }
 
 static bool is_falsey(Value val){
@@ -168,10 +798,22 @@ static void to_string(char* s, size_t size, Value val){
 #endif
 }
 
+size_t global_slot(ObjString* name){
+    Value slot;
+    if (table_get(&vm->global_slots, name, &slot)) return (size_t)AS_NUM(slot);
+    push(OBJ_VAL(name));
+    write_value_array(&vm->global_values, EMPTY_VAL);
+    write_value_array(&vm->global_names, OBJ_VAL(name));
+    table_set(&vm->global_slots, name, NUM_VAL(vm->global_names.count - 1));
+    pop();
+    return vm->global_names.count - 1;
+}
+
 static void define_native(const char* name, NativeFn function, size_t arity){
     push(OBJ_VAL(copy_string(name, strlen(name))));
     push(OBJ_VAL(new_native(function, arity)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    size_t slot = global_slot(AS_STRING(vm->stack[0]));
+    vm->global_values.values[slot] = vm->stack[1];
     pop();
     pop();
 }
@@ -185,6 +827,7 @@ static void concatenate(Value a, Value b){
     if (IS_ARRAY(a) && IS_ARRAY(b)){
         for (size_t i = 0; i < AS_ARRAY(b)->elements.count; i++){
             write_value_array(&AS_ARRAY(a)->elements, AS_ARRAY(b)->elements.values[i]);
+            WRITE_BARRIER(AS_OBJ(a), AS_ARRAY(b)->elements.values[i]);
         }
         pop();
         pop();
@@ -198,6 +841,7 @@ static void concatenate(Value a, Value b){
             AS_ARRAY(b)->elements.values[i] = AS_ARRAY(b)->elements.values[i-1];
         }
         AS_ARRAY(b)->elements.values[0] = a;
+        WRITE_BARRIER(AS_OBJ(b), a);
         pop();
         pop();
         push(b);
@@ -206,6 +850,7 @@ static void concatenate(Value a, Value b){
 
     if (IS_ARRAY(a) && !IS_ARRAY(b)){
         write_value_array(&AS_ARRAY(a)->elements, b);
+        WRITE_BARRIER(AS_OBJ(a), b);
         pop();
         pop();
         push(a);
@@ -226,6 +871,47 @@ static void concatenate(Value a, Value b){
     }
 }
 
+static bool concatenate_values(Value a, Value b){
+    if (IS_STRING(a) || IS_STRING(b) || IS_ARRAY(a) || IS_ARRAY(b)){
+        concatenate(a, b);
+        return true;
+    }
+    run_time_error("undefined add operation");
+    return false;
+}
+
+// makes room for one more frame and size values in the running stack, false past the limits.
+// Moving the values moves the slots of every frame and the open upvalues pointing into them
+static bool grow_stack(size_t size){
+    if (vm->frame_count == vm->frame_cap){
+        if (vm->frame_cap >= vm->options.max_frames) return false;
+        size_t cap = GROW_CAP(vm->frame_cap);
+        if (cap > vm->options.max_frames) cap = vm->options.max_frames;
+        vm->frames = GROW_ARRAY(CallFrame, vm->frames, vm->frame_cap, cap);
+        vm->frame_cap = cap;
+    }
+    if (size > vm->stack_cap){
+        if (size > vm->options.max_stack) return false;
+        size_t cap = vm->stack_cap;
+        while (cap < size) cap = GROW_CAP(cap);
+        if (cap > vm->options.max_stack) cap = vm->options.max_stack;
+        Value* stack = ALLOCATE(Value, cap);
+        Value* old = vm->stack;
+        memcpy(stack, old, sizeof(Value) * (vm->sp - old));
+        for (size_t i = 0; i < vm->frame_count; i++){
+            vm->frames[i].slots = stack + (vm->frames[i].slots - old);
+        }
+        for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next){
+            upvalue->location = stack + (upvalue->location - old);
+        }
+        vm->sp = stack + (vm->sp - old);
+        vm->stack = stack;
+        FREE_ARRAY(Value, old, vm->stack_cap);
+        vm->stack_cap = cap;
+    }
+    return true;
+}
+
 static bool call(ObjClosure* closure, uint8_t arg_count){
     if (arg_count != closure->function->arity){
         printf("DEBUG: %zu\n", closure->function->arity);
@@ -233,15 +919,31 @@ static bool call(ObjClosure* closure, uint8_t arg_count){
         return false;
     }
 
-    if (vm.frame_count >= FRAMES_MAX){
+    ObjFunction* function = closure->function;
+    if (vm->options.jit && function->jit == NULL && ++function->calls == vm->options.jit_threshold){
+        jit_compile(function, vm->options.jit_stats);
+    }
+
+    RegChunk* reg = function->reg;
+    if (function->stack_size == 0){
+        function->stack_size = stack_size(&function->chunk, function->arity);
+        if (reg != NULL && reg->frame_size > function->stack_size) function->stack_size = reg->frame_size;
+    }
+    size_t size = vm->sp - arg_count - 1 - vm->stack + function->stack_size + STACK_RESERVE;
+    if ((vm->frame_count == vm->frame_cap || size > vm->stack_cap) && !grow_stack(size)){
         run_time_error("Stack overflow error");
         return false;
     }
     
-    CallFrame* frame = &vm.frames[vm.frame_count++];
+    CallFrame* frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.sp - arg_count - 1;
+    frame->ip = function->chunk.code;
+    frame->slots = vm->sp - arg_count - 1;
+    if (reg != NULL){
+        // registers that aren't arguments start out as nil, the GC scans all of them
+        frame->reg_ip = reg->code;
+        while (vm->sp < frame->slots + reg->frame_size) push(NIL_VAL);
+    }
     return true;
 }
 
@@ -255,15 +957,15 @@ static bool call_value(Value callee, uint8_t arg_count){
                     return false;
                 }
                 NativeFn native = AS_NATIVE_FN(callee);
-                NativeResult res = native(arg_count, vm.sp - arg_count);
+                NativeResult res = native(arg_count, vm->sp - arg_count);
                 if (!res.success) return false;
-                vm.sp -= arg_count + 1;
+                vm->sp -= arg_count + 1;
                 push(res.result);
                 return true;
             } break;
             case OBJ_CLASS: {
                 ObjClass* class_obj = AS_CLASS(callee);
-                vm.sp[-arg_count - 1] = OBJ_VAL(new_instance(class_obj));
+                vm->sp[-arg_count - 1] = OBJ_VAL(new_instance(class_obj));
                 
                 if (class_obj->init != NULL){
                     return call(class_obj->init, arg_count);
@@ -272,7 +974,7 @@ static bool call_value(Value callee, uint8_t arg_count){
                     return false;
                 }
                 // Value initializer;
-                // if (table_get(&class_obj->methods, vm.init_string, &initializer)){
+                // if (table_get(&class_obj->methods, vm->init_string, &initializer)){
                 //     return call(AS_CLOSURE(initializer), arg_count);
                 // } else if (arg_count != 0){
                 //     run_time_error("Expected 0 arguments but got %d arguments", arg_count);
@@ -282,7 +984,7 @@ static bool call_value(Value callee, uint8_t arg_count){
             } break;
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND(callee);
-                vm.sp[-arg_count - 1] = bound->receiver;
+                vm->sp[-arg_count - 1] = bound->receiver;
                 return call(bound->method, arg_count);
             }
             default: break;
@@ -292,86 +994,488 @@ static bool call_value(Value callee, uint8_t arg_count){
     return false;
 }
 
-static bool invoke_from_class(ObjClass* class_obj, ObjString* name, size_t arg_count){
-    if (class_obj->init != NULL && class_obj->init->function->name == name){
-        return call(class_obj->init, arg_count);
-    }
-    
-    Value method;
-    if (!table_get(&class_obj->methods, name, &method)){
-        run_time_error("Undefined property '%s'", name->chars);
-        return false;
-    }
-    return call(AS_CLOSURE(method), arg_count);
+static bool find_method(ObjClass* class_obj, ObjString* name, Value* method){
+    if (class_obj->init != NULL && class_obj->init->function->name == name){
+        *method = OBJ_VAL(class_obj->init);
+        return true;
+    }
+    return table_get(&class_obj->methods, name, method);
+}
+
+static ICEntry* ic_lookup(InlineCache* cache, Obj* shape){
+    for (uint8_t i = 0; i < cache->count; i++){
+        if (cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static void ic_record(InlineCache* cache, Obj* shape, ICKind kind, uint32_t index, Value value){
+    if (cache->count == IC_WAYS) return; // megamorphic site, stay on the slow path
+    ICEntry* entry = &cache->entries[cache->count++];
+    entry->shape = shape;
+    entry->kind = kind;
+    entry->index = index;
+    entry->value = value;
+    // the cache belongs to the running function, which may already be old
+    Obj* owner = (Obj*)vm->frames[vm->frame_count - 1].closure->function;
+    WRITE_BARRIER_OBJ(owner, shape);
+    WRITE_BARRIER(owner, value);
+}
+
+static bool invoke_from_class(ObjClass* class_obj, ObjString* name, size_t arg_count, InlineCache* cache){
+    ICEntry* entry = ic_lookup(cache, (Obj*)class_obj->shape);
+    if (entry != NULL){
+        cache->hits++;
+        return call(AS_CLOSURE(entry->value), arg_count);
+    }
+    cache->misses++;
+
+    Value method;
+    if (!find_method(class_obj, name, &method)){
+        run_time_error("Undefined property '%s'", name->chars);
+        return false;
+    }
+    ic_record(cache, (Obj*)class_obj->shape, IC_METHOD, 0, method);
+    return call(AS_CLOSURE(method), arg_count);
+}
+
+static void bind_closure(ObjClosure* method){
+    ObjBoundMethod* bound = new_bound_method(peek(0), method);
+    pop();
+    push(OBJ_VAL(bound));
+}
+
+static bool bind_method(ObjClass* class_obj, ObjString* name){
+    Value method;
+    if (!table_get(&class_obj->methods, name, &method)){
+        run_time_error("Undefined property '%s'", name->chars);
+        return false;
+    }
+    bind_closure(AS_CLOSURE(method));
+    return true;
+}
+
+static bool invoke(ObjString* name, size_t arg_count, InlineCache* cache){
+    Value receiver = peek(arg_count);
+    if (!IS_INSTANCE(receiver)){
+        run_time_error("Only instances have methods");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    ICEntry* entry = ic_lookup(cache, (Obj*)INSTANCE_SHAPE(instance));
+    if (entry != NULL){
+        cache->hits++;
+        if (entry->kind == IC_METHOD) return call(AS_CLOSURE(entry->value), arg_count);
+        Value value = instance->fields[entry->index];
+        vm->sp[-arg_count-1] = value;
+        return call_value(value, arg_count);
+    }
+    cache->misses++;
+
+    uint32_t slot;
+    if (shape_find(INSTANCE_SHAPE(instance), name, &slot)){
+        ic_record(cache, (Obj*)INSTANCE_SHAPE(instance), IC_FIELD, slot, NIL_VAL);
+        Value value = instance->fields[slot];
+        vm->sp[-arg_count-1] = value;
+        return call_value(value, arg_count);
+    }
+    Value method;
+    if (!find_method(INSTANCE_CLASS(instance), name, &method)){
+        run_time_error("Undefined property '%s'", name->chars);
+        return false;
+    }
+    ic_record(cache, (Obj*)INSTANCE_SHAPE(instance), IC_METHOD, 0, method);
+    return call(AS_CLOSURE(method), arg_count);
+}
+
+static bool get_property(ObjString* name, InlineCache* cache){
+    if (!IS_INSTANCE(peek(0))){
+        run_time_error("Only instances have properties");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+    ICEntry* entry = ic_lookup(cache, (Obj*)INSTANCE_SHAPE(instance));
+    if (entry != NULL){
+        cache->hits++;
+        if (entry->kind == IC_FIELD){
+            vm->sp[-1] = instance->fields[entry->index];
+        } else {
+            bind_closure(AS_CLOSURE(entry->value));
+        }
+        return true;
+    }
+    cache->misses++;
+
+    uint32_t slot;
+    if (shape_find(INSTANCE_SHAPE(instance), name, &slot)){
+        ic_record(cache, (Obj*)INSTANCE_SHAPE(instance), IC_FIELD, slot, NIL_VAL);
+        vm->sp[-1] = instance->fields[slot];
+        return true;
+    }
+    Value method;
+    if (!table_get(&INSTANCE_CLASS(instance)->methods, name, &method)){
+        run_time_error("Undefined property '%s'", name->chars);
+        return false;
+    }
+    ic_record(cache, (Obj*)INSTANCE_SHAPE(instance), IC_METHOD, 0, method);
+    bind_closure(AS_CLOSURE(method));
+    return true;
+}
+
+static bool set_property(ObjString* name, InlineCache* cache){
+    if (!IS_INSTANCE(peek(1))){
+        run_time_error("Only properties of instances can be set to a value");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+    ICEntry* entry = ic_lookup(cache, (Obj*)INSTANCE_SHAPE(instance));
+    if (entry != NULL){
+        cache->hits++;
+        if (entry->kind == IC_FIELD){
+            instance->fields[entry->index] = peek(0);
+            WRITE_BARRIER(instance, peek(0));
+        } else {
+            instance_add_field(instance, AS_SHAPE(entry->value), peek(0));
+        }
+    } else {
+        cache->misses++;
+        ObjShape* shape = INSTANCE_SHAPE(instance);
+        uint32_t slot;
+        if (shape_find(shape, name, &slot)){
+            ic_record(cache, (Obj*)shape, IC_FIELD, slot, NIL_VAL);
+            instance->fields[slot] = peek(0);
+            WRITE_BARRIER(instance, peek(0));
+        } else {
+            ObjShape* next = shape_transition(shape, name);
+            ic_record(cache, (Obj*)shape, IC_TRANSITION, next->slot, OBJ_VAL(next));
+            instance_add_field(instance, next, peek(0));
+        }
+    }
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+static ObjUpvalue* capture_upvalue(Value* local){
+    ObjUpvalue* prev_upval = NULL;
+    ObjUpvalue* upvalue = vm->open_upvalues;
+    while(upvalue != NULL && upvalue->location > local){
+        prev_upval = upvalue;
+        upvalue = upvalue->next;
+    }
+    if (upvalue != NULL && upvalue->location == local){
+        return upvalue;
+    }
+    ObjUpvalue* created_upvalue = new_upvalue(local);
+    // until it is closed, the fiber whose stack it points into is kept alive through it
+    if (vm->fiber != NULL) created_upvalue->closed = OBJ_VAL(vm->fiber);
+    created_upvalue->next = upvalue;
+    if (prev_upval == NULL){
+        vm->open_upvalues = created_upvalue;
+    } else {
+        prev_upval->next = created_upvalue;
+    }
+    return created_upvalue;
+}
+
+static void capture_upvalues(CallFrame* frame, ObjClosure* closure){
+    for (int32_t i = 0; i < closure->upvalue_count; i++){
+        uint8_t flags = *frame->ip++;
+        size_t index = *frame->ip++;
+        if (flags & UPVALUE_LONG){
+            index |= frame->ip[0] << 8 | frame->ip[1] << 16;
+            frame->ip+=2;
+        }
+        if (flags & UPVALUE_LOCAL){
+            closure->upvalues[i] = TO_REF(capture_upvalue(frame->slots + index));
+            WRITE_BARRIER_OBJ(closure, CLOSURE_UPVALUE(closure, i));
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
+static inline void set_upvalue(ObjUpvalue* upvalue, Value value){
+    *upvalue->location = value;
+    WRITE_BARRIER(upvalue, value);
+}
+
+static void close_upvalues(Value* last){
+    while(vm->open_upvalues != NULL &&
+          vm->open_upvalues->location >= last)
+    {
+        ObjUpvalue* upvalue = vm->open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue, upvalue->closed);
+        vm->open_upvalues = upvalue->next;
+    }
+}
+
+static void define_method(ObjString* name){
+    Value method = peek(0);
+    ObjClass* class_obj = AS_CLASS(peek(1));
+    if (name->length == 4 && memcmp(name->chars, "init", 4) == 0){
+        class_obj->init = AS_CLOSURE(method);
+    } else {
+        table_set(&class_obj->methods, name, method);
+    }
+    WRITE_BARRIER(class_obj, method);
+    pop();
+}
+
+static bool get_index(){
+    if (IS_NUM(peek(0))) {
+        if (rintf(AS_NUM(peek(0))) != AS_NUM(peek(0))){
+            run_time_error("Index must evaluate to integer number");
+            return false;
+        }
+        if (!IS_ARRAY(peek(1)) && !IS_STRING(peek(1))){
+            run_time_error("Can only index into Array object or String literal");
+            return false;
+        }
+        Value index = pop();
+        Value array = pop();
+        if (IS_ARRAY(array)) push(AS_ARRAY(array)->elements.values[(size_t)AS_NUM(index) % AS_ARRAY(array)->elements.count]);
+        else push(OBJ_VAL(copy_string(AS_CSTRING(array) + (int)AS_NUM(index), 1))); 
+    } else if (IS_STRING(peek(0))){
+        if (!IS_INSTANCE(peek(1))){
+            run_time_error("Can only get field of instance");
+            return false;
+        }
+        ObjString* index_str = AS_STRING(peek(0));
+        ObjInstance* instance = AS_INSTANCE(peek(1));
+        Value val;
+        if (instance_get_field(instance, index_str, &val)){
+            pop();
+            pop();
+            push(val);
+        } else {
+            run_time_error("Undefined property '%s'", index_str->chars);
+            return false;
+        }
+    } else {
+        run_time_error("Undefined indexing operation");
+        return false;
+    }
+    return true;
+}
+
+static bool set_index(){
+    if (IS_NUM(peek(1))) {
+        if (rintf(AS_NUM(peek(1))) != AS_NUM(peek(1))){
+            run_time_error("Index must evaluate to integer number");
+            return false;
+        }
+        if (!IS_ARRAY(peek(2)) && !IS_STRING(peek(2))){
+            run_time_error("Can only index into Array object or String literal");
+            return false;
+        }
+        Value new_val = pop();
+        Value index = pop();
+        if (IS_ARRAY(peek(0))){
+            AS_ARRAY(peek(0))->elements.values[(size_t)AS_NUM(index) % AS_ARRAY(peek(0))->elements.count] = new_val;
+            WRITE_BARRIER(AS_OBJ(peek(0)), new_val);
+        } else if (IS_STRING(new_val) && AS_STRING(new_val)->length == 1){
+            AS_CSTRING(peek(0))[(size_t)AS_NUM(index) % AS_STRING(peek(0))->length] = AS_CSTRING(new_val)[0];
+        } else {
+            run_time_error("Can only assign characters to indices of strings");
+            return false;
+        }
+    } else if (IS_STRING(peek(1))){
+        if (!IS_INSTANCE(peek(2))){
+            run_time_error("Can only set field of instance");
+            return false;
+        }
+        instance_set_field(AS_INSTANCE(peek(2)), AS_STRING(peek(1)), peek(0));
+        Value new_val = pop();
+        pop();
+        pop();
+        push(new_val);
+    } else {
+        run_time_error("Undefined indexing operation");
+        return false;
+    }
+    return true;
+}
+
+// runs the frames above base from native code, natively if the top one starts a compiled function.
+// Every run nested like this takes some of the C stack, which deep recursion would overflow
+static InterpreterResult run_nested(size_t base){
+    if (vm->native_depth == NATIVE_DEPTH_MAX){
+        run_time_error("Stack overflow error");
+        return INTERPRET_RUNTIME_ERR;
+    }
+    vm->native_depth++;
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
+    ObjFunction* function = frame->closure->function;
+    InterpreterResult result = function->jit != NULL && frame->ip == function->chunk.code &&
+                               vm->native_depth < NATIVE_JIT_MAX
+        ? function->jit->entry(frame)
+        : run(base);
+    vm->native_depth--;
+    return result;
+}
+
+// runtime entry points of the code generated by the JIT, the native code stores vm->sp
+// and frame->ip before calling any of them and reloads vm->sp afterwards
+
+// runs a frame pushed by a call from native code until it returned its result
+static bool finish_call(size_t frame_count){
+    if (vm->frame_count == frame_count) return true;
+    return run_nested(frame_count) == INTERPRET_OK;
+}
+
+// calls the callee below its arguments on top of the stack and runs it until it returned,
+// the result takes the place of the callee and the arguments
+bool call_function(uint8_t arg_count){
+    size_t frame_count = vm->frame_count;
+    return call_value(peek(arg_count), arg_count) && finish_call(frame_count);
+}
+
+// calls hand back the frame of the caller, which the stack may have moved, NULL if they failed
+static CallFrame* caller_frame(bool success){
+    return success ? &vm->frames[vm->frame_count - 1] : NULL;
+}
+
+CallFrame* jit_call(size_t arg_count){
+    return caller_frame(call_function(arg_count));
 }
 
-static ObjUpvalue* capture_upvalue(Value* local){
-    ObjUpvalue* prev_upval = NULL;
-    ObjUpvalue* upvalue = vm.open_upvalues;
-    while(upvalue != NULL && upvalue->location > local){
-        prev_upval = upvalue;
-        upvalue = upvalue->next;
+CallFrame* jit_invoke(ObjString* name, size_t arg_count, InlineCache* cache){
+    size_t frame_count = vm->frame_count;
+    return caller_frame(invoke(name, arg_count, cache) && finish_call(frame_count));
+}
+
+CallFrame* jit_super_invoke(ObjString* name, size_t arg_count, InlineCache* cache){
+    size_t frame_count = vm->frame_count;
+    ObjClass* super_class = AS_CLASS(pop());
+    return caller_frame(invoke_from_class(super_class, name, arg_count, cache) && finish_call(frame_count));
+}
+
+void jit_return(){
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
+    Value result = pop();
+    close_upvalues(frame->slots);
+    vm->frame_count--;
+    vm->sp = frame->slots;
+    push(result);
+}
+
+bool jit_binary(uint8_t op){
+    Value b = peek(0);
+    Value a = peek(1);
+    if (op == OP_ADD && !(IS_NUM(a) && IS_NUM(b))) return concatenate_values(a, b);
+    if (op == OP_DIV && IS_NUM(b) && AS_NUM(b) == 0){
+        run_time_error("Divide by 0 error");
+        return false;
     }
-    if (upvalue != NULL && upvalue->location == local){
-        return upvalue;
+    if (!IS_NUM(a) || !IS_NUM(b)){
+        run_time_error("Operands must be numbers");
+        return false;
     }
-    ObjUpvalue* created_upvalue = new_upvalue(local);
-    created_upvalue->next = upvalue;
-    if (prev_upval == NULL){
-        vm.open_upvalues = created_upvalue;
-    } else {
-        prev_upval->next = created_upvalue;
+    double x = AS_NUM(a);
+    double y = AS_NUM(b);
+    Value result;
+    switch (op){
+        case OP_ADD:            result = NUM_VAL(x + y); break;
+        case OP_SUB:            result = NUM_VAL(x - y); break;
+        case OP_MUL:            result = NUM_VAL(x * y); break;
+        case OP_DIV:            result = NUM_VAL(x / y); break;
+        case OP_MOD:            result = NUM_VAL((int)x % (int)y); break;
+        case OP_LESS:           result = BOOL_VAL(x < y); break;
+        case OP_LESS_EQUAL:     result = BOOL_VAL(x <= y); break;
+        case OP_GREATER:        result = BOOL_VAL(x > y); break;
+        default:                result = BOOL_VAL(x >= y); break;
     }
-    return created_upvalue;
+    vm->sp--;
+    vm->sp[-1] = result;
+    return true;
 }
 
-static void close_upvalues(Value* last){
-    while(vm.open_upvalues != NULL &&
-          vm.open_upvalues->location >= last)
-    {
-        ObjUpvalue* upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
-    }
+bool jit_inc_local(Value* slot, Value constant){
+    push(*slot);
+    push(constant);
+    if (!concatenate_values(*slot, constant)) return false;
+    *slot = pop();
+    return true;
 }
 
-static void define_method(ObjString* name){
-    Value method = peek(0);
-    ObjClass* class_obj = AS_CLASS(peek(1));
-    if (name->length == 4 && memcmp(name->chars, "init", 4) == 0){
-        class_obj->init = AS_CLOSURE(method);
-    } else {
-        table_set(&class_obj->methods, name, method);
+bool jit_error(const char* message){
+    run_time_error("%s", message);
+    return false;
+}
+
+bool jit_undefined_global(size_t slot){
+    run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
+    return false;
+}
+
+void jit_print(){
+    print_value(pop());
+    printf("\n");
+}
+
+void jit_array(size_t count){
+    ObjArray* arr = take_array();
+    push(OBJ_VAL(arr));
+    for (size_t i = 0; i < count; i++){
+        write_value_array(&arr->elements, peek(count-i));
     }
     pop();
+    vm->sp -= count;
+    push(OBJ_VAL(arr));
 }
 
-static bool bind_method(ObjClass* class_obj, ObjString* name){
-    Value method;
-    if (!table_get(&class_obj->methods, name, &method)){
-        run_time_error("Undefined property '%s'", name->chars);
+bool jit_get_index(){ return get_index(); }
+bool jit_set_index(){ return set_index(); }
+bool jit_get_property(ObjString* name, InlineCache* cache){ return get_property(name, cache); }
+bool jit_set_property(ObjString* name, InlineCache* cache){ return set_property(name, cache); }
+
+void jit_closure(ObjFunction* function, uint8_t* upvalues){
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
+    push(OBJ_VAL(function));
+    ObjClosure* closure = new_closure(function);
+    pop();
+    push(OBJ_VAL(closure));
+    frame->ip = upvalues;
+    capture_upvalues(frame, closure);
+}
+
+void jit_set_upvalue(size_t index){
+    set_upvalue(CLOSURE_UPVALUE(vm->frames[vm->frame_count - 1].closure, index), peek(0));
+}
+
+void jit_close_upvalue(){
+    close_upvalues(vm->sp - 1);
+    pop();
+}
+
+void jit_class(ObjString* name){
+    push(OBJ_VAL(new_class(name)));
+}
+
+void jit_method(ObjString* name){
+    define_method(name);
+}
+
+bool jit_inherit(){
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)){
+        run_time_error("Can only inherit from another class");
         return false;
     }
-    ObjBoundMethod* bound = new_bound_method(peek(0), AS_CLOSURE(method));
+    ObjClass* subclass = AS_CLASS(peek(0));
+    table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+    WRITE_BARRIER_OBJ(subclass, AS_CLASS(superclass));
     pop();
-    push(OBJ_VAL(bound));
     return true;
 }
 
-static bool invoke(ObjString* name, size_t arg_count){
-    Value receiver = peek(arg_count);
-    if (!IS_INSTANCE(receiver)){
-        run_time_error("Only instances have methods");
-        return false;
-    }
-    ObjInstance* instance = AS_INSTANCE(receiver);
-    Value value;
-    if (table_get(&instance->fields, name, &value)){
-        vm.sp[-arg_count-1] = value;
-        return call_value(value, arg_count);
-    }
-    return invoke_from_class(instance->instance_of, name, arg_count);
+bool jit_get_super(ObjString* name){
+    ObjClass* super_class = AS_CLASS(pop());
+    return bind_method(super_class, name);
 }
 
 #define MODULO_OP()                                                 \
@@ -385,17 +1489,63 @@ static bool invoke(ObjString* name, size_t arg_count){
         push(NUM_VAL((int)a % (int)b));                             \
     } while (0)                                                     \
 
-#define BINARY_OP(val_type, op)                                     \
+#define BINARY_OP(val_type, op, quick)                              \
     do {                                                            \
         if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))){                  \
             run_time_error("Operands must be numbers");             \
             return INTERPRET_RUNTIME_ERR;                           \
         }                                                           \
+        QUICKEN(quick);                                             \
         double b = AS_NUM(pop());                                 \
         double a = AS_NUM(pop());                                 \
         push(val_type(a op b));                                     \
     } while (0)                                                     \
 
+// rewrites the instruction that is executing into its specialised form
+#define QUICKEN(quick)                                              \
+    do {                                                            \
+        if (vm->options.quicken) frame->ip[-1] = quick;              \
+    } while (0)                                                     \
+
+// specialised arithmetic on two numbers, anything else turns the instruction back
+// into the generic one, which executes it and may specialise it again
+#define NUM_OP(val_type, op, generic)                               \
+    do {                                                            \
+        Value b = vm->sp[-1];                                        \
+        Value a = vm->sp[-2];                                        \
+        if (!IS_NUM(a) || !IS_NUM(b)) DEOPT(generic);               \
+        vm->sp--;                                                    \
+        vm->sp[-1] = val_type(AS_NUM(a) op AS_NUM(b));               \
+    } while (0)                                                     \
+
+#define DEOPT(generic)                                              \
+    do {                                                            \
+        frame->ip[-1] = generic;                                    \
+        goto *dispatch_table[generic];                              \
+    } while (0)                                                     \
+
+#define COMPARE_JUMP(op)                                            \
+    do {                                                            \
+        if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))){                  \
+            run_time_error("Operands must be numbers");             \
+            return INTERPRET_RUNTIME_ERR;                           \
+        }                                                           \
+        double b = AS_NUM(pop());                                   \
+        double a = AS_NUM(pop());                                   \
+        size_t jmp_amt = READ_3_BYTES();                            \
+        if (!(a op b)) frame->ip += jmp_amt;                        \
+        else frame->ip += 3;                                        \
+    } while (0)                                                     \
+
+#define EQUALS_JUMP(not)                                            \
+    do {                                                            \
+        Value b = pop();                                            \
+        Value a = pop();                                            \
+        size_t jmp_amt = READ_3_BYTES();                            \
+        if (not values_equal(a, b)) frame->ip += 3;                 \
+        else frame->ip += jmp_amt;                                  \
+    } while (0)                                                     \
+
 #define EQUALS(not)                                                 \
     do {                                                            \
         Value b = pop();                                            \
@@ -403,27 +1553,73 @@ static bool invoke(ObjString* name, size_t arg_count){
         push(BOOL_VAL(not values_equal(a, b)));                     \
     } while (0)                                                     \
 
-static InterpreterResult run(){
-    CallFrame* frame = &vm.frames[vm.frame_count-1];
+#define REG_BINARY_OP(val_type, op)                                 \
+    do {                                                            \
+        Value a = RK(ins->b);                                       \
+        Value b = RK(ins->c);                                       \
+        if (!IS_NUM(a) || !IS_NUM(b)){                              \
+            run_time_error("Operands must be numbers");             \
+            return INTERPRET_RUNTIME_ERR;                           \
+        }                                                           \
+        regs[ins->a] = val_type(AS_NUM(a) op AS_NUM(b));            \
+    } while (0)                                                     \
+
+#define REG_COMPARE_JUMP(op)                                        \
+    do {                                                            \
+        Value a = RK(ins->b);                                       \
+        Value b = RK(ins->c);                                       \
+        if (!IS_NUM(a) || !IS_NUM(b)){                              \
+            run_time_error("Operands must be numbers");             \
+            return INTERPRET_RUNTIME_ERR;                           \
+        }                                                           \
+        if (!(AS_NUM(a) op AS_NUM(b))) frame->reg_ip = reg_code + ins->a; \
+    } while (0)                                                     \
+
+// runs until the frame above base returns, base 0 runs the whole script
+static InterpreterResult run(size_t base){
+    CallFrame* frame = &vm->frames[vm->frame_count-1];
     static void* dispatch_table[] = {
         #define OPCODE(name) &&name,
         #include "opcodes.h"
         #undef OPCODE
     };
+    static void* reg_dispatch_table[] = {
+        #define OPCODE(name) &&name,
+        #include "regopcodes.h"
+        #undef OPCODE
+    };
+    RegInstruction* ins = NULL;         // register instruction being executed
+    RegInstruction* reg_code = NULL;    // register code, registers and constants of the current frame
+    Value* regs = NULL;
+    Value* consts = NULL;
     #define READ_BYTE() (*(frame->ip++))
     #define DISPATCH() goto *dispatch_table[READ_BYTE()]
     #define NEXT() goto start
     #define READ_CONSTANT(index) (frame->closure->function->chunk.constants.values[index])
     #define READ_3_BYTES() (frame->ip[0] | frame->ip[1] << 8 | frame->ip[2] << 16)
+    #define READ_CACHE() (frame->ip+=3, \
+        &frame->closure->function->chunk.caches[frame->ip[-3] | frame->ip[-2] << 8 | frame->ip[-1] << 16])
+    #define REG_NEXT() goto reg_start
+    // frames that started out interpreted, or were suspended by yield, go on interpreted
+    #define RESUME() do {                                                       \
+        if (frame->closure->function->jit != NULL &&                            \
+            frame->ip == frame->closure->function->chunk.code &&                \
+            vm->native_depth < NATIVE_JIT_MAX) goto jit_resume;                 \
+        if (frame->closure->function->reg != NULL) goto reg_resume;             \
+        NEXT();                                                                 \
+    } while (0)
+    #define RK(operand) ((operand) & RK_CONSTANT ? consts[(operand) & RK_MAX] : regs[operand])
+    #define GLOBAL_SLOT() (ins->b | (size_t)ins->c << 16)
 
 #ifdef DEBUG_TRACE_EXECUTION
     printf("\n=== Debug instructions execution ===\n");
 #endif //DEBUG_TRACE_EXECUTION
+    RESUME();
     for (;;){
         start:;
 #ifdef DEBUG_TRACE_EXECUTION
             printf("      ");
-            for (Value* slot = vm.stack; slot < vm.sp; slot++){
+            for (Value* slot = vm->stack; slot < vm->sp; slot++){
                 printf("[");
                 print_value(*slot);
                 printf("]");
@@ -431,22 +1627,18 @@ static InterpreterResult run(){
             printf("\n");
             // printf("offset: %zu\n", (size_t)(frame->ip - frame->closure->function->chunk.code));
             disassemble_instruction(&frame->closure->function->chunk, (size_t)(frame->ip - frame->closure->function->chunk.code));
-            // table_print(&vm.globals, "Globals");
 #endif //DEBUG_TRACE_EXECUTION 
             DISPATCH();
 
         op_return:;{
             Value result = pop();
             close_upvalues(frame->slots);
-            vm.frame_count--;
-            if (vm.frame_count == 0){
-                pop();
-                return INTERPRET_OK; 
-            } 
-            vm.sp = frame->slots;
+            vm->frame_count--;
+            vm->sp = frame->slots;
             push(result);
-            frame = &vm.frames[vm.frame_count - 1];
-        } NEXT();
+            if (vm->frame_count == base) return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
+        } RESUME();
         op_const:;{
             Value constant = READ_CONSTANT(READ_BYTE());
             push(constant);
@@ -465,41 +1657,60 @@ static InterpreterResult run(){
                 run_time_error("operand must be a number");
                 return INTERPRET_RUNTIME_ERR;
             }
-            vm.sp[-1] = NUM_VAL(AS_NUM(vm.sp[-1]) * -1); // access top of stack directly and negate its value
+            vm->sp[-1] = NUM_VAL(AS_NUM(vm->sp[-1]) * -1); // access top of stack directly and negate its value
         } NEXT();
         op_not:; {
-            *(vm.sp-1) = BOOL_VAL(is_falsey(*(vm.sp-1)));
+            *(vm->sp-1) = BOOL_VAL(is_falsey(*(vm->sp-1)));
         } NEXT();
         op_add:;{
             Value b = peek(0);
             Value a = peek(1);
             if (IS_NUM(a) && IS_NUM(b)) {
+                QUICKEN(OP_ADD_NUM);
                 pop();
                 pop();
                 push(NUM_VAL(AS_NUM(a) + AS_NUM(b)));
-            } else if (IS_STRING(a) || IS_STRING(b)) concatenate(a, b);
-            else if (IS_ARRAY(a) || IS_ARRAY(b)) concatenate(a, b);
-            else {
-                run_time_error("undefined add operation");
+            } else if (IS_STRING(a) && IS_STRING(b)){
+                QUICKEN(OP_ADD_STR);
+                concatenate(a, b);
+            } else if (!concatenate_values(a, b)){
                 return INTERPRET_RUNTIME_ERR;
             }
         } NEXT();
+        op_add_num:;        NUM_OP(NUM_VAL, +, OP_ADD); NEXT();
+        op_add_str:;{
+            Value b = vm->sp[-1];
+            Value a = vm->sp[-2];
+            if (!IS_STRING(a) || !IS_STRING(b)) DEOPT(OP_ADD);
+            concat_string(AS_CSTRING(a), AS_STRING(a)->length, AS_CSTRING(b), AS_STRING(b)->length);
+        } NEXT();
+        op_sub_num:;        NUM_OP(NUM_VAL, -, OP_SUB); NEXT();
+        op_mul_num:;        NUM_OP(NUM_VAL, *, OP_MUL); NEXT();
+        op_div_num:;{
+            // dividing by zero is an error the generic instruction reports
+            if (IS_NUM(vm->sp[-1]) && AS_NUM(vm->sp[-1]) == 0) DEOPT(OP_DIV);
+            NUM_OP(NUM_VAL, /, OP_DIV);
+        } NEXT();
+        op_less_num:;           NUM_OP(BOOL_VAL, <, OP_LESS); NEXT();
+        op_less_equal_num:;     NUM_OP(BOOL_VAL, <=, OP_LESS_EQUAL); NEXT();
+        op_greater_num:;        NUM_OP(BOOL_VAL, >, OP_GREATER); NEXT();
+        op_greater_equal_num:;  NUM_OP(BOOL_VAL, >=, OP_GREATER_EQUAL); NEXT();
         op_div:;{
             if (IS_NUM(peek(0)) && AS_NUM(peek(0)) == 0){
                 run_time_error("Divide by 0 error");
                 return INTERPRET_RUNTIME_ERR;
             }
-            BINARY_OP(NUM_VAL, /);
+            BINARY_OP(NUM_VAL, /, OP_DIV_NUM);
         } NEXT();
-        op_sub:;            BINARY_OP(NUM_VAL, -); NEXT();
+        op_sub:;            BINARY_OP(NUM_VAL, -, OP_SUB_NUM); NEXT();
         op_mod:;            MODULO_OP(); NEXT();
-        op_mul:;            BINARY_OP(NUM_VAL, *); NEXT();
+        op_mul:;            BINARY_OP(NUM_VAL, *, OP_MUL_NUM); NEXT();
         op_equal:;          EQUALS(); NEXT();
         op_not_equal:;      EQUALS(!); NEXT();
-        op_less:;           BINARY_OP(BOOL_VAL, <); NEXT();
-        op_less_equal:;     BINARY_OP(BOOL_VAL, <=); NEXT();
-        op_greater:;        BINARY_OP(BOOL_VAL, >); NEXT();
-        op_greater_equal:;  BINARY_OP(BOOL_VAL, >=); NEXT();
+        op_less:;           BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); NEXT();
+        op_less_equal:;     BINARY_OP(BOOL_VAL, <=, OP_LESS_EQUAL_NUM); NEXT();
+        op_greater:;        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); NEXT();
+        op_greater_equal:;  BINARY_OP(BOOL_VAL, >=, OP_GREATER_EQUAL_NUM); NEXT();
         op_print:; {
             print_value(pop());
             printf("\n");
@@ -511,77 +1722,75 @@ static InterpreterResult run(){
             for (size_t i = 0; i < num; i++) pop();
         } NEXT();
         op_define_global:; {
-            ObjString* name = AS_STRING(READ_CONSTANT(READ_BYTE()));
-            push(OBJ_VAL(name));
-            table_set(&vm.globals, name, peek(1));
-            pop();
-            pop();
+            vm->global_values.values[READ_BYTE()] = pop();
         } NEXT();
         op_define_global_long:; {
-            size_t const_index = READ_3_BYTES();
-            ObjString* name = AS_STRING(READ_CONSTANT(const_index));
-            push(OBJ_VAL(name));
-            table_set(&vm.globals, name, peek(1));
-            pop();
-            pop();
+            size_t slot = READ_3_BYTES();
+            vm->global_values.values[slot] = pop();
             frame->ip+=3;
         } NEXT();
         op_get_global:;{
-            ObjString* name = AS_STRING(READ_CONSTANT(READ_BYTE()));
-            Value value;
-            if (!table_get(&vm.globals, name, &value)){
-                run_time_error("Undefined variable '%s'", name->chars);
+            size_t slot = READ_BYTE();
+            Value value = vm->global_values.values[slot];
+            if (IS_EMPTY(value)){
+                run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERR;
             }
             push(value);
         } NEXT();
         op_get_global_long:;{
-            size_t const_index = READ_3_BYTES();
-            ObjString* name = AS_STRING(READ_CONSTANT(const_index));
-            Value value;
-            if (!table_get(&vm.globals, name, &value)){
-                run_time_error("Undefined variable '%s'", name->chars);
+            size_t slot = READ_3_BYTES();
+            Value value = vm->global_values.values[slot];
+            if (IS_EMPTY(value)){
+                run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERR;
             }
             push(value);
             frame->ip+=3;
         } NEXT();
         op_set_global:;{
-            ObjString* name = AS_STRING(READ_CONSTANT(READ_BYTE()));
-            if (table_set(&vm.globals, name, peek(0))){ // is_new_key in hash, so undefined variable
-                table_delete(&vm.globals, name);
-                run_time_error("Undefined variable '%s'", name->chars);
+            size_t slot = READ_BYTE();
+            if (IS_EMPTY(vm->global_values.values[slot])){
+                run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERR;
             }
+            vm->global_values.values[slot] = peek(0);
         } NEXT();
         op_set_global_long:;{
-            size_t const_index = READ_3_BYTES();
-            ObjString* name = AS_STRING(READ_CONSTANT(const_index));
-            if (table_set(&vm.globals, name, peek(0))){ // is_new_key in hash, so undefined variable
-                table_delete(&vm.globals, name);
-                run_time_error("Undefined variable '%s'", name->chars);
+            size_t slot = READ_3_BYTES();
+            if (IS_EMPTY(vm->global_values.values[slot])){
+                run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERR;
             }
+            vm->global_values.values[slot] = peek(0);
             frame->ip+=3;
         } NEXT();
-        op_get_local:;{
+        op_get_local:; push(frame->slots[READ_BYTE()]); NEXT();
+        op_get_local_long:;{
             size_t slot = READ_3_BYTES();
             push(frame->slots[slot]);
             frame->ip+=3;
         } NEXT();
-        op_set_local:;{
+        op_get_local_0:; push(frame->slots[0]); NEXT();
+        op_get_local_1:; push(frame->slots[1]); NEXT();
+        op_get_local_2:; push(frame->slots[2]); NEXT();
+        op_get_local_3:; push(frame->slots[3]); NEXT();
+        op_set_local:; frame->slots[READ_BYTE()] = peek(0); NEXT();
+        op_set_local_long:;{
             size_t slot = READ_3_BYTES();
             frame->slots[slot] = peek(0);
             frame->ip+=3;
         } NEXT();
-        op_set_upvalue:;{
+        op_set_upvalue:; set_upvalue(CLOSURE_UPVALUE(frame->closure, READ_BYTE()), peek(0)); NEXT();
+        op_set_upvalue_long:;{
             size_t slot = READ_3_BYTES();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            set_upvalue(CLOSURE_UPVALUE(frame->closure, slot), peek(0));
             frame->ip+=3;
         } NEXT();
-        op_get_upvalue:;{
+        op_get_upvalue:; push(*CLOSURE_UPVALUE(frame->closure, READ_BYTE())->location); NEXT();
+        op_get_upvalue_long:;{
             size_t slot = READ_3_BYTES();
-            push(*frame->closure->upvalues[slot]->location);
+            push(*CLOSURE_UPVALUE(frame->closure, slot)->location);
             frame->ip+=3;
         } NEXT();
         op_array:; {
@@ -607,74 +1816,8 @@ static InterpreterResult run(){
             push(OBJ_VAL(arr));
             frame->ip+=3;
         } NEXT();
-        op_get_index:;{
-            if (IS_NUM(peek(0))) {
-                if (rintf(AS_NUM(peek(0))) != AS_NUM(peek(0))){
-                    run_time_error("Index must evaluate to integer number");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                if (!IS_ARRAY(peek(1)) && !IS_STRING(peek(1))){
-                    run_time_error("Can only index into Array object or String literal");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                Value index = pop();
-                Value array = pop();
-                if (IS_ARRAY(array)) push(AS_ARRAY(array)->elements.values[(size_t)AS_NUM(index) % AS_ARRAY(array)->elements.count]);
-                else push(OBJ_VAL(copy_string(AS_CSTRING(array) + (int)AS_NUM(index), 1))); 
-            } else if (IS_STRING(peek(0))){
-                if (!IS_INSTANCE(peek(1))){
-                    run_time_error("Can only get field of instance");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                ObjString* index_str = AS_STRING(pop());
-                ObjInstance* instance = AS_INSTANCE(pop());
-                Value val;
-                if (table_get(&instance->fields, index_str, &val)){
-                    push(val);
-                } else {
-                    run_time_error("Undefined property '%s'", index_str->chars);
-                    return INTERPRET_RUNTIME_ERR;
-                }
-            } else {
-                run_time_error("Undefined indexing operation");
-                return INTERPRET_RUNTIME_ERR;
-            }
-        } NEXT();
-        op_set_index:;{
-            if (IS_NUM(peek(1))) {
-                if (rintf(AS_NUM(peek(1))) != AS_NUM(peek(1))){
-                    run_time_error("Index must evaluate to integer number");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                if (!IS_ARRAY(peek(2)) && !IS_STRING(peek(2))){
-                    run_time_error("Can only index into Array object or String literal");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                Value new_val = pop();
-                Value index = pop();
-                if (IS_ARRAY(peek(0))){
-                    AS_ARRAY(peek(0))->elements.values[(size_t)AS_NUM(index) % AS_ARRAY(peek(0))->elements.count] = new_val;
-                } else if (IS_STRING(new_val) && AS_STRING(new_val)->length == 1){
-                    AS_CSTRING(peek(0))[(size_t)AS_NUM(index) % AS_STRING(peek(0))->length] = AS_CSTRING(new_val)[0];
-                } else {
-                    run_time_error("Can only assign characters to indices of strings");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-            } else if (IS_STRING(peek(1))){
-                if (!IS_INSTANCE(peek(2))){
-                    run_time_error("Can only set field of instance");
-                    return INTERPRET_RUNTIME_ERR;
-                }
-                table_set(&AS_INSTANCE(peek(2))->fields, AS_STRING(peek(1)), peek(0));
-                Value new_val = pop();
-                pop();
-                pop();
-                push(new_val);
-            } else {
-                run_time_error("Undefined indexing operation");
-                return INTERPRET_RUNTIME_ERR;
-            }
-        } NEXT();
+        op_get_index:; if (!get_index()) return INTERPRET_RUNTIME_ERR; NEXT();
+        op_set_index:; if (!set_index()) return INTERPRET_RUNTIME_ERR; NEXT();
         op_jump:; {
             size_t jmp_amt = READ_3_BYTES();
             frame->ip += jmp_amt;
@@ -688,29 +1831,52 @@ static InterpreterResult run(){
             if (is_falsey(peek(0))) frame->ip += jmp_amt;
             else frame->ip+=3;
         } NEXT();
+        op_pop_jump_if_false:;{
+            size_t jmp_amt = READ_3_BYTES();
+            if (is_falsey(pop())) frame->ip += jmp_amt;
+            else frame->ip+=3;
+        } NEXT();
+        op_jump_if_not_equal:;          EQUALS_JUMP(); NEXT();
+        op_jump_if_equal:;              EQUALS_JUMP(!); NEXT();
+        op_jump_if_not_less:;           COMPARE_JUMP(<); NEXT();
+        op_jump_if_not_less_equal:;     COMPARE_JUMP(<=); NEXT();
+        op_jump_if_not_greater:;        COMPARE_JUMP(>); NEXT();
+        op_jump_if_not_greater_equal:;  COMPARE_JUMP(>=); NEXT();
+        op_inc_local:;{
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT(READ_BYTE());
+            Value local = frame->slots[slot];
+            if (IS_NUM(local)){
+                frame->slots[slot] = NUM_VAL(AS_NUM(local) + AS_NUM(constant));
+            } else {
+                push(local);
+                push(constant);
+                if (!concatenate_values(local, constant)){
+                    return INTERPRET_RUNTIME_ERR;
+                }
+                frame->slots[slot] = pop();
+            }
+        } NEXT();
+        op_get_local2:;{
+            uint8_t a = READ_BYTE();
+            uint8_t b = READ_BYTE();
+            push(frame->slots[a]);
+            push(frame->slots[b]);
+        } NEXT();
         op_call:;{
             uint8_t arg_count = READ_BYTE();
             if (!call_value(peek(arg_count), arg_count)){
                 return INTERPRET_RUNTIME_ERR;
             }
-            frame = &vm.frames[vm.frame_count-1];
-        } NEXT();
+            frame = &vm->frames[vm->frame_count-1];
+        } RESUME();
         op_closure:;{
             ObjFunction* function = AS_FUNCTION(READ_CONSTANT(READ_BYTE()));
             push(OBJ_VAL(function));
             ObjClosure* closure = new_closure(function);
             pop();
             push(OBJ_VAL(closure));
-            for (int32_t i = 0; i < closure->upvalue_count; i++){
-                uint8_t is_local = READ_BYTE();
-                size_t index = READ_3_BYTES();
-                frame->ip+=3;
-                if (is_local){
-                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
+            capture_upvalues(frame, closure);
         } NEXT();
         op_closure_long:;{
             ObjFunction* function = AS_FUNCTION(READ_CONSTANT(READ_3_BYTES()));
@@ -719,19 +1885,10 @@ static InterpreterResult run(){
             pop();
             push(OBJ_VAL(closure));
             frame->ip+=3;
-            for (int32_t i = 0; i < closure->upvalue_count; i++){
-                uint8_t is_local = READ_BYTE();
-                size_t index = READ_3_BYTES();
-                frame->ip+=3;
-                if (is_local){
-                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
+            capture_upvalues(frame, closure);
         } NEXT();
         op_close_upvalue:;{
-            close_upvalues(vm.sp - 1);
+            close_upvalues(vm->sp - 1);
             pop();
         } NEXT();
         op_class:; {
@@ -743,70 +1900,44 @@ static InterpreterResult run(){
             define_method(AS_STRING(READ_CONSTANT(READ_BYTE())));
         } NEXT();
         op_get_prop:;{
-            if (!IS_INSTANCE(peek(0))){
-                run_time_error("Only instances have properties");
-                return INTERPRET_RUNTIME_ERR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(0));
             ObjString* name = AS_STRING(READ_CONSTANT(READ_BYTE()));
-            Value value;
-            if (table_get(&instance->fields, name, &value)){
-                pop();
-                push(value);
-            } else if (!bind_method(instance->instance_of, name)){
+            InlineCache* cache = READ_CACHE();
+            if (!get_property(name, cache)){
                 return INTERPRET_RUNTIME_ERR;
             }
         } NEXT();
         op_get_prop_long:;{
-            if (!IS_INSTANCE(peek(0))){
-                run_time_error("Only instances have properties");
-                return INTERPRET_RUNTIME_ERR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(0));
             ObjString* name = AS_STRING(READ_CONSTANT(READ_3_BYTES()));
             frame->ip+=3;
-            Value value;
-            if (table_get(&instance->fields, name, &value)){
-                pop();
-                push(value);
-            } else {
-                run_time_error("Undefined property '%s'", name->chars);
+            InlineCache* cache = READ_CACHE();
+            if (!get_property(name, cache)){
                 return INTERPRET_RUNTIME_ERR;
             }
         } NEXT();
         op_set_prop:;{
-            if (!IS_INSTANCE(peek(1))){
-                run_time_error("Only properties of instances can be set to a value");
+            ObjString* name = AS_STRING(READ_CONSTANT(READ_BYTE()));
+            InlineCache* cache = READ_CACHE();
+            if (!set_property(name, cache)){
                 return INTERPRET_RUNTIME_ERR;
             }
-            ObjInstance* instance = AS_INSTANCE(peek(1));
-            ObjString* name = AS_STRING(READ_CONSTANT(READ_BYTE()));
-            table_set(&instance->fields, name, peek(0));
-            Value value = pop();
-            pop();
-            push(value);
         } NEXT();
         op_set_prop_long:;{
-            if (!IS_INSTANCE(peek(1))){
-                run_time_error("Only properties of instances can be set to a value");
-                return INTERPRET_RUNTIME_ERR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(1));
             ObjString* name = AS_STRING(READ_CONSTANT(READ_3_BYTES()));
             frame->ip+=3;
-            table_set(&instance->fields, name, peek(0));
-            Value value = pop();
-            pop();
-            push(value);
+            InlineCache* cache = READ_CACHE();
+            if (!set_property(name, cache)){
+                return INTERPRET_RUNTIME_ERR;
+            }
         } NEXT();
         op_invoke:;{
             ObjString* method = AS_STRING(READ_CONSTANT(READ_BYTE()));
             size_t arg_count = READ_BYTE();
-            if (!invoke(method, arg_count)){
+            InlineCache* cache = READ_CACHE();
+            if (!invoke(method, arg_count, cache)){
                 return INTERPRET_RUNTIME_ERR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-        } NEXT();
+            frame = &vm->frames[vm->frame_count - 1];
+        } RESUME();
         op_inherit:;{
             Value superclass = peek(1);
             if (!IS_CLASS(superclass)){
@@ -815,6 +1946,7 @@ static InterpreterResult run(){
             }
             ObjClass* subclass = AS_CLASS(peek(0));
             table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+            WRITE_BARRIER_OBJ(subclass, AS_CLASS(superclass));
             pop();
         } NEXT();
         op_get_super:;{
@@ -827,30 +1959,230 @@ static InterpreterResult run(){
         op_super_invoke:;{
             ObjString* method = AS_STRING(READ_CONSTANT(READ_BYTE()));
             size_t arg_count = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
             ObjClass* super_class = AS_CLASS(pop());
-            if (!invoke_from_class(super_class, method, arg_count)){
+            if (!invoke_from_class(super_class, method, arg_count, cache)){
                 return INTERPRET_RUNTIME_ERR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-        } NEXT();
+            frame = &vm->frames[vm->frame_count - 1];
+        } RESUME();
+
+        // native code runs its frame until it returns and then continues with the caller
+        jit_resume:;
+            vm->native_depth++;
+            InterpreterResult result = frame->closure->function->jit->entry(frame);
+            vm->native_depth--;
+            if (result != INTERPRET_OK) return INTERPRET_RUNTIME_ERR;
+            if (vm->frame_count == base) return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
+            RESUME();
+
+        // register code, entered through reg_resume whenever the current frame changes
+        reg_resume:;
+            reg_code = frame->closure->function->reg->code;
+            regs = frame->slots;
+            consts = frame->closure->function->chunk.constants.values;
+            vm->sp = regs + frame->closure->function->reg->frame_size;
+        reg_start:;
+#ifdef DEBUG_TRACE_EXECUTION
+            printf("      ");
+            for (Value* slot = regs; slot < vm->sp; slot++){
+                printf("[");
+                print_value(*slot);
+                printf("]");
+            }
+            printf("\n");
+            disassemble_reg_instruction(frame->closure->function, (size_t)(frame->reg_ip - reg_code));
+#endif //DEBUG_TRACE_EXECUTION 
+            ins = frame->reg_ip++;
+            goto *reg_dispatch_table[ins->op];
+
+        reg_move:; regs[ins->a] = RK(ins->b); REG_NEXT();
+        reg_get_global:;{
+            Value value = vm->global_values.values[GLOBAL_SLOT()];
+            if (IS_EMPTY(value)){
+                run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[GLOBAL_SLOT()]));
+                return INTERPRET_RUNTIME_ERR;
+            }
+            regs[ins->a] = value;
+        } REG_NEXT();
+        reg_set_global:;{
+            if (IS_EMPTY(vm->global_values.values[GLOBAL_SLOT()])){
+                run_time_error("Undefined variable '%s'", AS_CSTRING(vm->global_names.values[GLOBAL_SLOT()]));
+                return INTERPRET_RUNTIME_ERR;
+            }
+            vm->global_values.values[GLOBAL_SLOT()] = RK(ins->a);
+        } REG_NEXT();
+        reg_define_global:; vm->global_values.values[GLOBAL_SLOT()] = RK(ins->a); REG_NEXT();
+        reg_add:;{
+            Value a = RK(ins->b);
+            Value b = RK(ins->c);
+            if (IS_NUM(a) && IS_NUM(b)){
+                regs[ins->a] = NUM_VAL(AS_NUM(a) + AS_NUM(b));
+            } else {
+                push(a);
+                push(b);
+                if (!concatenate_values(a, b)){
+                    return INTERPRET_RUNTIME_ERR;
+                }
+                regs[ins->a] = pop();
+            }
+        } REG_NEXT();
+        reg_sub:;           REG_BINARY_OP(NUM_VAL, -); REG_NEXT();
+        reg_mul:;           REG_BINARY_OP(NUM_VAL, *); REG_NEXT();
+        reg_div:;{
+            Value b = RK(ins->c);
+            if (IS_NUM(b) && AS_NUM(b) == 0){
+                run_time_error("Divide by 0 error");
+                return INTERPRET_RUNTIME_ERR;
+            }
+            REG_BINARY_OP(NUM_VAL, /);
+        } REG_NEXT();
+        reg_mod:;{
+            Value a = RK(ins->b);
+            Value b = RK(ins->c);
+            if (!IS_NUM(a) || !IS_NUM(b)){
+                run_time_error("Operands must be numbers");
+                return INTERPRET_RUNTIME_ERR;
+            }
+            regs[ins->a] = NUM_VAL((int)AS_NUM(a) % (int)AS_NUM(b));
+        } REG_NEXT();
+        reg_equal:;         regs[ins->a] = BOOL_VAL(values_equal(RK(ins->b), RK(ins->c))); REG_NEXT();
+        reg_not_equal:;     regs[ins->a] = BOOL_VAL(!values_equal(RK(ins->b), RK(ins->c))); REG_NEXT();
+        reg_less:;          REG_BINARY_OP(BOOL_VAL, <); REG_NEXT();
+        reg_less_equal:;    REG_BINARY_OP(BOOL_VAL, <=); REG_NEXT();
+        reg_greater:;       REG_BINARY_OP(BOOL_VAL, >); REG_NEXT();
+        reg_greater_equal:; REG_BINARY_OP(BOOL_VAL, >=); REG_NEXT();
+        reg_not:;           regs[ins->a] = BOOL_VAL(is_falsey(RK(ins->b))); REG_NEXT();
+        reg_negate:;{
+            Value value = RK(ins->b);
+            if (!IS_NUM(value)){
+                run_time_error("operand must be a number");
+                return INTERPRET_RUNTIME_ERR;
+            }
+            regs[ins->a] = NUM_VAL(AS_NUM(value) * -1);
+        } REG_NEXT();
+        reg_print:; {
+            print_value(RK(ins->a));
+            printf("\n");
+        } REG_NEXT();
+        reg_jump:;          frame->reg_ip = reg_code + ins->a; REG_NEXT();
+        reg_jump_if_false:; if (is_falsey(RK(ins->b))) frame->reg_ip = reg_code + ins->a; REG_NEXT();
+        reg_jump_if_not_equal:;{
+            if (!values_equal(RK(ins->b), RK(ins->c))) frame->reg_ip = reg_code + ins->a;
+        } REG_NEXT();
+        reg_jump_if_equal:;{
+            if (values_equal(RK(ins->b), RK(ins->c))) frame->reg_ip = reg_code + ins->a;
+        } REG_NEXT();
+        reg_jump_if_not_less:;          REG_COMPARE_JUMP(<); REG_NEXT();
+        reg_jump_if_not_less_equal:;    REG_COMPARE_JUMP(<=); REG_NEXT();
+        reg_jump_if_not_greater:;       REG_COMPARE_JUMP(>); REG_NEXT();
+        reg_jump_if_not_greater_equal:; REG_COMPARE_JUMP(>=); REG_NEXT();
+        reg_get_upvalue:;   regs[ins->a] = *CLOSURE_UPVALUE(frame->closure, ins->b)->location; REG_NEXT();
+        reg_set_upvalue:;   set_upvalue(CLOSURE_UPVALUE(frame->closure, ins->b), RK(ins->a)); REG_NEXT();
+        reg_closure:;{
+            ObjClosure* closure = new_closure(AS_FUNCTION(consts[ins->b]));
+            regs[ins->a] = OBJ_VAL(closure);
+            for (int32_t i = 0; i < closure->upvalue_count; i++){
+                RegInstruction* upvalue = frame->reg_ip++;
+                if (upvalue->op){
+                    closure->upvalues[i] = TO_REF(capture_upvalue(regs + upvalue->a));
+                    WRITE_BARRIER_OBJ(closure, CLOSURE_UPVALUE(closure, i));
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[upvalue->a];
+                }
+            }
+        } REG_NEXT();
+        reg_close_upvalue:; close_upvalues(regs + ins->a); REG_NEXT();
+        reg_call:;{
+            // the callee and its arguments have to be the top of the stack for call_value
+            vm->sp = regs + ins->a + ins->b + 1;
+            if (!call_value(regs[ins->a], ins->b)){
+                return INTERPRET_RUNTIME_ERR;
+            }
+            frame = &vm->frames[vm->frame_count - 1];
+        } RESUME();
+        reg_return:;{
+            Value result = RK(ins->a);
+            close_upvalues(frame->slots);
+            vm->frame_count--;
+            vm->sp = frame->slots;
+            push(result);
+            if (vm->frame_count == base) return INTERPRET_OK;
+            frame = &vm->frames[vm->frame_count - 1];
+        } RESUME();
     }
     #undef READ_BYTE
     #undef READ_CONSTANT
     #undef DISPATCH
     #undef NEXT
     #undef READ_3_BYTES
+    #undef READ_CACHE
+    #undef REG_NEXT
+    #undef RESUME
+    #undef RK
+    #undef GLOBAL_SLOT
 }
 
-InterpreterResult interpret(const char* source){
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERR;
-
-
+static InterpreterResult run_script(ObjFunction* function){
     push(OBJ_VAL(function));
     ObjClosure* closure = new_closure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
-    
-    return run();
+
+    InterpreterResult result = run(0);
+    if (result == INTERPRET_OK){
+        pop();
+        // tasks the script queued finish before it does
+        if (!drain_event_loop()) result = INTERPRET_RUNTIME_ERR;
+    }
+    return result;
+}
+
+InterpreterResult interpret(VM* machine, const char* source){
+    VM* previous = bind_VM(machine);
+    ObjFunction* function = compile(source);
+    InterpreterResult result = function != NULL ? run_script(function) : INTERPRET_COMPILE_ERR;
+    vm = previous;
+    return result;
+}
+
+// the REPL reads its lines through the event loop like input() does, so neither takes what
+// the other one buffered. Returns a line the caller frees, NULL at the end of the input
+char* read_input_line(VM* machine){
+    VM* previous = bind_VM(machine);
+    fflush(stdout);
+    Waiter request = io_request(IO_READ_LINE, 0, 0, NIL_VAL);
+    if (!io_attempt(&request) && io_wait(&request)){
+        while (!request.done && io_next() != NULL);
+        io_cancel(&request);
+    }
+    char* line = NULL;
+    if (IS_STRING(request.result)){
+        ObjString* string = AS_STRING(request.result);
+        line = (char*)malloc(string->length + 1);
+        if (line == NULL){
+            fprintf(stderr, "Couldn't allocate input line\n");
+            exit(1);
+        }
+        memcpy(line, string->chars, string->length);
+        line[string->length] = '\0';
+    }
+    vm = previous;
+    return line;
+}
+
+// skips the compiler when cache_path holds bytecode compiled from the same source,
+// otherwise compiles and refreshes the cache
+InterpreterResult interpret_cached(VM* machine, const char* source, const char* cache_path){
+    VM* previous = bind_VM(machine);
+    ObjFunction* function = load_cache(cache_path, source);
+    if (function == NULL){
+        function = compile(source);
+        if (function != NULL) write_cache(cache_path, source, function);
+    }
+    InterpreterResult result = function != NULL ? run_script(function) : INTERPRET_COMPILE_ERR;
+    vm = previous;
+    return result;
 }
\ No newline at end of file
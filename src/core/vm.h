@@ -5,9 +5,27 @@
 #include "../common/value.h"
 #include "../common/table.h"
 #include "../common/object.h"
+#include "slab.h"
+#include "loop.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_MAX)
+#ifdef __unix__
+#include <pthread.h>
+#endif //__unix__
+
+// the stacks of the script and of every fiber grow as calls need them, up to the limits in
+// VMOptions. push doesn't check for room, a call makes sure the deepest point of its function
+// fits together with STACK_RESERVE values for the helpers and natives it runs
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_MAX)
+#define FIBER_FRAMES_INITIAL 4
+#define FIBER_STACK_INITIAL 64
+#define STACK_RESERVE 16
+#define DEFAULT_MAX_FRAMES 100000
+#define DEFAULT_MAX_STACK ((size_t)1 << 24)
+// runs of native code and of the interpreter nested on the C stack, calls past NATIVE_JIT_MAX
+// are interpreted and calls past NATIVE_DEPTH_MAX fail, so deep recursion can't overflow it
+#define NATIVE_JIT_MAX 512
+#define NATIVE_DEPTH_MAX 1024
 
 typedef enum {
     INTERPRET_OK,
@@ -15,35 +33,127 @@ typedef enum {
     INTERPRET_RUNTIME_ERR,
 } InterpreterResult;
 
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure;
     uint8_t* ip;
+    RegInstruction* reg_ip;           // instruction pointer of functions lowered to register code
     Value* slots;
 } CallFrame;
 
+typedef enum {
+    GC_IDLE,                          // no full collection in progress
+    GC_MARKING,                       // old objects are being traced a few at a time
+    GC_SWEEPING,                      // unmarked old objects are being freed a few at a time
+} GCPhase;
+
+typedef enum {
+    PACE_GROWTH,                      // collect once the heap grew by a fixed factor since the last collection
+    PACE_HEAP,                        // collect once the heap reaches a target size
+    PACE_CPU,                         // adapt the growth factor to keep the time spent collecting near a target
+} GCPacing;
+
+// what the collector and allocator have done so far, for --gc-json and gc_stats()
+typedef struct {
+    size_t allocated[OBJ_TYPE_COUNT];       // objects allocated per type
+    size_t allocated_bytes[OBJ_TYPE_COUNT]; // their size, not counting the arrays they own
+    size_t freed[OBJ_TYPE_COUNT];           // objects freed per type
+    size_t freed_bytes[OBJ_TYPE_COUNT];     // their size, together with the arrays they owned
+    size_t peak_heap;                       // highest bytes_allocated seen
+    double minor_time;                      // seconds spent in minor collections
+    double mark_time;                       // seconds spent marking full collections
+    double sweep_time;                      // seconds the program spent sweeping
+} GCTelemetry;
+
+typedef struct {
+    bool peephole;                    // run the peephole pass over compiled chunks
+    bool peephole_stats;              // print before/after statistics of the peephole pass
+    bool quicken;                     // specialise arithmetic instructions on the operand types seen
+    bool ic_stats;                    // print the hits and misses of every inline cache on exit
+    bool cache;                       // load and store compiled scripts next to their source
+    bool registers;                   // lower compiled functions to register code where possible
+    bool register_stats;              // print the outcome of lowering every function
+    bool jit;                         // compile functions to native code once they are called often
+    bool jit_stats;                   // print the outcome of compiling every function
+    uint32_t jit_threshold;           // number of calls after which a function gets compiled
+    size_t max_frames;                // calls a stack may hold at once, more is a stack overflow
+    size_t max_stack;                 // values a stack may hold at once
+    size_t gc_budget;                 // objects traced or swept by each incremental GC step
+    size_t gc_threads;                // threads marking a full collection, 1 marks incrementally
+    bool gc_sweeper;                  // sweep on a background thread instead of in steps
+    bool gc_stress;                   // collect on every allocation, to shake out GC bugs
+    GCPacing gc_pacing;               // policy deciding when the next full collection starts
+    double gc_growth;                 // heap growth factor between full collections
+    size_t gc_heap_target;            // heap size at which PACE_HEAP collects
+    double gc_cpu_target;             // percentage of time PACE_CPU aims to spend collecting
+    size_t gc_nursery;                // bytes of new objects between minor collections
+    bool gc_stats;                    // print collection counts and the longest pause on exit
+    const char* gc_json;              // file the telemetry is written to as JSON on exit, - for stdout
+    const char* heap_snapshot;        // file a heap snapshot is written to on exit
+    bool alloc_stats;                 // print slab allocator usage per size class on exit
+} VMOptions;
+
 typedef struct {
-    Value stack[STACK_MAX];           // stack of Values
+    Value* stack;                     // stack of Values, the script's unless a fiber runs
     Value* sp;                        // stack pointer
-    CallFrame frames[FRAMES_MAX];     // stack of function calls that get executed
+    size_t stack_cap;                 // capacity of stack
+    CallFrame* frames;                // stack of function calls that get executed
     size_t frame_count;               // number of call frames currently on the stack
-    Table globals;                    // hashtable of global variables
+    size_t frame_cap;                 // capacity of frames
+    size_t native_depth;              // nested runs of native code and the interpreter
+    ObjFiber* fiber;                  // fiber running, NULL while the script runs on its own stack
+    CallStack script;                 // the script's stack while a fiber runs
+    EventLoop loop;                   // fibers waiting on I/O and tasks queued by async
+    ValueArray global_values;         // global variables indexed by the slot the compiler resolved
+    ValueArray global_names;          // name of every global slot, used in error messages
+    Table global_slots;               // hashtable of global names to their slot
     Table strings;                    // hashtable of strings (used for interning strings)
     ObjUpvalue* open_upvalues;        // linked list of all open upvalues
-    Obj* objects;                     // linked list of all heap allocated objects
+    Obj** young;                      // objects allocated since the last collection
+    size_t young_count;               // count of young objects
+    size_t young_cap;                 // capacity of young objects
+    size_t young_bytes;               // bytes allocated for young objects
+    bool collecting_young;            // a minor collection is marking, old objects count as live
+    size_t remembered_count;          // count of old objects that may point to young ones
+    size_t remembered_cap;            // capacity of the remembered set
+    Obj** remembered;                 // old objects written to since the last collection
+    GCPhase gc_phase;                 // state of the incremental full collection
+    size_t minor_count;               // number of minor collections run
+    size_t major_count;               // number of full collections finished
+    double max_pause;                 // longest time in seconds the GC held up the program
+    double gc_time;                   // seconds the GC held up the program in total
+    double gc_growth;                 // growth factor PACE_CPU currently uses
+    double cycle_start;               // when the last full collection finished
+    double cycle_gc_time;             // gc_time when the last full collection finished
+    GCTelemetry telemetry;            // counters behind --gc-json and gc_stats()
     size_t gray_count;                // count of gray colored object nodes
     size_t gray_cap;                  // capacity of gray colored object nodes
     Obj** gray_stack;                 // stack of gray colored object nodes used by GC
     size_t bytes_allocated;           // total of bytes that the VM has allocated
     size_t next_GC;                   // threshold to trigger next GC run    
+    SlabAllocator slab;               // size classes small blocks are allocated from
+#ifdef __unix__
+    pthread_mutex_t heap_lock;        // taken by the program and the background sweeper while it runs
+    pthread_t sweeper;                // background sweeper thread
+#endif //__unix__
+    bool sweeper_running;             // only changed by the program, and only while no sweeper runs
+    bool sweeper_done;                // set by the sweeper once it finished
+    VMOptions options;                // runtime options, set from the command line
     // ObjString* init_string; 
 } VM;
 
-extern VM vm;
+// the VM the calling thread runs, the entry points below bind theirs while they run.
+// Separate VMs share nothing, so each can run on a thread of its own
+extern __thread VM* vm;
 
-void init_VM();
-void free_VM();
+void init_VM_options(VMOptions* options);
+void init_VM(VM* machine, VMOptions options);
+void free_VM(VM* machine);
 
-InterpreterResult interpret(const char* source);
+InterpreterResult interpret(VM* machine, const char* source);
+InterpreterResult interpret_cached(VM* machine, const char* source, const char* cache_path);
+char* read_input_line(VM* machine);
+size_t global_slot(ObjString* name);
+bool call_function(uint8_t arg_count);
 void push(Value val);
 Value pop();
 
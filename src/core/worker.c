@@ -0,0 +1,735 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "worker.h"
+#include "cache.h"
+#include "memory.h"
+#include "vm.h"
+
+// A message starts with a u32 count and the names of all global slots of the sender, the count
+// is 0 unless it holds functions. Then follow a u32 count and the values of the globals, only
+// sent along by spawn, and the values themselves. Objects are numbered in the order they are
+// written, an object met again is written as MSG_SEEN and its number, which keeps sharing and
+// cycles intact. Functions use the encoding of the bytecode cache.
+
+typedef enum {
+    MSG_NIL,
+    MSG_TRUE,
+    MSG_FALSE,
+    MSG_NUM,
+    MSG_EMPTY,                        // global that was never defined
+    MSG_SEEN,
+    MSG_STRING,
+    MSG_ARRAY,
+    MSG_FUNCTION,
+    MSG_NATIVE,
+    MSG_CLOSURE,
+    MSG_UPVALUE,                      // read back closed, holding the value it had when written
+    MSG_CLASS,
+    MSG_INSTANCE,
+    MSG_BOUND_METHOD,
+} MessageTag;
+
+// the encoder keeps its own bookkeeping on malloc, so sending never triggers a collection
+typedef struct {
+    Writer* w;
+    Obj** keys;                       // open addressing set of the objects written, numbers alongside
+    uint32_t* ids;
+    size_t key_cap;
+    uint32_t count;
+    bool has_code;                    // functions were written, the reader needs the same global slots
+} Encoder;
+
+typedef struct {
+    Reader r;
+    ObjArray* seen;                   // objects read so far by number, kept on the VM stack
+} Decoder;
+
+typedef struct Worker {
+    uint32_t id;
+    VM* owner;                        // VM that spawned the worker, the only one that may join it
+    VMOptions options;
+    Writer task;                      // globals, callee and arguments, written by the owner
+    Writer result;                    // what the callee returned, written by the worker
+    bool done;
+    bool failed;
+    struct Worker* next;              // next worker not joined yet
+    struct Worker* next_queued;       // next worker waiting for a thread of the pool
+} Worker;
+
+typedef struct Envelope {
+    Writer message;
+    struct Envelope* next;
+} Envelope;
+
+typedef struct Channel {
+    uint32_t id;
+    VM* owner;                        // the channel closes when this VM is freed
+    bool closed;
+    size_t users;                     // threads waiting on it, the last one frees a closed channel
+    Envelope* head;
+    Envelope* tail;
+#ifdef __unix__
+    pthread_cond_t ready;             // signalled when a message arrives or the channel closes
+#endif //__unix__
+    struct Channel* next;
+} Channel;
+
+// workers and channels of all VMs, ids are shared so a channel is never mistaken for a worker
+static Worker* workers;
+static Channel* channels;
+static uint32_t next_id = 1;
+
+#ifdef __unix__
+// threads of the pool are started whenever every thread is busy and are kept once idle
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER; // guards everything in this file
+static pthread_cond_t work_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static Worker* queue_head;
+static Worker* queue_tail;
+static size_t queued;
+static size_t idle_threads;
+#endif //__unix__
+
+static void lock_workers(){
+#ifdef __unix__
+    pthread_mutex_lock(&worker_lock);
+#endif //__unix__
+}
+
+static void unlock_workers(){
+#ifdef __unix__
+    pthread_mutex_unlock(&worker_lock);
+#endif //__unix__
+}
+
+static void* checked(void* pointer){
+    if (pointer == NULL){
+        fprintf(stderr, "Couldn't allocate worker\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+static size_t hash_pointer(Obj* object){
+    return ((uintptr_t)object >> 4) * 2654435761u;
+}
+
+static void insert_key(Encoder* e, Obj* object, uint32_t id){
+    size_t index = hash_pointer(object) & (e->key_cap - 1);
+    while (e->keys[index] != NULL) index = (index + 1) & (e->key_cap - 1);
+    e->keys[index] = object;
+    e->ids[index] = id;
+}
+
+static void grow_keys(Encoder* e){
+    Obj** keys = e->keys;
+    uint32_t* ids = e->ids;
+    size_t key_cap = e->key_cap;
+    e->key_cap = key_cap < 64 ? 64 : key_cap * 2;
+    e->keys = (Obj**)checked(calloc(e->key_cap, sizeof(Obj*)));
+    e->ids = (uint32_t*)checked(malloc(sizeof(uint32_t) * e->key_cap));
+    for (size_t i = 0; i < key_cap; i++){
+        if (keys[i] != NULL) insert_key(e, keys[i], ids[i]);
+    }
+    free(keys);
+    free(ids);
+}
+
+// numbers the object the first time it is written, afterwards returns false and its number
+static bool first_write(Encoder* e, Obj* object, uint32_t* id){
+    if ((e->count + 1) * 2 > e->key_cap) grow_keys(e);
+    size_t index = hash_pointer(object) & (e->key_cap - 1);
+    while (e->keys[index] != NULL){
+        if (e->keys[index] == object){
+            *id = e->ids[index];
+            return false;
+        }
+        index = (index + 1) & (e->key_cap - 1);
+    }
+    e->keys[index] = object;
+    e->ids[index] = e->count++;
+    return true;
+}
+
+static bool encode_value(Encoder* e, Value value);
+
+// fields in the order they were added, so the reader builds the same shape
+static bool encode_fields(Encoder* e, ObjInstance* instance, ObjShape* shape){
+    if (shape->parent == NULL) return true;
+    return encode_fields(e, instance, shape->parent) &&
+           encode_value(e, OBJ_VAL(shape->key)) && encode_value(e, instance->fields[shape->slot]);
+}
+
+static bool encode_value(Encoder* e, Value value){
+    Writer* w = e->w;
+    if (IS_EMPTY(value)){
+        write_u8(w, MSG_EMPTY);
+        return true;
+    } else if (IS_NIL(value)){
+        write_u8(w, MSG_NIL);
+        return true;
+    } else if (IS_BOOL(value)){
+        write_u8(w, AS_BOOL(value) ? MSG_TRUE : MSG_FALSE);
+        return true;
+    } else if (IS_NUM(value)){
+        double number = AS_NUM(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(double));
+        write_u8(w, MSG_NUM);
+        write_u64(w, bits);
+        return true;
+    }
+
+    Obj* object = AS_OBJ(value);
+    uint32_t id;
+    if (!first_write(e, object, &id)){
+        write_u8(w, MSG_SEEN);
+        write_u32(w, id);
+        return true;
+    }
+    switch (object->type){
+        case OBJ_STRING:
+            write_u8(w, MSG_STRING);
+            write_string(w, (ObjString*)object);
+            return true;
+        case OBJ_ARRAY: {
+            ValueArray* elements = &((ObjArray*)object)->elements;
+            write_u8(w, MSG_ARRAY);
+            write_u32(w, elements->count);
+            for (size_t i = 0; i < elements->count; i++){
+                if (!encode_value(e, elements->values[i])) return false;
+            }
+            return true;
+        }
+        case OBJ_FUNCTION:
+            e->has_code = true;
+            write_u8(w, MSG_FUNCTION);
+            return write_function(w, (ObjFunction*)object);
+        case OBJ_NATIVE:
+            // natives are the same functions in every VM of the process
+            write_u8(w, MSG_NATIVE);
+            write_u64(w, (uintptr_t)((ObjNative*)object)->function);
+            write_u32(w, ((ObjNative*)object)->arity);
+            return true;
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            write_u8(w, MSG_CLOSURE);
+            if (!encode_value(e, OBJ_VAL(closure->function))) return false;
+            for (int32_t i = 0; i < closure->upvalue_count; i++){
+                if (!encode_value(e, OBJ_VAL(CLOSURE_UPVALUE(closure, i)))) return false;
+            }
+            return true;
+        }
+        case OBJ_UPVALUE:
+            write_u8(w, MSG_UPVALUE);
+            return encode_value(e, *((ObjUpvalue*)object)->location);
+        case OBJ_CLASS: {
+            ObjClass* class_obj = (ObjClass*)object;
+            write_u8(w, MSG_CLASS);
+            if (!encode_value(e, OBJ_VAL(class_obj->name))) return false;
+            write_u32(w, class_obj->field_hint);
+            if (!encode_value(e, class_obj->init != NULL ? OBJ_VAL(class_obj->init) : NIL_VAL)) return false;
+            uint32_t count = 0;
+            for (size_t i = 0; i < class_obj->methods.cap; i++){
+                if (class_obj->methods.entries[i].key != NULL_REF) count++;
+            }
+            write_u32(w, count);
+            for (size_t i = 0; i < class_obj->methods.cap; i++){
+                Entry* entry = &class_obj->methods.entries[i];
+                if (entry->key == NULL_REF) continue;
+                if (!encode_value(e, OBJ_VAL(FROM_REF(ObjString, entry->key))) || !encode_value(e, entry->value)){
+                    return false;
+                }
+            }
+            return true;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            write_u8(w, MSG_INSTANCE);
+            if (!encode_value(e, OBJ_VAL(INSTANCE_CLASS(instance)))) return false;
+            write_u32(w, INSTANCE_SHAPE(instance)->field_count);
+            return encode_fields(e, instance, INSTANCE_SHAPE(instance));
+        }
+        case OBJ_BOUND_METHOD:
+            write_u8(w, MSG_BOUND_METHOD);
+            return encode_value(e, ((ObjBoundMethod*)object)->receiver) &&
+                   encode_value(e, OBJ_VAL(((ObjBoundMethod*)object)->method));
+        default:
+            return false;
+    }
+}
+
+static bool write_message(Writer* message, Value* values, size_t count, bool globals){
+    Writer body = { NULL, 0, 0 };
+    Encoder e = { &body, NULL, NULL, 0, 0, globals };
+    bool written = true;
+    size_t global_count = globals ? vm->global_values.count : 0;
+    write_u32(&body, global_count);
+    for (size_t i = 0; i < global_count && written; i++) written = encode_value(&e, vm->global_values.values[i]);
+    for (size_t i = 0; i < count && written; i++) written = encode_value(&e, values[i]);
+
+    if (written){
+        size_t name_count = e.has_code ? vm->global_names.count : 0;
+        write_u32(message, name_count);
+        for (size_t i = 0; i < name_count; i++) write_string(message, AS_STRING(vm->global_names.values[i]));
+        write_bytes(message, body.data, body.count);
+    }
+    free(body.data);
+    free(e.keys);
+    free(e.ids);
+    return written;
+}
+
+// objects take their number before they are allocated, so everything read sits in seen
+static uint32_t reserve(Decoder* d){
+    write_value_array(&d->seen->elements, NIL_VAL);
+    return d->seen->elements.count - 1;
+}
+
+static void fill(Decoder* d, uint32_t id, Obj* object){
+    d->seen->elements.values[id] = OBJ_VAL(object);
+    WRITE_BARRIER_OBJ(d->seen, object);
+}
+
+static Value failed(Decoder* d){
+    d->r.failed = true;
+    return NIL_VAL;
+}
+
+// a reference to an object that is still being read comes back as nil
+static Value decode_value(Decoder* d){
+    Reader* r = &d->r;
+    switch (read_u8(r)){
+        case MSG_NIL:   return NIL_VAL;
+        case MSG_TRUE:  return TRUE_VAL;
+        case MSG_FALSE: return FALSE_VAL;
+        case MSG_EMPTY: return EMPTY_VAL;
+        case MSG_NUM: {
+            uint64_t bits = read_u64(r);
+            double number;
+            memcpy(&number, &bits, sizeof(double));
+            return NUM_VAL(number);
+        }
+        case MSG_SEEN: {
+            uint32_t id = read_u32(r);
+            if (id >= d->seen->elements.count) return failed(d);
+            return d->seen->elements.values[id];
+        }
+        case MSG_STRING: {
+            uint32_t id = reserve(d);
+            ObjString* string = read_string(r);
+            if (string == NULL) return failed(d);
+            fill(d, id, (Obj*)string);
+            return OBJ_VAL(string);
+        }
+        case MSG_ARRAY: {
+            uint32_t id = reserve(d);
+            ObjArray* array = take_array();
+            fill(d, id, (Obj*)array);
+            uint32_t count = read_u32(r);
+            for (uint32_t i = 0; i < count && !r->failed; i++){
+                Value element = decode_value(d);
+                write_value_array(&array->elements, element);
+                WRITE_BARRIER(array, element);
+            }
+            return OBJ_VAL(array);
+        }
+        case MSG_FUNCTION: {
+            uint32_t id = reserve(d);
+            ObjFunction* function = read_function(r);
+            if (function == NULL) return failed(d);
+            fill(d, id, (Obj*)function);
+            return OBJ_VAL(function);
+        }
+        case MSG_NATIVE: {
+            uint32_t id = reserve(d);
+            NativeFn function = (NativeFn)(uintptr_t)read_u64(r);
+            uint32_t arity = read_u32(r);
+            if (r->failed) return NIL_VAL;
+            ObjNative* native = new_native(function, arity);
+            fill(d, id, (Obj*)native);
+            return OBJ_VAL(native);
+        }
+        case MSG_CLOSURE: {
+            uint32_t id = reserve(d);
+            Value function = decode_value(d);
+            if (!IS_FUNCTION(function)) return failed(d);
+            ObjClosure* closure = new_closure(AS_FUNCTION(function));
+            fill(d, id, (Obj*)closure);
+            for (int32_t i = 0; i < closure->upvalue_count; i++){
+                Value upvalue = decode_value(d);
+                if (!is_obj_type(upvalue, OBJ_UPVALUE)) return failed(d);
+                closure->upvalues[i] = TO_REF((ObjUpvalue*)AS_OBJ(upvalue));
+                WRITE_BARRIER(closure, upvalue);
+            }
+            return OBJ_VAL(closure);
+        }
+        case MSG_UPVALUE: {
+            uint32_t id = reserve(d);
+            ObjUpvalue* upvalue = new_upvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            fill(d, id, (Obj*)upvalue);
+            upvalue->closed = decode_value(d);
+            WRITE_BARRIER(upvalue, upvalue->closed);
+            return OBJ_VAL(upvalue);
+        }
+        case MSG_CLASS: {
+            uint32_t id = reserve(d);
+            Value name = decode_value(d);
+            if (!IS_STRING(name)) return failed(d);
+            ObjClass* class_obj = new_class(AS_STRING(name));
+            fill(d, id, (Obj*)class_obj);
+            class_obj->field_hint = read_u32(r);
+            Value init = decode_value(d);
+            if (IS_CLOSURE(init)){
+                class_obj->init = AS_CLOSURE(init);
+                WRITE_BARRIER(class_obj, init);
+            }
+            uint32_t count = read_u32(r);
+            for (uint32_t i = 0; i < count && !r->failed; i++){
+                Value key = decode_value(d);
+                Value method = decode_value(d);
+                if (!IS_STRING(key)) return failed(d);
+                table_set(&class_obj->methods, AS_STRING(key), method);
+                WRITE_BARRIER(class_obj, key);
+                WRITE_BARRIER(class_obj, method);
+            }
+            return OBJ_VAL(class_obj);
+        }
+        case MSG_INSTANCE: {
+            uint32_t id = reserve(d);
+            Value class_obj = decode_value(d);
+            if (!IS_CLASS(class_obj)) return failed(d);
+            ObjInstance* instance = new_instance(AS_CLASS(class_obj));
+            fill(d, id, (Obj*)instance);
+            uint32_t count = read_u32(r);
+            for (uint32_t i = 0; i < count && !r->failed; i++){
+                Value key = decode_value(d);
+                Value field = decode_value(d);
+                if (!IS_STRING(key)) return failed(d);
+                instance_set_field(instance, AS_STRING(key), field);
+            }
+            return OBJ_VAL(instance);
+        }
+        case MSG_BOUND_METHOD: {
+            uint32_t id = reserve(d);
+            Value receiver = decode_value(d);
+            Value method = decode_value(d);
+            if (!IS_CLOSURE(method)) return failed(d);
+            ObjBoundMethod* bound = new_bound_method(receiver, AS_CLOSURE(method));
+            fill(d, id, (Obj*)bound);
+            return OBJ_VAL(bound);
+        }
+        default:
+            return failed(d);
+    }
+}
+
+// pushes the values of the message onto the stack of the bound VM, false if the
+// functions it holds were compiled against global slots this VM doesn't have
+static bool read_message(Writer* message, size_t count){
+    Decoder d = { { message->data, message->count, 0, false }, take_array() };
+    Reader* r = &d.r;
+    push(OBJ_VAL(d.seen));
+    Value* base = vm->sp - 1;
+
+    uint32_t name_count = read_u32(r);
+    for (uint32_t i = 0; i < name_count && !r->failed; i++){
+        ObjString* name = read_string(r);
+        if (name == NULL) break;
+        push(OBJ_VAL(name));
+        if (global_slot(name) != i) r->failed = true;
+        pop();
+    }
+    uint32_t global_count = read_u32(r);
+    if (global_count > vm->global_values.count) r->failed = true;
+    for (uint32_t i = 0; i < global_count && !r->failed; i++){
+        vm->global_values.values[i] = decode_value(&d);
+    }
+    for (size_t i = 0; i < count && !r->failed; i++) push(decode_value(&d));
+
+    if (r->failed || r->pos != r->size){
+        vm->sp = base;
+        return false;
+    }
+    memmove(base, base + 1, sizeof(Value) * count);
+    vm->sp--;
+    return true;
+}
+
+// the worker runs on a VM of its own, freed again once the result is written
+static void run_worker(Worker* worker){
+    VM* machine = (VM*)checked(malloc(sizeof(VM)));
+    init_VM(machine, worker->options);
+    VM* previous = vm;
+    vm = machine;
+    bool finished = false;
+    if (read_message(&worker->task, 2)){
+        ObjArray* args = AS_ARRAY(pop());
+        for (size_t i = 0; i < args->elements.count; i++) push(args->elements.values[i]);
+        finished = call_function(args->elements.count) && write_message(&worker->result, vm->sp - 1, 1, false);
+    } else {
+        fprintf(stderr, "Worker %u couldn't read its task\n", worker->id);
+    }
+    vm = previous;
+    free_VM(machine);
+    free(machine);
+    free(worker->task.data);
+    worker->task = (Writer){ NULL, 0, 0 };
+    worker->failed = !finished;
+}
+
+#ifdef __unix__
+static void* run_pool_thread(void* arg){
+    UNUSED(arg);
+    pthread_mutex_lock(&worker_lock);
+    for (;;){
+        idle_threads++;
+        while (queue_head == NULL) pthread_cond_wait(&work_queued, &worker_lock);
+        idle_threads--;
+        Worker* worker = queue_head;
+        queue_head = worker->next_queued;
+        if (queue_head == NULL) queue_tail = NULL;
+        queued--;
+        pthread_mutex_unlock(&worker_lock);
+
+        run_worker(worker);
+
+        pthread_mutex_lock(&worker_lock);
+        worker->done = true;
+        pthread_cond_broadcast(&work_done);
+    }
+    return NULL;
+}
+
+static bool start_pool_thread(){
+    pthread_attr_t attributes;
+    pthread_t thread;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    bool started = pthread_create(&thread, &attributes, run_pool_thread, NULL) == 0;
+    pthread_attr_destroy(&attributes);
+    return started;
+}
+#endif //__unix__
+
+static Worker* find_worker(uint32_t id){
+    Worker* worker = workers;
+    while (worker != NULL && worker->id != id) worker = worker->next;
+    return worker;
+}
+
+static void unlink_worker(Worker* worker){
+    Worker** link = &workers;
+    while (*link != worker) link = &(*link)->next;
+    *link = worker->next;
+}
+
+WorkerResult spawn_worker(Value callee, Value args, uint32_t* id){
+    Worker* worker = (Worker*)checked(calloc(1, sizeof(Worker)));
+    Value values[2] = { callee, args };
+    if (!write_message(&worker->task, values, 2, true)){
+        free(worker->task.data);
+        free(worker);
+        return WORKER_UNCOPYABLE;
+    }
+    worker->owner = vm;
+    worker->options = vm->options;
+    worker->options.peephole_stats = false;
+    worker->options.ic_stats = false;
+    worker->options.register_stats = false;
+    worker->options.jit_stats = false;
+    worker->options.gc_stats = false;
+    worker->options.gc_json = NULL;
+    worker->options.heap_snapshot = NULL;
+    worker->options.alloc_stats = false;
+
+    lock_workers();
+#ifdef __unix__
+    // a worker may wait on another one, so a queued worker never waits for a thread to free up
+    if (queued + 1 > idle_threads && !start_pool_thread()){
+        pthread_mutex_unlock(&worker_lock);
+        free(worker->task.data);
+        free(worker);
+        return WORKER_FAILED;
+    }
+#endif //__unix__
+    worker->id = *id = next_id++;
+    worker->next = workers;
+    workers = worker;
+#ifdef __unix__
+    if (queue_tail != NULL){
+        queue_tail->next_queued = worker;
+    } else {
+        queue_head = worker;
+    }
+    queue_tail = worker;
+    queued++;
+    pthread_cond_signal(&work_queued);
+    pthread_mutex_unlock(&worker_lock);
+#else //__unix__
+    // without threads the worker runs to completion right away
+    unlock_workers();
+    run_worker(worker);
+    worker->done = true;
+#endif //__unix__
+    return WORKER_OK;
+}
+
+static void wait_for(Worker* worker){
+#ifdef __unix__
+    while (!worker->done) pthread_cond_wait(&work_done, &worker_lock);
+#else //__unix__
+    UNUSED(worker);
+#endif //__unix__
+}
+
+WorkerResult join_worker(uint32_t id, Value* result){
+    lock_workers();
+    Worker* worker = find_worker(id);
+    if (worker == NULL || worker->owner != vm){
+        unlock_workers();
+        return WORKER_UNKNOWN;
+    }
+    wait_for(worker);
+    unlink_worker(worker);
+    unlock_workers();
+
+    WorkerResult status = WORKER_FAILED;
+    if (!worker->failed) status = read_message(&worker->result, 1) ? WORKER_OK : WORKER_FOREIGN;
+    if (status == WORKER_OK) *result = pop();
+    free(worker->result.data);
+    free(worker);
+    return status;
+}
+
+static Channel* find_channel(uint32_t id){
+    Channel* channel = channels;
+    while (channel != NULL && channel->id != id) channel = channel->next;
+    return channel;
+}
+
+static void drop_messages(Channel* channel){
+    while (channel->head != NULL){
+        Envelope* envelope = channel->head;
+        channel->head = envelope->next;
+        free(envelope->message.data);
+        free(envelope);
+    }
+    channel->tail = NULL;
+}
+
+static void free_channel(Channel* channel){
+    drop_messages(channel);
+#ifdef __unix__
+    pthread_cond_destroy(&channel->ready);
+#endif //__unix__
+    free(channel);
+}
+
+uint32_t new_channel(){
+    Channel* channel = (Channel*)checked(calloc(1, sizeof(Channel)));
+    channel->owner = vm;
+#ifdef __unix__
+    pthread_cond_init(&channel->ready, NULL);
+#endif //__unix__
+    lock_workers();
+    channel->id = next_id++;
+    channel->next = channels;
+    channels = channel;
+    unlock_workers();
+    return channel->id;
+}
+
+// the value is copied before the channel is looked up, sending never waits for a receiver
+WorkerResult channel_send(uint32_t id, Value value){
+    Envelope* envelope = (Envelope*)checked(calloc(1, sizeof(Envelope)));
+    if (!write_message(&envelope->message, &value, 1, false)){
+        free(envelope->message.data);
+        free(envelope);
+        return WORKER_UNCOPYABLE;
+    }
+    lock_workers();
+    Channel* channel = find_channel(id);
+    if (channel == NULL){
+        unlock_workers();
+        free(envelope->message.data);
+        free(envelope);
+        return WORKER_UNKNOWN;
+    }
+    if (channel->tail != NULL){
+        channel->tail->next = envelope;
+    } else {
+        channel->head = envelope;
+    }
+    channel->tail = envelope;
+#ifdef __unix__
+    pthread_cond_signal(&channel->ready);
+#endif //__unix__
+    unlock_workers();
+    return WORKER_OK;
+}
+
+WorkerResult channel_receive(uint32_t id, Value* value){
+    lock_workers();
+    Channel* channel = find_channel(id);
+    if (channel == NULL){
+        unlock_workers();
+        return WORKER_UNKNOWN;
+    }
+    channel->users++;
+#ifdef __unix__
+    while (channel->head == NULL && !channel->closed) pthread_cond_wait(&channel->ready, &worker_lock);
+#endif //__unix__
+    channel->users--;
+    Envelope* envelope = channel->head;
+    if (envelope != NULL){
+        channel->head = envelope->next;
+        if (channel->head == NULL) channel->tail = NULL;
+    }
+    if (channel->closed && channel->users == 0) free_channel(channel);
+    unlock_workers();
+    if (envelope == NULL) return WORKER_CLOSED;
+
+    WorkerResult status = read_message(&envelope->message, 1) ? WORKER_OK : WORKER_FOREIGN;
+    if (status == WORKER_OK) *value = pop();
+    free(envelope->message.data);
+    free(envelope);
+    return status;
+}
+
+void stop_workers(){
+    lock_workers();
+    for (Channel** link = &channels; *link != NULL;){
+        Channel* channel = *link;
+        if (channel->owner != vm){
+            link = &channel->next;
+            continue;
+        }
+        *link = channel->next;
+        channel->closed = true;
+        if (channel->users == 0){
+            free_channel(channel);
+        } else {
+            // waiting receivers find the channel empty and free it on their way out
+            drop_messages(channel);
+#ifdef __unix__
+            pthread_cond_broadcast(&channel->ready);
+#endif //__unix__
+        }
+    }
+
+    for (Worker* worker = workers; worker != NULL;){
+        if (worker->owner != vm){
+            worker = worker->next;
+            continue;
+        }
+        wait_for(worker);
+        unlink_worker(worker);
+        free(worker->result.data);
+        free(worker);
+        worker = workers;
+    }
+    unlock_workers();
+}
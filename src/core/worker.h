@@ -0,0 +1,32 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include "../common/value.h"
+
+// Workers run a function on a VM of their own, taken from a pool of threads. Values never
+// cross VMs by reference, they are serialised by the sender and rebuilt on the receiving VM's
+// heap. Functions address globals by slot, so a worker starts from a copy of the globals of
+// the VM that spawned it, and a value holding functions only reads back where every global
+// of the sender has the same slot.
+
+typedef enum {
+    WORKER_OK,
+    WORKER_UNKNOWN,                   // no worker or channel by that id, or not one this VM may use
+    WORKER_FAILED,                    // the worker stopped with an error
+    WORKER_CLOSED,                    // the VM owning the channel was freed
+    WORKER_FOREIGN,                   // the value holds functions compiled against other global slots
+    WORKER_UNCOPYABLE,                // the value holds an object that can't leave its VM, like a fiber
+} WorkerResult;
+
+// workers and channels are owned by the bound VM, which is the only one that may join them.
+// Channels can be used by any VM that was handed their id
+WorkerResult spawn_worker(Value callee, Value args, uint32_t* id);
+WorkerResult join_worker(uint32_t id, Value* result);
+uint32_t new_channel();
+WorkerResult channel_send(uint32_t id, Value value);
+WorkerResult channel_receive(uint32_t id, Value* value);
+
+// closes the channels of the bound VM and waits for the workers it never joined
+void stop_workers();
+
+#endif //_WORKER_H
@@ -1,22 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "common/common.h"
 #include "common/debug.h"
 #include "core/chunk.h"
 #include "core/vm.h"
+#include "core/jit.h"
+#include "core/memory.h"
+
+static VM machine;
+static VMOptions vm_options;
 
 void run_REPL(){
-    char line[1024];
     printf("Welcome to the REPL of Yabil\n");
     for(;;){
         printf("> ");
-        if (!fgets(line, sizeof(line), stdin)){
+        char* line = read_input_line(&machine);
+        if (line == NULL){
             printf("\n");
             break;
         }
         // printf("<%s>\n", line);
-        interpret(line);
+        interpret(&machine, line);
+        free(line);
     }
 }
 
@@ -49,7 +56,22 @@ static char* read_file(const char* file_path){
 
 void run_file(const char* file_path){
     char* source = read_file(file_path);
-    InterpreterResult result = interpret(source);
+    InterpreterResult result;
+    if (vm_options.cache){
+        // foo.yabl is cached in foo.yablc
+        size_t length = strlen(file_path);
+        char* cache_path = malloc(length + 2);
+        if (cache_path == NULL){
+            fprintf(stderr, "Could not allocate buffer [%s]\n", file_path);
+            exit(74);
+        }
+        memcpy(cache_path, file_path, length);
+        memcpy(cache_path + length, "c", 2);
+        result = interpret_cached(&machine, source, cache_path);
+        free(cache_path);
+    } else {
+        result = interpret(&machine, source);
+    }
     free(source);
     if (result == INTERPRET_COMPILE_ERR) {
         fprintf(stderr, "Compilation error\n");
@@ -61,17 +83,176 @@ void run_file(const char* file_path){
     }
 }
 
+static void usage(){
+    fprintf(stderr, "Usage: yabil [options] [path]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --no-cache          don't load or write the compiled bytecode cache next to the script\n");
+    fprintf(stderr, "  --no-peephole       don't run the peephole optimizer over compiled bytecode\n");
+    fprintf(stderr, "  --peephole-stats    print bytecode statistics before and after the peephole pass\n");
+    fprintf(stderr, "  --no-quicken        don't specialise instructions on the operand types seen at runtime\n");
+    fprintf(stderr, "  --ic-stats          print the hits and misses of every inline cache on exit\n");
+    fprintf(stderr, "  --registers         run functions on the register VM where they can be lowered\n");
+    fprintf(stderr, "  --register-stats    print how every function was lowered to register code\n");
+    fprintf(stderr, "  --jit               compile functions to native code once they are called often\n");
+    fprintf(stderr, "  --jit-threshold=N   calls after which a function gets compiled (default %d)\n", JIT_DEFAULT_THRESHOLD);
+    fprintf(stderr, "  --jit-stats         print how every function was compiled to native code\n");
+    fprintf(stderr, "  --max-frames=N      calls active at once before a stack overflow (default %d)\n", DEFAULT_MAX_FRAMES);
+    fprintf(stderr, "  --max-stack=N       values a stack may hold, K and M suffixes work (default 16M)\n");
+    fprintf(stderr, "  --gc-budget=N       objects the collector traces or sweeps per allocation (default %d)\n", GC_DEFAULT_BUDGET);
+    fprintf(stderr, "  --gc-threads=N      threads marking a full collection at once instead of incrementally (max %d)\n", GC_MAX_THREADS);
+    fprintf(stderr, "  --gc-sweeper        free dead objects on a background thread\n");
+    fprintf(stderr, "  --gc-pacing=P       when full collections start: growth, heap or cpu (default growth)\n");
+    fprintf(stderr, "  --gc-growth=F       heap growth factor between full collections (default %d)\n", GC_HEAP_GROW_FACTOR);
+    fprintf(stderr, "  --gc-heap-target=S  collect once the heap reaches S bytes, K, M and G suffixes work (default 64M)\n");
+    fprintf(stderr, "  --gc-cpu-target=P   adapt the growth factor to spend about P%% of the time collecting (default %d)\n", GC_DEFAULT_CPU_TARGET);
+    fprintf(stderr, "  --gc-nursery=S      bytes of new objects between minor collections (default 256K)\n");
+    fprintf(stderr, "  --gc-stress         collect on every allocation\n");
+    fprintf(stderr, "  --gc-stats          print collection counts and the longest GC pause on exit\n");
+    fprintf(stderr, "  --gc-json=FILE      write GC and allocation telemetry as JSON to FILE on exit, - for stdout\n");
+    fprintf(stderr, "  --alloc-stats       print allocator usage per size class on exit\n");
+    fprintf(stderr, "  --heap-snapshot=F   write a heap snapshot to F on exit, for make heapstat to analyse\n");
+    fprintf(stderr, "Every --gc-name=value option can also be set as YABIL_GC_NAME=value in the environment,\n");
+    fprintf(stderr, "flags like --gc-stress as YABIL_GC_STRESS=1. The command line takes precedence.\n");
+    exit(64);
+}
+
+// reads sizes like 4096, 512K, 64M or 1G
+static bool parse_size(const char* text, size_t* size){
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return false;
+    switch (*end){
+        case 'K': case 'k': value <<= 10; end++; break;
+        case 'M': case 'm': value <<= 20; end++; break;
+        case 'G': case 'g': value <<= 30; end++; break;
+    }
+    if (*end != '\0' || value == 0) return false;
+    *size = value;
+    return true;
+}
+
+static bool parse_number(const char* text, double* number){
+    char* end;
+    *number = strtod(text, &end);
+    return end != text && *end == '\0';
+}
+
+// handles every --gc-* option, returns false for unknown ones or bad values
+static bool gc_option(const char* option){
+    double number;
+    if (strncmp(option, "--gc-budget=", 12) == 0){
+        int budget = atoi(option + 12);
+        if (budget < 1) return false;
+        vm_options.gc_budget = budget;
+    }
+    else if (strncmp(option, "--gc-threads=", 13) == 0){
+        int threads = atoi(option + 13);
+        if (threads < 1 || threads > GC_MAX_THREADS) return false;
+        vm_options.gc_threads = threads;
+    }
+    else if (strcmp(option, "--gc-pacing=growth") == 0) vm_options.gc_pacing = PACE_GROWTH;
+    else if (strcmp(option, "--gc-pacing=heap") == 0) vm_options.gc_pacing = PACE_HEAP;
+    else if (strcmp(option, "--gc-pacing=cpu") == 0) vm_options.gc_pacing = PACE_CPU;
+    else if (strncmp(option, "--gc-growth=", 12) == 0){
+        if (!parse_number(option + 12, &number) || number <= 1) return false;
+        vm_options.gc_growth = number;
+        vm_options.gc_pacing = PACE_GROWTH;
+    }
+    else if (strncmp(option, "--gc-heap-target=", 17) == 0){
+        if (!parse_size(option + 17, &vm_options.gc_heap_target)) return false;
+        vm_options.gc_pacing = PACE_HEAP;
+    }
+    else if (strncmp(option, "--gc-cpu-target=", 16) == 0){
+        if (!parse_number(option + 16, &number) || number <= 0 || number >= 100) return false;
+        vm_options.gc_cpu_target = number;
+        vm_options.gc_pacing = PACE_CPU;
+    }
+    else if (strncmp(option, "--gc-nursery=", 13) == 0) return parse_size(option + 13, &vm_options.gc_nursery);
+    else if (strcmp(option, "--gc-sweeper") == 0) vm_options.gc_sweeper = true;
+    else if (strcmp(option, "--gc-stress") == 0) vm_options.gc_stress = true;
+    else if (strcmp(option, "--gc-stats") == 0) vm_options.gc_stats = true;
+    else if (strncmp(option, "--gc-json=", 10) == 0){
+        if (option[10] == '\0') return false;
+        vm_options.gc_json = option + 10;
+    }
+    else return false;
+    return true;
+}
+
+// YABIL_GC_HEAP_TARGET=64M is read as --gc-heap-target=64M, flags are set by any value but 0
+static void read_gc_environment(){
+    static const struct { const char* name; bool flag; } options[] = {
+        {"budget", false}, {"threads", false}, {"pacing", false}, {"growth", false},
+        {"heap-target", false}, {"cpu-target", false}, {"nursery", false}, {"json", false},
+        {"sweeper", true}, {"stress", true}, {"stats", true},
+    };
+    // options like --gc-json keep pointing into their text
+    static char texts[sizeof(options) / sizeof(options[0])][1024];
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++){
+        char variable[64] = "YABIL_GC_";
+        size_t length = strlen(variable);
+        for (const char* c = options[i].name; *c != '\0'; c++){
+            variable[length++] = *c == '-' ? '_' : toupper((unsigned char)*c);
+        }
+        variable[length] = '\0';
+
+        const char* value = getenv(variable);
+        if (value == NULL) continue;
+        char* option = texts[i];
+        if (options[i].flag){
+            if (strcmp(value, "0") == 0) continue;
+            snprintf(option, sizeof(texts[i]), "--gc-%s", options[i].name);
+        } else {
+            snprintf(option, sizeof(texts[i]), "--gc-%s=%s", options[i].name, value);
+        }
+        if (!gc_option(option)){
+            fprintf(stderr, "Invalid value for %s: %s\n", variable, value);
+            exit(64);
+        }
+    }
+}
+
 int main(int argc, const char** argv){
     
-    init_VM();
+    init_VM_options(&vm_options);
+    read_gc_environment();
 
-    if (argc == 1) run_REPL();
-    else if (argc == 2) run_file(argv[1]);
-    else {
-        fprintf(stderr, "Usage: yabil [path]\n");
-        exit(64);
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--no-cache") == 0) vm_options.cache = false;
+        else if (strcmp(argv[i], "--no-peephole") == 0) vm_options.peephole = false;
+        else if (strcmp(argv[i], "--peephole-stats") == 0) vm_options.peephole_stats = true;
+        else if (strcmp(argv[i], "--no-quicken") == 0) vm_options.quicken = false;
+        else if (strcmp(argv[i], "--ic-stats") == 0) vm_options.ic_stats = true;
+        else if (strcmp(argv[i], "--registers") == 0) vm_options.registers = true;
+        else if (strcmp(argv[i], "--register-stats") == 0) vm_options.register_stats = vm_options.registers = true;
+        else if (strcmp(argv[i], "--jit") == 0) vm_options.jit = true;
+        else if (strcmp(argv[i], "--jit-stats") == 0) vm_options.jit_stats = vm_options.jit = true;
+        else if (strncmp(argv[i], "--jit-threshold=", 16) == 0){
+            int threshold = atoi(argv[i] + 16);
+            if (threshold < 1) usage();
+            vm_options.jit_threshold = threshold;
+            vm_options.jit = true;
+        }
+        else if (strncmp(argv[i], "--max-frames=", 13) == 0){
+            if (!parse_size(argv[i] + 13, &vm_options.max_frames)) usage();
+        }
+        else if (strncmp(argv[i], "--max-stack=", 12) == 0){
+            if (!parse_size(argv[i] + 12, &vm_options.max_stack)) usage();
+        }
+        else if (strncmp(argv[i], "--gc-", 5) == 0){
+            if (!gc_option(argv[i])) usage();
+        }
+        else if (strcmp(argv[i], "--alloc-stats") == 0) vm_options.alloc_stats = true;
+        else if (strncmp(argv[i], "--heap-snapshot=", 16) == 0 && argv[i][16] != '\0') vm_options.heap_snapshot = argv[i] + 16;
+        else if (argv[i][0] == '-' || path != NULL) usage();
+        else path = argv[i];
     }
+    init_VM(&machine, vm_options);
+
+    if (path == NULL) run_REPL();
+    else run_file(path);
     
-    free_VM();
+    free_VM(&machine);
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,183 @@
+// popen is hidden by -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Regression tests, run from the root of the repository once yabil is built. The scripts
+// check themselves and print "name = Passed" or "name = Failed", the tester adds lines of
+// its own for what only shows from the outside, like the size of a cache
+
+#ifdef _WIN32
+#define YABIL "yabil.exe"
+#define popen _popen
+#define pclose _pclose
+#else
+#define YABIL "./yabil"
+#endif
+
+static int failures = 0;
+
+static void check(const char* name, bool passed){
+    printf("%s = %s\n", name, passed ? "Passed" : "Failed");
+    if (!passed) failures++;
+}
+
+// returns what the command printed to stdout, the caller frees it
+static char* output_of(const char* command, int* status){
+    size_t length = 0;
+    size_t cap = 4096;
+    char* output = malloc(cap);
+    FILE* pipe = popen(command, "r");
+    if (output == NULL || pipe == NULL){
+        fprintf(stderr, "Could not run [%s]\n", command);
+        exit(1);
+    }
+    size_t count;
+    while ((count = fread(output + length, 1, cap - length - 1, pipe)) > 0){
+        length += count;
+        if (length + 1 == cap){
+            cap *= 2;
+            output = realloc(output, cap);
+            if (output == NULL){
+                fprintf(stderr, "Could not allocate output of [%s]\n", command);
+                exit(1);
+            }
+        }
+    }
+    *status = pclose(pipe);
+    output[length] = '\0';
+    return output;
+}
+
+// runs a script that checks itself, it fails if it printed a failed check or didn't exit cleanly
+static void run_script(const char* command){
+    int status;
+    char* output = output_of(command, &status);
+    fputs(output, stdout);
+    if (strstr(output, "Failed") != NULL) failures++;
+    if (status != 0) check(command, false);
+    free(output);
+}
+
+// runs a script that has to stop with a runtime error carrying the message
+static void expect_error(const char* name, const char* command, const char* message){
+    int status;
+    char* output = output_of(command, &status);
+    check(name, status != 0 && strstr(output, message) != NULL);
+    free(output);
+}
+
+// runs a script with extra options and checks it prints what the interpreter prints
+static void same_output(const char* name, const char* options, const char* script){
+    char interpreted[256];
+    char command[256];
+    snprintf(interpreted, sizeof(interpreted), YABIL " --no-cache %s 2>&1", script);
+    snprintf(command, sizeof(command), YABIL " --no-cache %s %s 2>&1", options, script);
+    int expected_status, status;
+    char* expected = output_of(interpreted, &expected_status);
+    char* output = output_of(command, &status);
+    check(name, status == expected_status && strcmp(output, expected) == 0);
+    free(expected);
+    free(output);
+}
+
+static long file_size(const char* path){
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return -1;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// folded operands, intermediate results and dead code leave nothing in the constant pool
+static void test_fold_pool(){
+    remove("src/test/fold_pool.yablc");
+    remove("src/test/fold_pool_literals.yablc");
+    run_script(YABIL " src/test/fold_pool.yabl");
+    run_script(YABIL " src/test/fold_pool_literals.yabl");
+    long folded = file_size("src/test/fold_pool.yablc");
+    check("folding keeps only the results in the cache", folded > 0 && folded == file_size("src/test/fold_pool_literals.yablc"));
+    remove("src/test/fold_pool.yablc");
+    remove("src/test/fold_pool_literals.yablc");
+}
+
+static void write_file(const char* path, const char* text){
+    FILE* file = fopen(path, "wb");
+    if (file == NULL){
+        fprintf(stderr, "Could not write file [%s]\n", path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+}
+
+// the first run compiles and writes the cache, the next one loads it and compiles nothing,
+// which --peephole-stats shows on stderr. Editing the source makes the cache stale
+static void test_cache(){
+    int status;
+    remove("src/test/cache.yablc");
+    char* written = output_of(YABIL " --peephole-stats src/test/cache.yabl 2>&1", &status);
+    check("cache written on the first run", status == 0 && strstr(written, "=== peephole") != NULL &&
+                                            file_size("src/test/cache.yablc") > 0);
+    char* loaded = output_of(YABIL " --peephole-stats src/test/cache.yabl 2>&1", &status);
+    fputs(loaded, stdout);
+    check("cache loaded on the second run", status == 0 && strstr(loaded, "=== peephole") == NULL &&
+                                            strstr(loaded, "Failed") == NULL && strstr(written, "Failed") == NULL);
+    free(written);
+    free(loaded);
+    remove("src/test/cache.yablc");
+
+    // same length and likely the same modification time, only the contents tell them apart
+    write_file("src/test/cache_edit.yabl", "print \"version 1\";\n");
+    char* before = output_of(YABIL " src/test/cache_edit.yabl", &status);
+    write_file("src/test/cache_edit.yabl", "print \"version 2\";\n");
+    char* after = output_of(YABIL " src/test/cache_edit.yabl", &status);
+    check("stale cache compiled again", strstr(before, "version 1") != NULL && strstr(after, "version 2") != NULL);
+    free(before);
+    free(after);
+    remove("src/test/cache_edit.yabl");
+    remove("src/test/cache_edit.yablc");
+}
 
 int main(void){
-    system("yabil.exe src/test/case1.yabl");
-}
\ No newline at end of file
+    run_script(YABIL " --no-cache src/test/case1.yabl");
+    // fed to the REPL, which has to leave the line after it to input()
+    run_script(YABIL " < src/test/case2.yabl");
+    run_script(YABIL " --no-cache src/test/fold.yabl");
+    test_fold_pool();
+    test_cache();
+    run_script(YABIL " --no-cache src/test/peephole.yabl");
+    run_script(YABIL " --no-cache --no-peephole src/test/peephole.yabl");
+    run_script(YABIL " --no-cache src/test/shapes.yabl");
+    expect_error("shorter shapes miss the fields of longer ones",
+                 YABIL " --no-cache src/test/shapes_missing.yabl 2>&1", "Undefined property 'k25'");
+    run_script(YABIL " --no-cache src/test/modes.yabl");
+    same_output("registers print what the interpreter prints", "--registers", "src/test/modes.yabl");
+    same_output("registers report errors like the interpreter", "--registers", "src/test/modes_error.yabl");
+    // a threshold of one compiles every function on its first call
+    same_output("jit prints what the interpreter prints", "--jit --jit-threshold=1", "src/test/modes.yabl");
+    same_output("jit reports errors like the interpreter", "--jit --jit-threshold=1", "src/test/modes_error.yabl");
+    same_output("jit after warming up prints what the interpreter prints", "--jit", "src/test/modes.yabl");
+    run_script(YABIL " --no-cache src/test/fibers.yabl");
+    expect_error("errors unwind nested fibers", YABIL " --no-cache src/test/fibers_error.yabl 2>&1", "[line 3] in mid()");
+    expect_error("finished fibers can't be resumed",
+                 YABIL " --no-cache src/test/fibers_finished.yabl 2>&1", "Can't resume a fiber that finished");
+    run_script(YABIL " --no-cache src/test/workers.yabl");
+    expect_error("errors in a worker fail its join", YABIL " --no-cache src/test/workers_failed.yabl 2>&1", "join: worker 1 failed");
+    expect_error("fibers stay on their VM",
+                 YABIL " --no-cache src/test/workers_fiber.yabl 2>&1", "spawn: the value holds a fiber");
+    run_script(YABIL " --no-cache src/test/deep.yabl");
+    run_script(YABIL " --no-cache src/test/deep_limit.yabl");
+    expect_error("--max-frames stops deeper calls",
+                 YABIL " --no-cache --max-frames=1000 src/test/deep_limit.yabl 2>&1", "Stack overflow error");
+    expect_error("--max-stack stops a deeper stack",
+                 YABIL " --no-cache --max-stack=4K src/test/deep_limit.yabl 2>&1", "Stack overflow error");
+    expect_error("unbounded recursion stops at the default limit",
+                 YABIL " --no-cache src/test/deep_unbounded.yabl 2>&1", "Stack overflow error");
+    if (failures > 0) printf("%d checks failed\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,470 @@
+// Reads a heap snapshot written by yabil --heap-snapshot=FILE or heap_snapshot(path),
+// builds the dominator tree of the object graph and prints what retains the most memory.
+//   heapstat [--top=N] snapshot
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../core/snapshot.h"
+
+static const char* root_kinds[] = {"stack", "frame", "upvalue", "global"};
+
+typedef struct {
+    uint8_t type;
+    uint32_t size;
+    char* label;
+    uint32_t* edges;
+    uint32_t edge_count;
+} Node;
+
+typedef struct {
+    uint8_t kind;
+    char* label;
+    uint32_t id;
+} Root;
+
+typedef struct {
+    char* name;                       // class name for instances, (type) for everything else
+    size_t count;
+    size_t shallow;
+    size_t retained;                  // retained by members no other member dominates
+} Group;
+
+typedef struct {
+    char* type_names[256];
+    Root* roots;
+    uint32_t root_count;
+    Node* nodes;
+    uint32_t count;                   // objects, the virtual root all roots hang off is nodes[count]
+    // dominator tree
+    uint32_t* order;                  // reverse postorder from the virtual root
+    uint32_t* order_index;
+    uint32_t* idom;
+    uint64_t* retained;
+    uint32_t* group;
+    Group* groups;
+    uint32_t group_count;
+} Heap;
+
+static FILE* in;
+static const char* in_path;
+
+static void* allocate(size_t size){
+    void* pointer = malloc(size == 0 ? 1 : size);
+    if (pointer == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+static void read_bytes(void* data, size_t size){
+    if (fread(data, 1, size, in) != size){
+        fprintf(stderr, "Truncated heap snapshot [%s]\n", in_path);
+        exit(65);
+    }
+}
+
+static uint8_t read_u8(){
+    uint8_t value;
+    read_bytes(&value, 1);
+    return value;
+}
+
+static uint16_t read_u16(){
+    uint16_t value;
+    read_bytes(&value, 2);
+    return value;
+}
+
+static uint32_t read_u32(){
+    uint32_t value;
+    read_bytes(&value, 4);
+    return value;
+}
+
+static char* read_string(size_t length){
+    char* string = (char*)allocate(length + 1);
+    read_bytes(string, length);
+    string[length] = '\0';
+    return string;
+}
+
+static void read_snapshot(Heap* heap){
+    char magic[4];
+    read_bytes(magic, 4);
+    if (memcmp(magic, SNAPSHOT_MAGIC, 4) != 0){
+        fprintf(stderr, "Not a heap snapshot [%s]\n", in_path);
+        exit(65);
+    }
+    uint8_t type_count = read_u8();
+    for (int i = 0; i < 256; i++) heap->type_names[i] = "?";
+    for (int i = 0; i < type_count; i++) heap->type_names[i] = read_string(read_u8());
+
+    heap->root_count = read_u32();
+    heap->roots = (Root*)allocate(sizeof(Root) * heap->root_count);
+    for (uint32_t i = 0; i < heap->root_count; i++){
+        heap->roots[i].kind = read_u8();
+        heap->roots[i].label = read_string(read_u16());
+        heap->roots[i].id = read_u32();
+    }
+
+    size_t cap = 1024;
+    heap->nodes = (Node*)allocate(sizeof(Node) * cap);
+    heap->count = 0;
+    for (;;){
+        uint8_t type = read_u8();
+        if (type == SNAPSHOT_END) break;
+        if (heap->count + 2 > cap){
+            cap *= 2;
+            heap->nodes = (Node*)realloc(heap->nodes, sizeof(Node) * cap);
+            if (heap->nodes == NULL){
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        Node* node = &heap->nodes[heap->count++];
+        node->type = type;
+        node->size = read_u32();
+        node->label = read_string(read_u16());
+        node->edge_count = read_u32();
+        node->edges = (uint32_t*)allocate(sizeof(uint32_t) * node->edge_count);
+        read_bytes(node->edges, sizeof(uint32_t) * node->edge_count);
+    }
+
+    // the virtual root points at every root object
+    Node* top = &heap->nodes[heap->count];
+    top->type = SNAPSHOT_END;
+    top->size = 0;
+    top->label = "";
+    top->edge_count = heap->root_count;
+    top->edges = (uint32_t*)allocate(sizeof(uint32_t) * heap->root_count);
+    for (uint32_t i = 0; i < heap->root_count; i++){
+        if (heap->roots[i].id >= heap->count){
+            fprintf(stderr, "Broken heap snapshot [%s]\n", in_path);
+            exit(65);
+        }
+        top->edges[i] = heap->roots[i].id;
+    }
+    for (uint32_t i = 0; i < heap->count; i++){
+        for (uint32_t j = 0; j < heap->nodes[i].edge_count; j++){
+            if (heap->nodes[i].edges[j] >= heap->count){
+                fprintf(stderr, "Broken heap snapshot [%s]\n", in_path);
+                exit(65);
+            }
+        }
+    }
+}
+
+// iterative depth first search, so long linked structures don't overflow the C stack
+static void number_nodes(Heap* heap){
+    uint32_t total = heap->count + 1;
+    heap->order = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    heap->order_index = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t* stack = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t* next_edge = (uint32_t*)calloc(total, sizeof(uint32_t));
+    char* seen = (char*)calloc(total, 1);
+    if (next_edge == NULL || seen == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    uint32_t post = 0;
+    uint32_t depth = 0;
+    stack[depth++] = heap->count;
+    seen[heap->count] = 1;
+    while (depth > 0){
+        uint32_t node = stack[depth - 1];
+        if (next_edge[node] < heap->nodes[node].edge_count){
+            uint32_t child = heap->nodes[node].edges[next_edge[node]++];
+            if (!seen[child]){
+                seen[child] = 1;
+                stack[depth++] = child;
+            }
+        } else {
+            heap->order[post++] = node;
+            depth--;
+        }
+    }
+    // reverse the postorder, every object in a snapshot is reachable so all of them got a number
+    for (uint32_t i = 0; i < post / 2; i++){
+        uint32_t swap = heap->order[i];
+        heap->order[i] = heap->order[post - 1 - i];
+        heap->order[post - 1 - i] = swap;
+    }
+    for (uint32_t i = 0; i < post; i++) heap->order_index[heap->order[i]] = i;
+    free(stack);
+    free(next_edge);
+    free(seen);
+}
+
+static uint32_t intersect(Heap* heap, uint32_t a, uint32_t b){
+    while (a != b){
+        while (heap->order_index[a] > heap->order_index[b]) a = heap->idom[a];
+        while (heap->order_index[b] > heap->order_index[a]) b = heap->idom[b];
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm over the predecessors of every node
+static void find_dominators(Heap* heap){
+    uint32_t total = heap->count + 1;
+    uint32_t* pred_start = (uint32_t*)calloc(total + 1, sizeof(uint32_t));
+    if (pred_start == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < total; i++){
+        for (uint32_t j = 0; j < heap->nodes[i].edge_count; j++) pred_start[heap->nodes[i].edges[j] + 1]++;
+    }
+    for (uint32_t i = 0; i < total; i++) pred_start[i + 1] += pred_start[i];
+    uint32_t* preds = (uint32_t*)allocate(sizeof(uint32_t) * pred_start[total]);
+    uint32_t* fill = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    memcpy(fill, pred_start, sizeof(uint32_t) * total);
+    for (uint32_t i = 0; i < total; i++){
+        for (uint32_t j = 0; j < heap->nodes[i].edge_count; j++) preds[fill[heap->nodes[i].edges[j]]++] = i;
+    }
+
+    const uint32_t undefined = UINT32_MAX;
+    heap->idom = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    for (uint32_t i = 0; i < total; i++) heap->idom[i] = undefined;
+    heap->idom[heap->count] = heap->count;
+    for (int changed = 1; changed;){
+        changed = 0;
+        for (uint32_t i = 1; i < total; i++){
+            uint32_t node = heap->order[i];
+            uint32_t dominator = undefined;
+            for (uint32_t j = pred_start[node]; j < pred_start[node + 1]; j++){
+                uint32_t pred = preds[j];
+                if (heap->idom[pred] == undefined) continue;
+                dominator = dominator == undefined ? pred : intersect(heap, pred, dominator);
+            }
+            if (heap->idom[node] != dominator){
+                heap->idom[node] = dominator;
+                changed = 1;
+            }
+        }
+    }
+
+    // dominators come before what they dominate in reverse postorder
+    heap->retained = (uint64_t*)allocate(sizeof(uint64_t) * total);
+    for (uint32_t i = 0; i < total; i++) heap->retained[i] = heap->nodes[i].size;
+    for (uint32_t i = total - 1; i > 0; i--){
+        uint32_t node = heap->order[i];
+        heap->retained[heap->idom[node]] += heap->retained[node];
+    }
+    free(pred_start);
+    free(preds);
+    free(fill);
+}
+
+static uint32_t group_of(Heap* heap, Node* node, size_t* cap){
+    char name[SNAPSHOT_LABEL_MAX + 32];
+    if (strcmp(heap->type_names[node->type], "instance") == 0){
+        snprintf(name, sizeof(name), "%s", node->label);
+    } else {
+        snprintf(name, sizeof(name), "(%s)", heap->type_names[node->type]);
+    }
+    for (uint32_t i = 0; i < heap->group_count; i++){
+        if (strcmp(heap->groups[i].name, name) == 0) return i;
+    }
+    if (heap->group_count + 1 > *cap){
+        *cap = *cap < 16 ? 16 : *cap * 2;
+        heap->groups = (Group*)realloc(heap->groups, sizeof(Group) * *cap);
+        if (heap->groups == NULL){
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    Group* group = &heap->groups[heap->group_count];
+    group->name = (char*)allocate(strlen(name) + 1);
+    strcpy(group->name, name);
+    group->count = group->shallow = group->retained = 0;
+    return heap->group_count++;
+}
+
+// an object adds its retained size to its group unless a dominator of it is in the same
+// group, which already counted it. Walks the dominator tree keeping count of the groups above
+static void group_nodes(Heap* heap){
+    uint32_t total = heap->count + 1;
+    size_t cap = 0;
+    heap->groups = NULL;
+    heap->group_count = 0;
+    heap->group = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t last_type = UINT32_MAX, last_group = 0;
+    const char* last_label = NULL;
+    for (uint32_t i = 0; i < heap->count; i++){
+        Node* node = &heap->nodes[i];
+        // runs of objects of the same kind are common, skip the lookup for them
+        if (node->type != last_type || last_label == NULL || strcmp(node->label, last_label) != 0){
+            last_group = group_of(heap, node, &cap);
+            last_type = node->type;
+            last_label = node->label;
+        }
+        heap->group[i] = last_group;
+        heap->groups[last_group].count++;
+        heap->groups[last_group].shallow += node->size;
+    }
+
+    uint32_t* child_start = (uint32_t*)calloc(total + 1, sizeof(uint32_t));
+    uint32_t* children = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t* above = (uint32_t*)calloc(heap->group_count + 1, sizeof(uint32_t));
+    uint32_t* stack = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t* next_child = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    if (child_start == NULL || above == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < heap->count; i++) child_start[heap->idom[i] + 1]++;
+    for (uint32_t i = 0; i < total; i++) child_start[i + 1] += child_start[i];
+    memcpy(next_child, child_start, sizeof(uint32_t) * total);
+    for (uint32_t i = 0; i < heap->count; i++) children[next_child[heap->idom[i]]++] = i;
+    memcpy(next_child, child_start, sizeof(uint32_t) * total);
+
+    uint32_t depth = 0;
+    stack[depth++] = heap->count;
+    while (depth > 0){
+        uint32_t node = stack[depth - 1];
+        if (next_child[node] < child_start[node + 1]){
+            uint32_t child = children[next_child[node]++];
+            Group* group = &heap->groups[heap->group[child]];
+            if (above[heap->group[child]]++ == 0) group->retained += heap->retained[child];
+            stack[depth++] = child;
+        } else {
+            if (node != heap->count) above[heap->group[node]]--;
+            depth--;
+        }
+    }
+    free(child_start);
+    free(children);
+    free(above);
+    free(stack);
+    free(next_child);
+}
+
+static int by_retained(const void* a, const void* b){
+    const Group* x = (const Group*)a;
+    const Group* y = (const Group*)b;
+    return x->retained < y->retained ? 1 : x->retained > y->retained ? -1 : 0;
+}
+
+static void print_node(Heap* heap, uint32_t id){
+    Node* node = &heap->nodes[id];
+    printf("%s", heap->type_names[node->type]);
+    if (node->label[0] != '\0') printf(" %s", node->label);
+}
+
+// shortest path from a root, found breadth first
+static void print_path(Heap* heap, uint32_t target, uint32_t* parent, uint32_t* root_of){
+    uint32_t path[8];
+    uint32_t length = 0;
+    uint32_t hops = 0;
+    for (uint32_t node = target; node != heap->count; node = parent[node]){
+        if (length < 8) path[length++] = node;
+        hops++;
+    }
+    Root* root = &heap->roots[root_of[target]];
+    printf("%s", root->kind < 4 ? root_kinds[root->kind] : "?");
+    if (root->label[0] != '\0') printf(" '%s'", root->label);
+    if (hops > length) printf(" -> ... %u more", hops - length);
+    for (uint32_t i = length; i > 0; i--){
+        printf(" -> ");
+        print_node(heap, path[i - 1]);
+    }
+    printf("\n");
+}
+
+static void print_top(Heap* heap, uint32_t top){
+    uint32_t total = heap->count + 1;
+    uint32_t* parent = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t* root_of = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    uint32_t* queue = (uint32_t*)allocate(sizeof(uint32_t) * total);
+    char* seen = (char*)calloc(total, 1);
+    if (seen == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    uint32_t head = 0, tail = 0;
+    for (uint32_t i = 0; i < heap->root_count; i++){
+        uint32_t id = heap->roots[i].id;
+        if (seen[id]) continue;
+        seen[id] = 1;
+        parent[id] = heap->count;
+        root_of[id] = i;
+        queue[tail++] = id;
+    }
+    while (head < tail){
+        uint32_t node = queue[head++];
+        for (uint32_t j = 0; j < heap->nodes[node].edge_count; j++){
+            uint32_t child = heap->nodes[node].edges[j];
+            if (seen[child]) continue;
+            seen[child] = 1;
+            parent[child] = node;
+            root_of[child] = root_of[node];
+            queue[tail++] = child;
+        }
+    }
+
+    // selection of the largest few, top is small
+    char* picked = (char*)calloc(total, 1);
+    if (picked == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    printf("\n%12s  %s\n", "retained", "object and its shortest path from a root");
+    for (uint32_t n = 0; n < top && n < heap->count; n++){
+        uint32_t best = UINT32_MAX;
+        for (uint32_t i = 0; i < heap->count; i++){
+            if (picked[i]) continue;
+            if (best == UINT32_MAX || heap->retained[i] > heap->retained[best]) best = i;
+        }
+        picked[best] = 1;
+        printf("%12llu  ", (unsigned long long)heap->retained[best]);
+        print_path(heap, best, parent, root_of);
+    }
+    free(parent);
+    free(root_of);
+    free(queue);
+    free(seen);
+    free(picked);
+}
+
+static void usage(){
+    fprintf(stderr, "Usage: heapstat [--top=N] snapshot\n");
+    fprintf(stderr, "  --top=N   objects with the largest retained size to list (default 10)\n");
+    exit(64);
+}
+
+int main(int argc, const char** argv){
+    uint32_t top = 10;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strncmp(argv[i], "--top=", 6) == 0) top = atoi(argv[i] + 6);
+        else if (argv[i][0] == '-' || path != NULL) usage();
+        else path = argv[i];
+    }
+    if (path == NULL) usage();
+    in_path = path;
+    in = fopen(path, "rb");
+    if (in == NULL){
+        fprintf(stderr, "Could not open file [%s]\n", path);
+        return 74;
+    }
+
+    Heap heap;
+    read_snapshot(&heap);
+    fclose(in);
+    number_nodes(&heap);
+    find_dominators(&heap);
+    group_nodes(&heap);
+
+    printf("%u objects, %llu bytes reachable from %u roots\n\n", heap.count,
+           (unsigned long long)heap.retained[heap.count], heap.root_count);
+    printf("%12s %12s %10s  %s\n", "retained", "shallow", "count", "class");
+    qsort(heap.groups, heap.group_count, sizeof(Group), by_retained);
+    for (uint32_t i = 0; i < heap.group_count; i++){
+        Group* group = &heap.groups[i];
+        printf("%12zu %12zu %10zu  %s\n", group->retained, group->shallow, group->count, group->name);
+    }
+    print_top(&heap, top);
+    return 0;
+}